@@ -0,0 +1,77 @@
+#define _XOPEN_SOURCE 700
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "chip8.h"
+
+// Runs ROMs that chip8-aotc translated to C and that were linked into the program. A translation is only
+// good while the bytes it was made from are in memory and the instance has the quirk profile it was made
+// for; any write over a translated byte makes the instance fall back to the interpreter until a reset or
+// a loaded state puts the original bytes back.
+
+#define AOT_MAX_ROMS 16
+
+static const CHIP8AOT *roms[AOT_MAX_ROMS];
+static int rom_count;
+
+// Called by the constructor in each generated file, before main.
+void chip8_aot_register(const CHIP8AOT *aot) {
+    if (rom_count == AOT_MAX_ROMS) {
+        fprintf(stderr, "Too many compiled ROMs, ignoring %s\n", aot->name);
+        return;
+    }
+    roms[rom_count++] = aot;
+}
+
+static int matches(const CHIP8AOT *aot, const CHIP8OBJECT *chip8) {
+    int i;
+
+    if (aot->quirks != chip8->quirks)
+        return 0;
+    for (i = 0; i < MEMORY_SIZE; ++i) {
+        if ((aot->code[i >> 3] >> (i & 7) & 1) && chip8->mem[i] != aot->image[i])
+            return 0;
+    }
+    return 1;
+}
+
+// Returns the compiled ROM whose translated bytes are all in the instance's memory as they are now, or NULL.
+const CHIP8AOT *chip8_aot_find(const CHIP8OBJECT *chip8) {
+    int i;
+
+    for (i = 0; i < rom_count; ++i) {
+        if (matches(roms[i], chip8))
+            return roms[i];
+    }
+    return NULL;
+}
+
+// Checks again whether the translation still matches, after memory or the quirk profile changed wholesale.
+void chip8_aot_validate(CHIP8OBJECT *chip8) {
+    chip8->aot_valid = chip8->aot && matches(chip8->aot, chip8);
+}
+
+/**
+ * Runs count instructions, none of them past a timer tick, like chip8_jit_run. The translated code runs
+ * as long as it can and stops exactly where the budget runs out; where it stops early (an address it has
+ * no code for, a write over translated code) one instruction is interpreted and the translated code gets
+ * another go from there.
+ */
+void chip8_aot_run(CHIP8OBJECT *chip8, uint32_t count) {
+    uint64_t budget = count, remaining, start = chip8->instructions;
+
+    while (budget) {
+        chip8->instructions = start + count - budget;
+        remaining = chip8->aot_valid ? chip8->aot->run(chip8, budget) : budget;
+        if (remaining == budget) {
+            chip8->instructions = start + count - budget;
+            chip8_execute_instruction(chip8);
+            --budget;
+        }
+        else {
+            budget = remaining;
+        }
+    }
+}
@@ -0,0 +1,430 @@
+#define _XOPEN_SOURCE 700
+
+#include <ctype.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "chip8.h"
+
+// Ahead-of-time compiler: translates a ROM into a C file that links into the emulator (make aot ROM=file)
+// and runs with -A. The code reachable from 0x200 is found by following every jump, call and skip, decoded
+// with the same chip8_decode as the interpreter, and cut into basic blocks. Each instruction becomes a label
+// in one function that keeps the registers in locals, so the C compiler sees whole loops with constant
+// register numbers. Each block is written twice. The first copy takes the whole block from the budget at
+// once and runs it straight through; when less than the block is left it hands over to the second, where
+// every instruction takes one from the budget first and stops there once it is spent, so a run ends
+// exactly at the timer tick. The next run picks up at that instruction through a switch over the
+// translated addresses, the same switch that targets known only at run time (00EE, BNNN) go through.
+// Anything the walk did not reach is left to the interpreter, as is everything after a write over
+// translated bytes.
+
+enum {
+    AOT_REACHED = 1,
+    AOT_LEADER = 2
+};
+
+static uint8_t flags[MEMORY_SIZE];
+static uint16_t worklist[MEMORY_SIZE];
+static int worklist_size;
+
+// Marks address as the start of a block and queues it if the walk has not been there yet.
+static void lead(uint16_t address) {
+    if (address > MEMORY_SIZE - 2)
+        return;
+    flags[address] |= AOT_LEADER;
+    if (!(flags[address] & AOT_REACHED) && worklist_size < MEMORY_SIZE)
+        worklist[worklist_size++] = address;
+}
+
+static int is_skip(uint8_t op) {
+    return op == CHIP8_OP_3XNN || op == CHIP8_OP_4XNN || op == CHIP8_OP_5XY0 || op == CHIP8_OP_9XY0 ||
+           op == CHIP8_OP_EX9E || op == CHIP8_OP_EXA1;
+}
+
+// Instructions after which execution does not simply go on with the next one.
+static int ends_block(uint8_t op) {
+    return op == CHIP8_OP_1NNN || op == CHIP8_OP_2NNN || op == CHIP8_OP_00EE || op == CHIP8_OP_BNNN ||
+           op == CHIP8_OP_FX0A || is_skip(op);
+}
+
+// Follows the control flow from 0x200 and marks every instruction reached and every block start.
+static void walk(CHIP8OBJECT *chip8) {
+    const CHIP8DECODED *op;
+    uint16_t address;
+
+    lead(0x200);
+    while (worklist_size) {
+        address = worklist[--worklist_size];
+        while (address <= MEMORY_SIZE - 2 && !(flags[address] & AOT_REACHED)) {
+            flags[address] |= AOT_REACHED;
+            op = chip8_decode(chip8, address);
+            if (op->op == CHIP8_OP_1NNN) {
+                lead(op->NNN);
+            }
+            else if (op->op == CHIP8_OP_2NNN) {
+                lead(op->NNN);
+                lead(address + 2);
+            }
+            else if (is_skip(op->op)) {
+                lead(address + 2);
+                lead(address + 4);
+            }
+            else if (op->op == CHIP8_OP_FX0A) {
+                lead(address);
+                lead(address + 2);
+            }
+            if (ends_block(op->op))
+                break;
+            address += 2;
+        }
+    }
+}
+
+static int is_block(uint32_t address) {
+    return address <= MEMORY_SIZE - 2 && (flags[address] & (AOT_REACHED | AOT_LEADER)) == (AOT_REACHED | AOT_LEADER);
+}
+
+// Number of instructions in the block at start.
+static int block_length(const CHIP8OBJECT *chip8, uint32_t start) {
+    uint32_t address = start;
+    int length = 0;
+
+    while (address <= MEMORY_SIZE - 2 && (flags[address] & AOT_REACHED) &&
+           (address == start || !(flags[address] & AOT_LEADER))) {
+        ++length;
+        if (ends_block(chip8->decoded[address].op))
+            break;
+        address += 2;
+    }
+    return length;
+}
+
+// Continues at a known address: straight into its block, or out to the interpreter if it has none.
+static void emit_goto(FILE *out, uint32_t address) {
+    if (is_block(address))
+        fprintf(out, "goto op_%03x;\n", address);
+    else
+        fprintf(out, "{ pc = 0x%03x; goto out; }\n", address);
+}
+
+// Leaves the block right after an instruction that wrote memory, if the write hit translated code, and
+// gives back what was taken from the budget for the rest of the block.
+static void emit_write_check(FILE *out, uint32_t next, int charged) {
+    if (charged > 1)
+        fprintf(out, "    if (!chip8->aot_valid) { budget += %d; pc = 0x%03x; goto out; }\n", charged - 1, next);
+    else
+        fprintf(out, "    if (!chip8->aot_valid) { pc = 0x%03x; goto out; }\n", next);
+}
+
+// Charged is how many instructions, this one and those after it in the block, are already off the budget.
+static void emit_instruction(FILE *out, const CHIP8DECODED *op, uint32_t address, int quirks, int charged) {
+    uint32_t next = address + 2;
+    int x = op->X, y = op->Y, i;
+
+    switch (op->op) {
+        case CHIP8_OP_00E0:
+            fprintf(out, "    chip8_clear_frame(chip8);\n");
+            break;
+        case CHIP8_OP_00EE:
+            fprintf(out, "    sp = (sp - 1) & STACK_MASK;\n    pc = chip8->stack[sp];\n    goto dispatch;\n");
+            break;
+        case CHIP8_OP_1NNN:
+            fprintf(out, "    ");
+            emit_goto(out, op->NNN);
+            break;
+        case CHIP8_OP_2NNN:
+            fprintf(out, "    chip8->stack[sp] = 0x%03x;\n    sp = (sp + 1) & STACK_MASK;\n    ", next);
+            emit_goto(out, op->NNN);
+            break;
+        case CHIP8_OP_3XNN:
+        case CHIP8_OP_4XNN:
+            fprintf(out, "    if (V[%d] %s 0x%02x) ", x, op->op == CHIP8_OP_3XNN ? "==" : "!=", op->NN);
+            emit_goto(out, next + 2);
+            fprintf(out, "    ");
+            emit_goto(out, next);
+            break;
+        case CHIP8_OP_5XY0:
+        case CHIP8_OP_9XY0:
+            fprintf(out, "    if (V[%d] %s V[%d]) ", x, op->op == CHIP8_OP_5XY0 ? "==" : "!=", y);
+            emit_goto(out, next + 2);
+            fprintf(out, "    ");
+            emit_goto(out, next);
+            break;
+        case CHIP8_OP_6XNN:
+            fprintf(out, "    V[%d] = 0x%02x;\n", x, op->NN);
+            break;
+        case CHIP8_OP_7XNN:
+            fprintf(out, "    V[%d] += 0x%02x;\n", x, op->NN);
+            break;
+        case CHIP8_OP_8XY0:
+            fprintf(out, "    V[%d] = V[%d];\n", x, y);
+            break;
+        case CHIP8_OP_8XY1:
+        case CHIP8_OP_8XY2:
+        case CHIP8_OP_8XY3:
+            fprintf(out, "    V[%d] %c= V[%d];\n", x,
+                    op->op == CHIP8_OP_8XY1 ? '|' : op->op == CHIP8_OP_8XY2 ? '&' : '^', y);
+            if (quirks & CHIP8_QUIRK_VF_RESET)
+                fprintf(out, "    V[15] = 0;\n");
+            break;
+        // VF is written before VX, as in the other engines, so that X == F ends up holding the result.
+        case CHIP8_OP_8XY4:
+            fprintf(out, "    t = V[%d] + V[%d] > 0xFF;\n    V[15] = t;\n    V[%d] += V[%d];\n", x, y, x, y);
+            break;
+        case CHIP8_OP_8XY5:
+            fprintf(out, "    t = V[%d] >= V[%d];\n    V[15] = t;\n    V[%d] -= V[%d];\n", x, y, x, y);
+            break;
+        case CHIP8_OP_8XY7:
+            fprintf(out, "    t = V[%d] >= V[%d];\n    V[15] = t;\n    V[%d] = V[%d] - V[%d];\n", y, x, x, y, x);
+            break;
+        case CHIP8_OP_8XY6:
+        case CHIP8_OP_8XYE:
+            if (quirks & CHIP8_QUIRK_SHIFT_VY)
+                fprintf(out, "    V[%d] = V[%d];\n", x, y);
+            if (op->op == CHIP8_OP_8XY6)
+                fprintf(out, "    V[15] = V[%d] & 0x1;\n    V[%d] >>= 1;\n", x, x);
+            else
+                fprintf(out, "    V[15] = (V[%d] & 0x80) == 0x80;\n    V[%d] <<= 1;\n", x, x);
+            break;
+        case CHIP8_OP_ANNN:
+            fprintf(out, "    I = 0x%03x;\n", op->NNN);
+            break;
+        case CHIP8_OP_BNNN:
+            fprintf(out, "    pc = 0x%03x + V[%d];\n    goto dispatch;\n", op->NNN,
+                    quirks & CHIP8_QUIRK_JUMP_VX ? x : 0);
+            break;
+        case CHIP8_OP_CXNN:
+            fprintf(out, "    V[%d] = chip8_random(chip8) & 0x%02x;\n", x, op->NN);
+            break;
+        case CHIP8_OP_DXYN:
+            fprintf(out, "    V[15] = chip8_draw_sprite(chip8, I, V[%d], V[%d], %d);\n", x, y, op->NN & 0xF);
+            break;
+        case CHIP8_OP_EX9E:
+        case CHIP8_OP_EXA1:
+            fprintf(out, "    if (%schip8->buttons[V[%d] & 0xF]) ", op->op == CHIP8_OP_EX9E ? "" : "!", x);
+            emit_goto(out, next + 2);
+            fprintf(out, "    ");
+            emit_goto(out, next);
+            break;
+        case CHIP8_OP_FX07:
+            fprintf(out, "    V[%d] = chip8->delay_timer;\n", x);
+            break;
+        case CHIP8_OP_FX0A:
+            fprintf(out, "    for (i = 0; i < 16 && !chip8->buttons[i]; ++i) {\n    }\n    if (i == 16) ");
+            emit_goto(out, address);
+            fprintf(out, "    V[%d] = chip8->buttons[i];\n    ", x);
+            emit_goto(out, next);
+            break;
+        case CHIP8_OP_FX15:
+            fprintf(out, "    chip8->delay_timer = V[%d];\n", x);
+            break;
+        case CHIP8_OP_FX18:
+            // The beeper needs to know exactly which instruction set the sound timer.
+            fprintf(out, "    chip8->instructions = end - budget - %d;\n", charged);
+            fprintf(out, "    chip8_register_write(chip8, CHIP8_REG_SOUND, V[%d]);\n", x);
+            break;
+        case CHIP8_OP_FX1E:
+            fprintf(out, "    I += V[%d];\n", x);
+            break;
+        case CHIP8_OP_FX29:
+            fprintf(out, "    I = 5 * (V[%d] & 0xF);\n", x);
+            break;
+        case CHIP8_OP_FX33:
+            fprintf(out, "    chip8_mem_write(chip8, I, V[%d] / 100);\n", x);
+            fprintf(out, "    chip8_mem_write(chip8, I + 1, V[%d] / 10 %% 10);\n", x);
+            fprintf(out, "    chip8_mem_write(chip8, I + 2, V[%d] %% 10);\n", x);
+            emit_write_check(out, next, charged);
+            break;
+        case CHIP8_OP_FX55:
+        case CHIP8_OP_FX65:
+            for (i = 0; i <= x; ++i) {
+                if (op->op == CHIP8_OP_FX55)
+                    fprintf(out, "    chip8_mem_write(chip8, I + %d, V[%d]);\n", i, i);
+                else
+                    fprintf(out, "    V[%d] = chip8_mem_read(chip8, I + %d);\n", i, i);
+            }
+            if (quirks & CHIP8_QUIRK_LOAD_X1)
+                fprintf(out, "    I += %d;\n", x + 1);
+            if ((quirks & CHIP8_QUIRK_LOAD_X) && x)
+                fprintf(out, "    I += %d;\n", x);
+            if (op->op == CHIP8_OP_FX55)
+                emit_write_check(out, next, charged);
+            break;
+        default:
+            // Not part of the instruction set (including 0NNN): does nothing.
+            break;
+    }
+}
+
+/**
+ * Writes one copy of the block at start. The whole copy, entered at op_ and used when the budget covers
+ * the block, charges it up front; the stepping copy, whose labels are step_, charges each instruction on
+ * its own. A block of one instruction only needs the stepping copy, under the op_ label.
+ */
+static void emit_block(FILE *out, const CHIP8OBJECT *chip8, uint32_t start, int length, int quirks, int whole) {
+    const CHIP8DECODED *op = NULL;
+    uint32_t address;
+    int index;
+
+    fprintf(out, "\n");
+    if (whole)
+        fprintf(out, "op_%03x:\n    if (budget < %d)\n        goto step_%03x;\n    budget -= %d;\n", start, length,
+                start, length);
+    for (address = start, index = 0; index < length; address += 2, ++index) {
+        op = &chip8->decoded[address];
+        if (!whole)
+            fprintf(out, "%s_%03x:\n    STEP(0x%03x);\n", length > 1 ? "step" : "op", address, address);
+        fprintf(out, "    // %03x: %02x%02x\n", address, chip8->mem[address], chip8->mem[address + 1]);
+        emit_instruction(out, op, address, quirks, whole ? length - index : 1);
+    }
+    if (!ends_block(op->op)) {
+        fprintf(out, "    ");
+        emit_goto(out, address);
+    }
+}
+
+static void emit_bytes(FILE *out, const char *name, const uint8_t *bytes, int count) {
+    int i;
+
+    fprintf(out, "static const uint8_t %s[%d] = {", name, count);
+    for (i = 0; i < count; ++i) {
+        fprintf(out, "%s0x%02x%s", i % 16 ? " " : "\n    ", bytes[i], i + 1 < count ? "," : "");
+    }
+    fprintf(out, "\n};\n\n");
+}
+
+/**
+ * Writes the translation: the memory image and the map of translated bytes that chip8-aot.c checks before
+ * running it, then the run function with two copies of each block, then the descriptor and the constructor
+ * that registers it. Returns the number of blocks.
+ */
+static int emit(FILE *out, const CHIP8OBJECT *chip8, const char *name, int profile) {
+    uint8_t code[MEMORY_SIZE / 8] = {0};
+    uint32_t start, address;
+    int quirks = CHIP8_QUIRKS(profile), blocks = 0, dynamic = 0, length;
+
+    for (address = 0; address <= MEMORY_SIZE - 2; ++address) {
+        if (flags[address] & AOT_REACHED) {
+            code[address >> 3] |= 1 << (address & 7);
+            code[(address + 1) >> 3] |= 1 << ((address + 1) & 7);
+            if (chip8->decoded[address].op == CHIP8_OP_00EE || chip8->decoded[address].op == CHIP8_OP_BNNN)
+                dynamic = 1;
+        }
+    }
+
+    fprintf(out, "// Translated from %s by chip8-aotc for the %s quirk profile. Do not edit.\n\n", name,
+            chip8_quirks_name(profile));
+    fprintf(out, "#include <stdint.h>\n#include <string.h>\n\n#include \"chip8.h\"\n\n");
+    emit_bytes(out, "image", chip8->mem, MEMORY_SIZE);
+    emit_bytes(out, "code", code, MEMORY_SIZE / 8);
+
+    fprintf(out, "// Takes the instruction at address from the budget, or stops in front of it if nothing is left.\n");
+    fprintf(out, "#define STEP(address)             \\\n");
+    fprintf(out, "    do {                          \\\n");
+    fprintf(out, "        if (!budget) {            \\\n");
+    fprintf(out, "            pc = (address);       \\\n");
+    fprintf(out, "            goto out;             \\\n");
+    fprintf(out, "        }                         \\\n");
+    fprintf(out, "        --budget;                 \\\n");
+    fprintf(out, "    } while (0)\n\n");
+
+    fprintf(out, "static uint64_t run(CHIP8OBJECT *chip8, uint64_t budget) {\n");
+    fprintf(out, "    uint64_t end = chip8->instructions + budget;\n");
+    fprintf(out, "    uint16_t pc = chip8->program_counter, I = chip8->I;\n");
+    fprintf(out, "    uint8_t V[16], sp = chip8->stack_pointer, t;\n");
+    fprintf(out, "    int i;\n\n");
+    fprintf(out, "    (void) end;\n    (void) t;\n    (void) i;\n");
+    fprintf(out, "    memcpy(V, chip8->V, sizeof(V));\n\n");
+    // A run may start at any translated instruction; 00EE and BNNN come back here too. Inside a block it
+    // can only be where an earlier run stopped, in the stepping copy.
+    fprintf(out, "%s    switch (pc) {\n", dynamic ? "dispatch:\n" : "");
+    for (address = 0; address <= MEMORY_SIZE - 2; ++address) {
+        if (flags[address] & AOT_REACHED)
+            fprintf(out, "        case 0x%03x:\n            goto %s_%03x;\n", address,
+                    flags[address] & AOT_LEADER ? "op" : "step", address);
+    }
+    fprintf(out, "        default:\n            goto out;\n    }\n");
+
+    for (start = 0; start <= MEMORY_SIZE - 2; ++start) {
+        if (!is_block(start))
+            continue;
+        ++blocks;
+        length = block_length(chip8, start);
+        if (length > 1)
+            emit_block(out, chip8, start, length, quirks, 1);
+        emit_block(out, chip8, start, length, quirks, 0);
+    }
+
+    fprintf(out, "\nout:\n");
+    fprintf(out, "    memcpy(chip8->V, V, sizeof(V));\n");
+    fprintf(out, "    chip8->program_counter = pc;\n    chip8->I = I;\n    chip8->stack_pointer = sp;\n");
+    fprintf(out, "    return budget;\n}\n\n");
+
+    fprintf(out, "static const CHIP8AOT rom = {\"%s\", %d, image, code, run};\n\n", name, profile);
+    fprintf(out, "__attribute__((constructor)) static void register_rom(void) {\n");
+    fprintf(out, "    chip8_aot_register(&rom);\n}\n");
+    return blocks;
+}
+
+int main(int argc, char *argv[]) {
+    const char *rom = NULL, *output = NULL, *base;
+    char name[64];
+    CHIP8OBJECT *chip8;
+    FILE *out;
+    int i, profile = CHIP8_QUIRKS_DEFAULT, blocks, instructions = 0;
+
+    for (i = 1; i < argc; ++i) {
+        if (!strcmp(argv[i], "-q") && i + 1 < argc) {
+            if ((profile = chip8_find_quirks(argv[++i])) < 0) {
+                fprintf(stderr, "Unknown quirk profile %s\n", argv[i]);
+                return 1;
+            }
+        }
+        else if (argv[i][0] != '-' && !rom) {
+            rom = argv[i];
+        }
+        else if (argv[i][0] != '-' && !output) {
+            output = argv[i];
+        }
+        else {
+            rom = NULL;
+            break;
+        }
+    }
+    if (!rom || !output) {
+        printf("Usage: %s [-q profile] romfilename output.c\n", argv[0]);
+        return 1;
+    }
+
+    if (!(chip8 = chip8_create()) || chip8_load_rom(chip8, rom))
+        return 1;
+    chip8_reset(chip8);
+
+    // The name only labels the translation in messages; keep it to characters that need no escaping.
+    base = strrchr(rom, '/') ? strrchr(rom, '/') + 1 : rom;
+    for (i = 0; base[i] && i < (int) sizeof(name) - 1; ++i) {
+        name[i] = isalnum((unsigned char) base[i]) || strchr("._-", base[i]) ? base[i] : '_';
+    }
+    name[i] = '\0';
+
+    walk(chip8);
+
+    if (!(out = fopen(output, "w"))) {
+        fprintf(stderr, "Could not create %s\n", output);
+        return 1;
+    }
+    blocks = emit(out, chip8, name, profile);
+    if (fclose(out)) {
+        fprintf(stderr, "Could not write %s\n", output);
+        return 1;
+    }
+
+    for (i = 0; i < MEMORY_SIZE; ++i) {
+        instructions += flags[i] & AOT_REACHED;
+    }
+    printf("%s: %d instructions in %d blocks\n", output, instructions, blocks);
+    chip8_destroy(chip8);
+    return 0;
+}
@@ -0,0 +1,91 @@
+#define _XOPEN_SOURCE 700
+
+#include <math.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "chip8.h"
+
+// Measures the cost of one audio callback at every buffer size from 16 to 4096 samples, for the wavetable
+// beeper and for the sin() per sample loop fill_audio used to run, both with the tone playing the whole
+// time. Exits non-zero if the beeper is not cheaper at some size.
+
+#define SAMPLE_RATE 44100
+#define BEEP_FREQUENCY 400
+#define BEEP_AMPLITUDE 25000
+
+static double monotonic_seconds(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void reference_fill(const uint8_t *sound_timer, int16_t *buffer, int length) {
+    static double phase = 0.0;
+    double increment = 2.0 * M_PI * BEEP_FREQUENCY / SAMPLE_RATE;
+    int i;
+
+    for (i = 0; i < length; ++i) {
+        if (*sound_timer) {
+            buffer[i] = (int16_t) (BEEP_AMPLITUDE * sin(phase));
+            phase += increment;
+            if (phase >= 2.0 * M_PI)
+                phase -= 2.0 * M_PI;
+        }
+        else {
+            buffer[i] = 0;
+            phase = 0;
+        }
+    }
+}
+
+int main(void) {
+    static int16_t buffer[4096];
+    volatile uint8_t sound_timer = 255;
+    CHIP8AUDIO *audio;
+    double start, reference_ns, wavetable_ns;
+    uint64_t instructions, samples;
+    int32_t checksum = 0;
+    int size, calls, n, failed = 0;
+
+    printf("samples  reference ns/buffer  wavetable ns/buffer  speedup\n");
+    for (size = 16; size <= 4096; size *= 2) {
+        calls = 4000000 / size;
+
+        start = monotonic_seconds();
+        for (n = 0; n < calls; ++n) {
+            reference_fill((const uint8_t *) &sound_timer, buffer, size);
+            checksum += buffer[size - 1];
+        }
+        reference_ns = (monotonic_seconds() - start) * 1e9 / calls;
+
+        // Emulation stays a buffer ahead of the stream like a real 60 Hz loop, and FX18 is repeated well
+        // before each beep (255 frames, 4.25 s) runs out, so the tone never stops.
+        audio = chip8_audio_create(SAMPLE_RATE, size, BEEP_FREQUENCY, BEEP_AMPLITUDE);
+        samples = 0;
+        start = monotonic_seconds();
+        for (n = 0; n < calls; ++n) {
+            samples += size;
+            instructions = samples * INSTRUCTIONS_PER_FRAME * CHIP8_FRAME_RATE / SAMPLE_RATE;
+            if (n % (1 + 65536 / size) == 0)
+                chip8_audio_sound(audio, instructions, INSTRUCTIONS_PER_FRAME, 255);
+            chip8_audio_sync(audio, instructions, INSTRUCTIONS_PER_FRAME);
+            chip8_audio_render(audio, buffer, size);
+            checksum += buffer[size - 1];
+        }
+        wavetable_ns = (monotonic_seconds() - start) * 1e9 / calls;
+        chip8_audio_destroy(audio);
+
+        printf("%7d  %19.0f  %19.0f  %6.2fx\n", size, reference_ns, wavetable_ns, reference_ns / wavetable_ns);
+        if (wavetable_ns >= reference_ns)
+            failed = 1;
+    }
+
+    // Keeps the compiler from dropping the buffers.
+    if (checksum == 0x7fffffff)
+        printf("\n");
+    return failed;
+}
@@ -0,0 +1,153 @@
+#define _XOPEN_SOURCE 700
+
+#include <math.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "chip8.h"
+
+#define WAVETABLE_BITS 10
+#define WAVETABLE_SIZE (1 << WAVETABLE_BITS)
+#define AUDIO_EVENTS 64
+
+// A beep as an interval of emulated time in samples, [start, end). end == start is silence from start on.
+typedef struct {
+    uint64_t start;
+    uint64_t end;
+} CHIP8BEEP;
+
+// The emulation thread is the only writer of head, clock and the events it publishes; the audio thread is
+// the only writer of tail and of everything after it. Each side's fields sit on their own cache line.
+struct CHIP8AUDIO {
+    int16_t wavetable[WAVETABLE_SIZE];
+    uint32_t rate;
+    uint32_t increment;
+    uint32_t latency;
+    CHIP8BEEP events[AUDIO_EVENTS];
+
+    uint64_t head __attribute__((aligned(64)));
+    uint64_t clock;
+    uint64_t overflows;
+
+    uint64_t tail __attribute__((aligned(64)));
+    uint64_t cursor;
+    uint32_t phase;
+    int synced;
+    CHIP8BEEP beep;
+};
+
+// Creates a tone generator for a stream of rate samples per second delivered buffer samples at a time. One
+// period of the tone is precomputed, and the phase accumulator's top bits index it.
+CHIP8AUDIO *chip8_audio_create(uint32_t rate, uint32_t buffer, uint32_t frequency, int16_t amplitude) {
+    CHIP8AUDIO *audio;
+    void *block;
+    int i;
+
+    if (posix_memalign(&block, 64, sizeof(CHIP8AUDIO)))
+        return NULL;
+    audio = memset(block, 0, sizeof(CHIP8AUDIO));
+
+    for (i = 0; i < WAVETABLE_SIZE; ++i) {
+        audio->wavetable[i] = (int16_t) lrint(amplitude * sin(2.0 * M_PI * i / WAVETABLE_SIZE));
+    }
+    audio->rate = rate;
+    audio->increment = (uint32_t) ((double) frequency * 4294967296.0 / rate);
+    // The stream trails emulated time by one buffer plus one frame, so every beep that starts within a
+    // buffer has been published by the time the buffer is rendered.
+    audio->latency = buffer + rate / CHIP8_FRAME_RATE;
+    return audio;
+}
+
+void chip8_audio_destroy(CHIP8AUDIO *audio) {
+    free(audio);
+}
+
+static uint64_t instructions_to_samples(const CHIP8AUDIO *audio, uint64_t instructions, uint32_t frame) {
+    return instructions * audio->rate / ((uint64_t) CHIP8_FRAME_RATE * frame);
+}
+
+/**
+ * Called from the emulation thread by chip8_register_write whenever the sound timer is set, while
+ * chip8->instructions still says how many instructions ran before the FX18. The tone starts at that
+ * instruction's point in emulated time and stops at the timer tick that takes the timer to 0, value frames
+ * later, so the beep is exact to the sample no matter how frames are paced on the host. The beep is
+ * handed over through a single-producer single-consumer ring; if the audio thread fell so far behind
+ * that the ring is full, the beep is dropped.
+ */
+void chip8_audio_sound(CHIP8AUDIO *audio, uint64_t instructions, uint32_t frame, uint8_t value) {
+    uint64_t head = audio->head;
+    CHIP8BEEP *beep;
+
+    if (head - __atomic_load_n(&audio->tail, __ATOMIC_ACQUIRE) >= AUDIO_EVENTS) {
+        ++audio->overflows;
+        return;
+    }
+
+    beep = &audio->events[head & (AUDIO_EVENTS - 1)];
+    beep->start = instructions_to_samples(audio, instructions, frame);
+    beep->end = instructions_to_samples(audio, (instructions / frame + value) * frame, frame);
+    __atomic_store_n(&audio->head, head + 1, __ATOMIC_RELEASE);
+}
+
+// Publishes how far emulation has got. Called from the emulation thread after every batch of frames.
+void chip8_audio_sync(CHIP8AUDIO *audio, uint64_t instructions, uint32_t frame) {
+    __atomic_store_n(&audio->clock, instructions_to_samples(audio, instructions, frame), __ATOMIC_RELEASE);
+}
+
+static void render_tone(CHIP8AUDIO *audio, int16_t *out, uint32_t count) {
+    uint32_t phase = audio->phase, i;
+
+    for (i = 0; i < count; ++i) {
+        out[i] = audio->wavetable[phase >> (32 - WAVETABLE_BITS)];
+        phase += audio->increment;
+    }
+    audio->phase = phase;
+}
+
+/**
+ * Fills out with count samples, called from the audio thread. The stream follows emulated time latency
+ * samples behind the last sync; if it has drifted more than that either way (a stall on either side, or
+ * the first buffer) it jumps back onto that schedule. Each buffer is split into spans between beep edges,
+ * which are filled from the wavetable or with silence. No locks, no allocation, no libm.
+ */
+void chip8_audio_render(CHIP8AUDIO *audio, int16_t *out, uint32_t count) {
+    uint64_t clock = __atomic_load_n(&audio->clock, __ATOMIC_ACQUIRE);
+    uint64_t head = __atomic_load_n(&audio->head, __ATOMIC_ACQUIRE);
+    uint64_t target = clock > audio->latency ? clock - audio->latency : 0;
+    uint64_t tail = audio->tail, t, edge;
+    uint32_t done = 0, span;
+
+    if (!audio->synced || audio->cursor + audio->latency < target || audio->cursor > target + audio->latency) {
+        audio->cursor = target;
+        audio->synced = 1;
+    }
+
+    t = audio->cursor;
+    while (done < count) {
+        while (tail != head && audio->events[tail & (AUDIO_EVENTS - 1)].start <= t) {
+            audio->beep = audio->events[tail++ & (AUDIO_EVENTS - 1)];
+        }
+
+        // The next edge is the end of the current beep or the start of the next one, whichever comes first.
+        edge = t + (count - done);
+        if (t < audio->beep.end && audio->beep.end < edge)
+            edge = audio->beep.end;
+        if (tail != head && audio->events[tail & (AUDIO_EVENTS - 1)].start < edge)
+            edge = audio->events[tail & (AUDIO_EVENTS - 1)].start;
+        span = (uint32_t) (edge - t);
+
+        if (t >= audio->beep.start && t < audio->beep.end) {
+            render_tone(audio, out + done, span);
+        }
+        else {
+            memset(out + done, 0, span * sizeof(int16_t));
+            audio->phase = 0;
+        }
+        done += span;
+        t = edge;
+    }
+
+    audio->cursor = t;
+    __atomic_store_n(&audio->tail, tail, __ATOMIC_RELEASE);
+}
@@ -0,0 +1,475 @@
+#define _XOPEN_SOURCE 700
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+
+#include "chip8.h"
+
+// Benchmark suite run by make bench. Micro-benchmarks time the pieces of the emulator on their own (decode,
+// table dispatch, sprite drawing, scaling a frame, reset, one audio callback); macro-benchmarks run
+// synthetic ROMs, written out by this program, on every engine the host has, including their ahead-of-time
+// translations when those are linked in (make bench does that). Every benchmark is timed as
+// a number of samples, each long enough to be well above the clock resolution, and reported as
+// percentiles of nanoseconds per operation. The results can be written as JSON and compared against an
+// earlier run; a median more than the threshold slower than the baseline's counts as a regression.
+
+#define DEFAULT_SAMPLES 51
+#define SAMPLE_NS 2000000
+#define DEFAULT_THRESHOLD 10.0
+#define MAX_RESULTS 96
+// Instructions per frame for the -bigframe runs, which show what the engines cost with the timer tick out of
+// the way: at the default of 12 every run is cut into 12-instruction pieces.
+#define BIG_FRAME 1000000
+
+typedef void (*BENCHFN)(void *context, uint64_t iterations);
+
+typedef struct {
+    char name[48];
+    int samples;
+    double min, p50, p90, p99, max, mean;
+} BENCHRESULT;
+
+static BENCHRESULT results[MAX_RESULTS];
+static int result_count;
+static int samples = DEFAULT_SAMPLES;
+static const char *filter;
+static volatile uint64_t sink;
+
+static uint64_t monotonic_ns(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000u + ts.tv_nsec;
+}
+
+static int compare_doubles(const void *a, const void *b) {
+    double x = *(const double *) a, y = *(const double *) b;
+
+    return (x > y) - (x < y);
+}
+
+// Nearest-rank percentile of sorted values.
+static double percentile(const double *sorted, int count, int p) {
+    int rank = (p * count + 99) / 100;
+
+    return sorted[rank > 0 ? rank - 1 : 0];
+}
+
+/**
+ * Times fn: first doubles the iteration count until one call takes SAMPLE_NS, then takes that many
+ * samples of the same iteration count and records the distribution of ns per iteration.
+ */
+static void run(const char *name, BENCHFN fn, void *context) {
+    double values[1024], sum = 0.0;
+    BENCHRESULT *result;
+    uint64_t iterations = 1, start, elapsed;
+    int i;
+
+    if ((filter && !strstr(name, filter)) || result_count == MAX_RESULTS)
+        return;
+
+    for (;;) {
+        start = monotonic_ns();
+        fn(context, iterations);
+        elapsed = monotonic_ns() - start;
+        if (elapsed >= SAMPLE_NS || iterations >= (1ull << 40))
+            break;
+        iterations *= elapsed < SAMPLE_NS / 16 ? 8 : 2;
+    }
+
+    for (i = 0; i < samples; ++i) {
+        start = monotonic_ns();
+        fn(context, iterations);
+        values[i] = (double) (monotonic_ns() - start) / iterations;
+        sum += values[i];
+    }
+    qsort(values, samples, sizeof(double), compare_doubles);
+
+    result = &results[result_count++];
+    snprintf(result->name, sizeof(result->name), "%s", name);
+    result->samples = samples;
+    result->min = values[0];
+    result->p50 = percentile(values, samples, 50);
+    result->p90 = percentile(values, samples, 90);
+    result->p99 = percentile(values, samples, 99);
+    result->max = values[samples - 1];
+    result->mean = sum / samples;
+    printf("%-32s %10.2f %10.2f %10.2f %10.2f\n", name, result->min, result->p50, result->p90, result->p99);
+    fflush(stdout);
+}
+
+// Synthetic ROMs, one per kind of work. Each is an endless loop that keeps the stack balanced.
+typedef struct {
+    const char *name;
+    uint16_t code[32];
+    int length;
+} BENCHROM;
+
+static const BENCHROM roms[] = {
+    // Arithmetic and logic between two registers.
+    {"alu", {0x6A01, 0x6B03, 0x8AB4, 0x8AB5, 0x7A07, 0x8AB1, 0x8AB2, 0x8AB3, 0x8A0E, 0x8AB6, 0x8BA4, 0x8BA7,
+             0x7B0D, 0x1204}, 14},
+    // Font digits and 10-row sprites walking across (and wrapping off) the screen, cleared every 16 digits.
+    {"sprite", {0x6000, 0x6100, 0x6200, 0xF229, 0xD015, 0xA300, 0xD10A, 0x7007, 0x7103, 0x7201, 0x3210, 0x1206,
+                0x00E0, 0x6200, 0x1206}, 15},
+    // Three levels of subroutine calls per loop.
+    {"call", {0x2210, 0x7001, 0x1200, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000,
+              0x2220, 0x2220, 0x7101, 0x00EE, 0x0000, 0x0000, 0x0000, 0x0000,
+              0x2230, 0x00EE, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000,
+              0x7201, 0x00EE}, 26},
+    // Register dumps and loads of all sixteen registers, and BCD, to a data area above the code.
+    {"memory", {0x6110, 0xA400, 0xFF55, 0xFF65, 0xF033, 0x7001, 0xF11E, 0xFF55, 0xFF65, 0x1202}, 10},
+    // The sequences the interpreter fuses: two loads and a draw, I and a register load, a counted loop and a
+    // wait on the delay timer.
+    {"idioms", {0x6005, 0x610A, 0xD015, 0xA400, 0xF365, 0x7201, 0x3200, 0x120A, 0x6402, 0xF415, 0xF507, 0x3500,
+                0x1214, 0x1200}, 14},
+};
+
+#define ROM_COUNT (int) (sizeof(roms) / sizeof(roms[0]))
+
+static int write_rom(const BENCHROM *rom, const char *directory, char *path, size_t size) {
+    uint8_t bytes[64];
+    FILE *fileptr;
+    int i;
+
+    for (i = 0; i < rom->length; ++i) {
+        bytes[2 * i] = rom->code[i] >> 8;
+        bytes[2 * i + 1] = rom->code[i] & 0xFF;
+    }
+    snprintf(path, size, "%s/%s.ch8", directory, rom->name);
+    if (!(fileptr = fopen(path, "wb")) || fwrite(bytes, 2, rom->length, fileptr) != (size_t) rom->length) {
+        fprintf(stderr, "Could not write benchmark ROM: %s\n", path);
+        if (fileptr)
+            fclose(fileptr);
+        return -1;
+    }
+
+    return fclose(fileptr) ? -1 : 0;
+}
+
+static void bench_decode(void *context, uint64_t iterations) {
+    CHIP8OBJECT *chip8 = context;
+    uint64_t i, acc = 0;
+
+    for (i = 0; i < iterations; ++i) {
+        acc += chip8_decode(chip8, 0x200 + (i & 0x7FF) * 2)->op;
+    }
+    sink += acc;
+}
+
+// Table dispatch alone: pre-decoded register instructions called through chip8_opcode_handler's table.
+static void bench_dispatch(void *context, uint64_t iterations) {
+    CHIP8OBJECT *chip8 = context;
+    const CHIP8DECODED *op;
+    uint64_t i;
+
+    for (i = 0; i < iterations; ++i) {
+        op = &chip8->decoded[0x200 + (i & 0xFF) * 2];
+        chip8_opcode_handler(chip8, op->op)(chip8, op);
+    }
+    sink += chip8->V[0];
+}
+
+typedef struct {
+    CHIP8OBJECT *chip8;
+    uint8_t x, y, height;
+} SPRITEBENCH;
+
+static void bench_sprite(void *context, uint64_t iterations) {
+    SPRITEBENCH *bench = context;
+    uint64_t i, hits = 0;
+
+    for (i = 0; i < iterations; ++i) {
+        hits += chip8_draw_sprite(bench->chip8, 0x300, bench->x, bench->y, bench->height);
+    }
+    sink += hits;
+}
+
+typedef struct {
+    const uint64_t *framebuffer;
+    uint32_t rows;
+    uint32_t *pixels;
+    int scale;
+} SCALEBENCH;
+
+static void bench_scale(void *context, uint64_t iterations) {
+    SCALEBENCH *bench = context;
+    uint64_t i;
+
+    for (i = 0; i < iterations; ++i) {
+        chip8_scale_rows(bench->framebuffer, bench->rows, bench->pixels, 64 * bench->scale, bench->scale,
+                         chip8_palettes());
+    }
+    sink += bench->pixels[0];
+}
+
+// Each reset follows a write, so it has one line of memory to put back.
+static void bench_reset(void *context, uint64_t iterations) {
+    uint64_t i;
+
+    for (i = 0; i < iterations; ++i) {
+        chip8_mem_write(context, 0x300, (uint8_t) i);
+        chip8_reset(context);
+    }
+}
+
+// One 512-sample callback with the tone playing, as the window's fill_audio runs it.
+static void bench_audio(void *context, uint64_t iterations) {
+    static int16_t buffer[512];
+    static uint64_t instructions;
+    uint64_t i;
+
+    for (i = 0; i < iterations; ++i) {
+        instructions += 512 * INSTRUCTIONS_PER_FRAME * CHIP8_FRAME_RATE / 44100;
+        if (i % 64 == 0)
+            chip8_audio_sound(context, instructions, INSTRUCTIONS_PER_FRAME, 255);
+        chip8_audio_sync(context, instructions, INSTRUCTIONS_PER_FRAME);
+        chip8_audio_render(context, buffer, 512);
+    }
+    sink += buffer[511];
+}
+
+// One iteration is one instruction.
+static void bench_run(void *context, uint64_t iterations) {
+    chip8_run(context, iterations);
+}
+
+static int run_micro(const char *rom_path) {
+    static const uint8_t heights[] = {1, 5, 15};
+    static const struct {
+        const char *name;
+        uint8_t x, y;
+    } positions[] = {{"aligned", 0, 0}, {"shifted", 13, 7}, {"clip-right", 60, 4}, {"clip-bottom", 8, 28}};
+    static uint32_t pixels[64 * 32 * 10 * 10];
+    CHIP8OBJECT *chip8;
+    CHIP8AUDIO *audio;
+    SPRITEBENCH sprite;
+    SCALEBENCH scale;
+    char name[48];
+    int i, j;
+
+    if (!(chip8 = chip8_create()) || chip8_load_rom(chip8, rom_path))
+        return -1;
+    chip8_reset(chip8);
+
+    // Random code for decode, then 256 register instructions decoded in place for dispatch.
+    srand(1);
+    for (i = 0x200; i < MEMORY_SIZE; ++i) {
+        chip8->mem[i] = (uint8_t) rand();
+    }
+    run("decode", bench_decode, chip8);
+    for (i = 0; i < 256; ++i) {
+        chip8->mem[0x200 + 2 * i] = 0x80 | (rand() & 0xF);
+        chip8->mem[0x201 + 2 * i] = (uint8_t) ((rand() & 0xF0) | "\x00\x01\x02\x03\x04\x05\x06\x07\x0E"[i % 9]);
+        chip8_decode(chip8, 0x200 + 2 * i);
+    }
+    run("dispatch", bench_dispatch, chip8);
+
+    sprite.chip8 = chip8;
+    for (i = 0; i < 15; ++i) {
+        chip8->mem[0x300 + i] = (uint8_t) rand();
+    }
+    for (i = 0; i < (int) (sizeof(heights) / sizeof(heights[0])); ++i) {
+        for (j = 0; j < (int) (sizeof(positions) / sizeof(positions[0])); ++j) {
+            sprite.height = heights[i];
+            sprite.x = positions[j].x;
+            sprite.y = positions[j].y;
+            snprintf(name, sizeof(name), "draw-sprite-h%d-%s", heights[i], positions[j].name);
+            run(name, bench_sprite, &sprite);
+        }
+    }
+
+    for (i = 0; i < 32; ++i) {
+        chip8->framebuffer[i] = (uint64_t) rand() << 33 ^ (uint64_t) rand() << 11 ^ rand();
+    }
+    scale.framebuffer = chip8->framebuffer;
+    scale.pixels = pixels;
+    scale.scale = 10;
+    scale.rows = 0xFFFFFFFF;
+    run("draw-framebuffer-full-x10", bench_scale, &scale);
+    scale.rows = 0x000F0000;
+    run("draw-framebuffer-4rows-x10", bench_scale, &scale);
+
+    run("reset", bench_reset, chip8);
+    chip8_destroy(chip8);
+
+    if (!(audio = chip8_audio_create(44100, 512, 400, 25000)))
+        return -1;
+    run("fill-audio-512", bench_audio, audio);
+    chip8_audio_destroy(audio);
+    return 0;
+}
+
+static int run_macro(const char *directory) {
+    // The traced interpreter shows what an execution trace costs per instruction.
+    static const struct {
+        const char *name;
+        int engine;
+        int trace;
+    } engines[] = {
+        {"interpreter", CHIP8_ENGINE_INTERPRETER}, {"interpreter-traced", CHIP8_ENGINE_INTERPRETER, 1},
+        {"threaded", CHIP8_ENGINE_THREADED}, {"jit", CHIP8_ENGINE_JIT}, {"aot", CHIP8_ENGINE_AOT}
+    };
+    CHIP8OBJECT *chip8;
+    char path[256], name[48];
+    int i, j, big;
+
+    for (i = 0; i < ROM_COUNT; ++i) {
+        if (write_rom(&roms[i], directory, path, sizeof(path)))
+            return -1;
+        for (big = 0; big < 2; ++big) {
+            for (j = 0; j < (int) (sizeof(engines) / sizeof(engines[0])); ++j) {
+                if (big && engines[j].trace)
+                    continue;
+                if (!(chip8 = chip8_create()) || chip8_load_rom(chip8, path))
+                    return -1;
+                chip8_reset(chip8);
+                if (big)
+                    chip8_set_frame_instructions(chip8, BIG_FRAME);
+                if (engines[j].trace && !(chip8->trace = chip8_trace_create(1u << 16)))
+                    return -1;
+                if (chip8_set_engine(chip8, engines[j].engine) == engines[j].engine) {
+                    snprintf(name, sizeof(name), "rom-%s-%s%s", roms[i].name, engines[j].name, big ? "-bigframe" : "");
+                    run(name, bench_run, chip8);
+                }
+                chip8_trace_destroy(chip8->trace);
+                chip8_destroy(chip8);
+            }
+        }
+    }
+
+    return 0;
+}
+
+static int write_json(const char *filename) {
+    FILE *fileptr;
+    int i;
+
+    if (!(fileptr = fopen(filename, "w"))) {
+        fprintf(stderr, "Could not create %s\n", filename);
+        return -1;
+    }
+    fprintf(fileptr, "{\n  \"unit\": \"ns/op\",\n  \"benchmarks\": [\n");
+    for (i = 0; i < result_count; ++i) {
+        fprintf(fileptr,
+                "    {\"name\": \"%s\", \"samples\": %d, \"min\": %.3f, \"p50\": %.3f, \"p90\": %.3f, \"p99\": %.3f, "
+                "\"max\": %.3f, \"mean\": %.3f}%s\n",
+                results[i].name, results[i].samples, results[i].min, results[i].p50, results[i].p90, results[i].p99,
+                results[i].max, results[i].mean, i + 1 < result_count ? "," : "");
+    }
+    fprintf(fileptr, "  ]\n}\n");
+    return fclose(fileptr) ? -1 : 0;
+}
+
+/**
+ * Compares medians with a file written by an earlier run. Only this program's own output is understood:
+ * one benchmark per line with its name first. Benchmarks missing from either side are skipped. Returns the
+ * number of regressions.
+ */
+static int compare_baseline(const char *filename, double threshold) {
+    char line[512], name[48];
+    const char *p;
+    double p50, change;
+    FILE *fileptr;
+    int i, regressions = 0;
+
+    if (!(fileptr = fopen(filename, "r"))) {
+        fprintf(stderr, "Could not open baseline %s\n", filename);
+        return -1;
+    }
+
+    printf("\n%-32s %10s %10s %8s\n", "vs baseline", "p50 was", "p50 now", "change");
+    while (fgets(line, sizeof(line), fileptr)) {
+        if (sscanf(line, " {\"name\": \"%47[^\"]\"", name) != 1 || !(p = strstr(line, "\"p50\": ")) ||
+            sscanf(p + 7, "%lf", &p50) != 1)
+            continue;
+        for (i = 0; i < result_count && strcmp(results[i].name, name); ++i) {
+        }
+        if (i == result_count || p50 <= 0.0)
+            continue;
+        change = 100.0 * (results[i].p50 - p50) / p50;
+        printf("%-32s %10.2f %10.2f %+7.1f%%%s\n", name, p50, results[i].p50, change,
+               change > threshold ? "  REGRESSION" : "");
+        if (change > threshold)
+            ++regressions;
+    }
+
+    fclose(fileptr);
+    return regressions;
+}
+
+int main(int argc, char *argv[]) {
+    const char *output = NULL, *baseline = NULL, *directory = "bench-roms";
+    double threshold = DEFAULT_THRESHOLD;
+    char path[256];
+    int i, regressions, write_only = 0;
+
+    for (i = 1; i < argc; ++i) {
+        if (!strcmp(argv[i], "-o") && i + 1 < argc) {
+            output = argv[++i];
+        }
+        else if (!strcmp(argv[i], "-b") && i + 1 < argc) {
+            baseline = argv[++i];
+        }
+        else if (!strcmp(argv[i], "-t") && i + 1 < argc) {
+            threshold = atof(argv[++i]);
+        }
+        else if (!strcmp(argv[i], "-n") && i + 1 < argc) {
+            samples = atoi(argv[++i]);
+            if (samples < 1 || samples > 1024)
+                samples = DEFAULT_SAMPLES;
+        }
+        else if (!strcmp(argv[i], "-d") && i + 1 < argc) {
+            directory = argv[++i];
+        }
+        else if (!strcmp(argv[i], "-f") && i + 1 < argc) {
+            filter = argv[++i];
+        }
+        else if (!strcmp(argv[i], "-w")) {
+            write_only = 1;
+        }
+        else {
+            printf("Usage: %s [-o results.json] [-b baseline.json] [-t percent] [-n samples] [-d romdir] "
+                   "[-f filter] [-w]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    if (mkdir(directory, 0755) && errno != EEXIST) {
+        fprintf(stderr, "Could not create %s\n", directory);
+        return 1;
+    }
+
+    // -w only writes the ROMs, for chip8-aotc to translate.
+    if (write_only) {
+        for (i = 0; i < ROM_COUNT; ++i) {
+            if (write_rom(&roms[i], directory, path, sizeof(path)))
+                return 1;
+        }
+        return 0;
+    }
+
+    printf("%-32s %10s %10s %10s %10s\n", "ns/op", "min", "p50", "p90", "p99");
+    if (write_rom(&roms[0], directory, path, sizeof(path)) || run_micro(path) || run_macro(directory)) {
+        fprintf(stderr, "Benchmark set up failed\n");
+        return 1;
+    }
+
+    if (output && write_json(output))
+        return 1;
+    if (baseline) {
+        if ((regressions = compare_baseline(baseline, threshold)) < 0)
+            return 1;
+        if (regressions) {
+            printf("%d benchmarks regressed by more than %.0f%%\n", regressions, threshold);
+            return 1;
+        }
+    }
+
+    return 0;
+}
@@ -0,0 +1,156 @@
+#define _XOPEN_SOURCE 700
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "chip8.h"
+
+static uint64_t monotonic_ns(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000u + ts.tv_nsec;
+}
+
+/**
+ * Creates (or takes over) the shared memory object name, e.g. "/chip8-0", sizes it for the header and the
+ * ring and maps it. The header says which ROM and process it belongs to. The object stays in /dev/shm
+ * until chip8_export_destroy unlinks it.
+ */
+CHIP8EXPORT *chip8_export_create(const char *name, const CHIP8OBJECT *chip8) {
+    CHIP8EXPORT *export;
+    const char *rom;
+    void *map;
+    int fd;
+
+    if ((fd = shm_open(name, O_RDWR | O_CREAT, 0644)) < 0) {
+        fprintf(stderr, "Could not create shared memory object: %s\n", name);
+        return NULL;
+    }
+    if (ftruncate(fd, sizeof(CHIP8EXPORT)) ||
+        (map = mmap(NULL, sizeof(CHIP8EXPORT), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0)) == MAP_FAILED) {
+        fprintf(stderr, "Could not map shared memory object: %s\n", name);
+        close(fd);
+        shm_unlink(name);
+        return NULL;
+    }
+    close(fd);
+
+    export = memset(map, 0, sizeof(CHIP8EXPORT));
+    export->version = CHIP8_EXPORT_VERSION;
+    export->slots = CHIP8_EXPORT_SLOTS;
+    export->frame_size = sizeof(CHIP8EXPORTFRAME);
+    export->pid = (uint32_t) getpid();
+    snprintf(export->name, sizeof(export->name), "%s", name);
+    rom = chip8->romfn && strrchr(chip8->romfn, '/') ? strrchr(chip8->romfn, '/') + 1 : chip8->romfn;
+    snprintf(export->rom, sizeof(export->rom), "%s", rom ? rom : "");
+    // Readers check the magic last, so they never see a header that is only half written.
+    __atomic_store_n(&export->magic, CHIP8_EXPORT_MAGIC, __ATOMIC_RELEASE);
+    return export;
+}
+
+void chip8_export_destroy(CHIP8EXPORT *export) {
+    if (!export)
+        return;
+    shm_unlink(export->name);
+    munmap(export, sizeof(CHIP8EXPORT));
+}
+
+/**
+ * Writes the instance's framebuffer and registers into the next slot of the ring. The slot's sequence
+ * goes odd before the first store and even after the last, and published is bumped after that, so the
+ * emulator never waits for or even notices its readers. Costs one copy of about 400 bytes.
+ */
+void chip8_export_publish(CHIP8EXPORT *export, const CHIP8OBJECT *chip8) {
+    uint64_t index = export->published;
+    CHIP8EXPORTFRAME *frame = &export->frames[index % CHIP8_EXPORT_SLOTS];
+    uint32_t sequence = frame->sequence;
+
+    __atomic_store_n(&frame->sequence, sequence + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+
+    frame->instructions_per_frame = chip8->instructions_per_frame;
+    frame->frame = chip8->instructions / chip8->instructions_per_frame;
+    frame->instructions = chip8->instructions;
+    frame->time_ns = monotonic_ns();
+    frame->I = chip8->I;
+    frame->program_counter = chip8->program_counter;
+    memcpy(frame->stack, chip8->stack, sizeof(frame->stack));
+    memcpy(frame->V, chip8->V, sizeof(frame->V));
+    frame->stack_pointer = chip8->stack_pointer;
+    frame->delay_timer = chip8->delay_timer;
+    frame->sound_timer = chip8->sound_timer;
+    memcpy(frame->buttons, chip8->buttons, sizeof(frame->buttons));
+    memcpy(frame->framebuffer, chip8->framebuffer, sizeof(frame->framebuffer));
+
+    __atomic_store_n(&frame->sequence, sequence + 2, __ATOMIC_RELEASE);
+    __atomic_store_n(&export->published, index + 1, __ATOMIC_RELEASE);
+}
+
+// Maps an export read-only. Returns NULL if it does not exist or is not an export of this version.
+CHIP8EXPORT *chip8_export_open(const char *name) {
+    CHIP8EXPORT *export;
+    struct stat st;
+    void *map;
+    int fd;
+
+    if ((fd = shm_open(name, O_RDONLY, 0)) < 0) {
+        fprintf(stderr, "Could not open shared memory object: %s\n", name);
+        return NULL;
+    }
+    if (fstat(fd, &st) || st.st_size < (off_t) sizeof(CHIP8EXPORT) ||
+        (map = mmap(NULL, sizeof(CHIP8EXPORT), PROT_READ, MAP_SHARED, fd, 0)) == MAP_FAILED) {
+        fprintf(stderr, "Not a frame export: %s\n", name);
+        close(fd);
+        return NULL;
+    }
+    close(fd);
+
+    export = map;
+    if (__atomic_load_n(&export->magic, __ATOMIC_ACQUIRE) != CHIP8_EXPORT_MAGIC ||
+        export->version != CHIP8_EXPORT_VERSION || export->frame_size != sizeof(CHIP8EXPORTFRAME)) {
+        fprintf(stderr, "Not a frame export of this version: %s\n", name);
+        munmap(map, sizeof(CHIP8EXPORT));
+        return NULL;
+    }
+    return export;
+}
+
+void chip8_export_close(CHIP8EXPORT *export) {
+    if (export)
+        munmap(export, sizeof(CHIP8EXPORT));
+}
+
+/**
+ * Copies frame number index (counting from 0 for the first one published) out of the ring. Returns 0 on
+ * success, 1 if it has not been published yet and -1 if it has already been overwritten. A copy that
+ * raced with the writer is detected by the slot's sequence changing and taken again.
+ */
+int chip8_export_read(const CHIP8EXPORT *export, uint64_t index, CHIP8EXPORTFRAME *frame) {
+    const CHIP8EXPORTFRAME *slot = &export->frames[index % CHIP8_EXPORT_SLOTS];
+    uint64_t published;
+    uint32_t before;
+
+    for (;;) {
+        published = __atomic_load_n(&export->published, __ATOMIC_ACQUIRE);
+        if (index >= published)
+            return 1;
+        if (published - index > CHIP8_EXPORT_SLOTS - 1)
+            return -1;
+
+        before = __atomic_load_n(&slot->sequence, __ATOMIC_ACQUIRE);
+        if (before & 1)
+            continue;
+        memcpy(frame, slot, sizeof(CHIP8EXPORTFRAME));
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&slot->sequence, __ATOMIC_RELAXED) == before &&
+            __atomic_load_n(&export->published, __ATOMIC_RELAXED) - index <= CHIP8_EXPORT_SLOTS - 1)
+            return 0;
+    }
+}
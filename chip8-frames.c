@@ -0,0 +1,78 @@
+#define _XOPEN_SOURCE 700
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "chip8.h"
+
+// Set in middle while the slot it names holds a frame the reader has not taken yet.
+#define FRAMES_FRESH 4
+
+typedef struct {
+    uint64_t framebuffer[32];
+    uint32_t dirty;
+} CHIP8FRAME;
+
+// Each slot is owned by exactly one side at a time: back by the writer, front by the reader, and middle by
+// neither until one of them swaps it for its own. middle is the only field both sides touch.
+struct CHIP8FRAMES {
+    CHIP8FRAME slots[3] __attribute__((aligned(64)));
+
+    uint32_t middle __attribute__((aligned(64)));
+
+    uint32_t back __attribute__((aligned(64)));
+    uint32_t pending;
+
+    uint32_t front __attribute__((aligned(64)));
+};
+
+CHIP8FRAMES *chip8_frames_create(void) {
+    CHIP8FRAMES *frames;
+    void *block;
+
+    if (posix_memalign(&block, 64, sizeof(CHIP8FRAMES)))
+        return NULL;
+    frames = memset(block, 0, sizeof(CHIP8FRAMES));
+    frames->back = 0;
+    frames->middle = 1;
+    frames->front = 2;
+    return frames;
+}
+
+void chip8_frames_destroy(CHIP8FRAMES *frames) {
+    free(frames);
+}
+
+/**
+ * Called from the emulation thread with a finished framebuffer and the rows that changed since the last
+ * call. The frame is copied into the back slot, which is then swapped with the middle one in a single
+ * atomic exchange, so the writer never waits for the reader. Each frame's dirty rows count from the last
+ * frame the reader took, so a reader that skips frames still redraws every row that changed; getting
+ * back a slot that is not fresh is how the writer learns that the reader took the previous frame.
+ */
+void chip8_frames_publish(CHIP8FRAMES *frames, const uint64_t *framebuffer, uint32_t dirty) {
+    CHIP8FRAME *slot = &frames->slots[frames->back];
+    uint32_t old;
+
+    memcpy(slot->framebuffer, framebuffer, sizeof(slot->framebuffer));
+    frames->pending |= dirty;
+    slot->dirty = frames->pending;
+    old = __atomic_exchange_n(&frames->middle, frames->back | FRAMES_FRESH, __ATOMIC_ACQ_REL);
+    frames->back = old & 3;
+    if (!(old & FRAMES_FRESH))
+        frames->pending = dirty;
+}
+
+// Called from the presentation thread. Returns the newest published framebuffer and its dirty rows, or
+// NULL if nothing was published since the last call. It stays valid until the next call.
+const uint64_t *chip8_frames_take(CHIP8FRAMES *frames, uint32_t *dirty) {
+    uint32_t old;
+
+    if (!(__atomic_load_n(&frames->middle, __ATOMIC_RELAXED) & FRAMES_FRESH))
+        return NULL;
+    old = __atomic_exchange_n(&frames->middle, frames->front, __ATOMIC_ACQ_REL);
+    frames->front = old & 3;
+    *dirty = frames->slots[frames->front].dirty;
+    return frames->slots[frames->front].framebuffer;
+}
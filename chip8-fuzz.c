@@ -0,0 +1,167 @@
+#define _XOPEN_SOURCE 700
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "chip8.h"
+
+// Persistent-mode fuzzing harness for the CPU core. Every input is a program: its first byte picks the quirk
+// profile and the rest is loaded as the ROM of one long-lived instance, which chip8_load_rom_data resets by
+// copying back only the memory the previous input touched. The program then runs for a fixed number of
+// instructions through chip8_execute_instruction, with the timers ticking every frame, or until the program
+// counter leaves the loaded bytes: past them there is only empty memory, which decodes as 00E0, and
+// clearing the screen a few hundred times finds nothing but would take most of the time. make fuzz builds it
+// with AddressSanitizer and UndefinedBehaviorSanitizer; with FUZZ=libfuzzer (and CC=clang) it is a libFuzzer
+// target, and built with afl-clang-fast it runs in AFL++'s persistent mode. Standalone it runs the inputs
+// named on the command line, or -n random ones, and reports how many it got through per second.
+
+#define FUZZ_INSTRUCTIONS 1000
+#define FUZZ_MAX_INPUT (MEMORY_SIZE - 0x200 + 1)
+#define FUZZ_RANDOM_LENGTH 256
+
+static CHIP8OBJECT *chip8;
+static uint32_t instructions = FUZZ_INSTRUCTIONS;
+
+static double monotonic_seconds(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void run_input(const uint8_t *data, size_t size) {
+    uint32_t i, frame = 0;
+
+    if (!size)
+        return;
+    if (size > FUZZ_MAX_INPUT)
+        size = FUZZ_MAX_INPUT;
+    if (!chip8 && !(chip8 = chip8_create()))
+        abort();
+
+    chip8_set_quirks(chip8, data[0] % CHIP8_QUIRKS_COUNT);
+    chip8_load_rom_data(chip8, data + 1, size - 1);
+    chip8_reset(chip8);
+    chip8_seed(chip8, 0);
+    for (i = 0; i < instructions; ++i) {
+        if (chip8->program_counter < 0x200 || chip8->program_counter >= chip8->image_end)
+            break;
+        chip8_execute_instruction(chip8);
+        if (++frame == chip8->instructions_per_frame) {
+            chip8_tick_timers(chip8);
+            frame = 0;
+        }
+    }
+}
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size) {
+    run_input(data, size);
+    return 0;
+}
+
+#ifndef CHIP8_FUZZ_LIBFUZZER
+
+#ifdef __AFL_FUZZ_TESTCASE_LEN
+__AFL_FUZZ_INIT();
+#endif
+
+static int run_file(const char *filename) {
+    static uint8_t data[FUZZ_MAX_INPUT];
+    FILE *fileptr;
+    size_t size;
+
+    if (!(fileptr = fopen(filename, "rb"))) {
+        fprintf(stderr, "Could not open input: %s\n", filename);
+        return -1;
+    }
+    size = fread(data, 1, sizeof(data), fileptr);
+    fclose(fileptr);
+
+    run_input(data, size);
+    printf("%s: pc %03x  I %03x  sp %2u  hash %016llx\n", filename, chip8 ? chip8->program_counter : 0,
+           chip8 ? chip8->I : 0, chip8 ? chip8->stack_pointer : 0,
+           (unsigned long long) (chip8 ? chip8_framebuffer_hash(chip8) : 0));
+    return 0;
+}
+
+// Random programs of random length, mostly well-formed enough to get past the first few instructions.
+static void run_random(uint64_t count, uint32_t seed) {
+    uint8_t data[FUZZ_RANDOM_LENGTH + 1];
+    uint32_t x = seed ? seed : 1;
+    uint64_t n;
+    double start, elapsed;
+    size_t size, i;
+
+    start = monotonic_seconds();
+    for (n = 0; n < count; ++n) {
+        x ^= x << 13;
+        x ^= x >> 17;
+        x ^= x << 5;
+        size = 1 + x % FUZZ_RANDOM_LENGTH;
+        for (i = 0; i < size + 1; ++i) {
+            x ^= x << 13;
+            x ^= x >> 17;
+            x ^= x << 5;
+            data[i] = x >> 24;
+        }
+        run_input(data, size + 1);
+    }
+    elapsed = monotonic_seconds() - start;
+
+    printf("Inputs:            %llu\n", (unsigned long long) count);
+    printf("Instructions each: %u\n", instructions);
+    printf("Seconds:           %.3f\n", elapsed);
+    printf("Inputs per second: %.0f\n", elapsed > 0 ? count / elapsed : 0.0);
+}
+
+int main(int argc, char *argv[]) {
+    uint64_t count = 0;
+    uint32_t seed = 1;
+    int i, usage = 0, result = 0;
+
+#ifdef __AFL_FUZZ_TESTCASE_LEN
+    __AFL_INIT();
+    while (__AFL_LOOP(10000)) {
+        run_input(__AFL_FUZZ_TESTCASE_BUF, __AFL_FUZZ_TESTCASE_LEN);
+    }
+    return 0;
+#endif
+
+    for (i = 1; i < argc; ++i) {
+        if (!strcmp(argv[i], "-n") && i + 1 < argc) {
+            count = strtoull(argv[++i], NULL, 0);
+        }
+        else if (!strcmp(argv[i], "-i") && i + 1 < argc) {
+            instructions = strtoul(argv[++i], NULL, 0);
+        }
+        else if (!strcmp(argv[i], "-s") && i + 1 < argc) {
+            seed = strtoul(argv[++i], NULL, 0);
+        }
+        else if (argv[i][0] != '-') {
+            break;
+        }
+        else {
+            usage = 1;
+            break;
+        }
+    }
+    if (usage || (i == argc && !count)) {
+        printf("Usage: %s [-i instructions] -n inputs [-s seed]\n"
+               "       %s [-i instructions] input...\n", argv[0], argv[0]);
+        return 1;
+    }
+
+    for (; i < argc; ++i) {
+        if (run_file(argv[i]))
+            result = 1;
+    }
+    if (count)
+        run_random(count, seed);
+    chip8_destroy(chip8);
+    return result;
+}
+
+#endif
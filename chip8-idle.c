@@ -0,0 +1,181 @@
+#define _XOPEN_SOURCE 700
+
+#include <stdint.h>
+#include <string.h>
+
+#include "chip8.h"
+
+// Longest loop body looked for, in instructions, and how far apart idle checks get while nothing is found.
+#define IDLE_MAX_LENGTH 16
+#define IDLE_MAX_BACKOFF 64
+
+// Instructions an idle loop may contain besides the jump back: none of them writes memory, draws, calls,
+// makes a sound or draws a random number, so an iteration that leaves the registers as they were can be
+// repeated any number of times with the same result. IDLE_FRAME marks the ones that use the delay timer
+// or the keys, which only stay put until the end of the frame: timers tick and the front end applies key
+// presses between frames.
+enum {
+    IDLE_NO,
+    IDLE_PURE,
+    IDLE_FRAME
+};
+
+static const uint8_t idle_ops[CHIP8_OP_COUNT] = {
+    [CHIP8_OP_UNKNOWN] = IDLE_PURE, [CHIP8_OP_3XNN] = IDLE_PURE, [CHIP8_OP_4XNN] = IDLE_PURE,
+    [CHIP8_OP_5XY0] = IDLE_PURE, [CHIP8_OP_6XNN] = IDLE_PURE, [CHIP8_OP_7XNN] = IDLE_PURE,
+    [CHIP8_OP_8XY0] = IDLE_PURE, [CHIP8_OP_8XY1] = IDLE_PURE, [CHIP8_OP_8XY2] = IDLE_PURE,
+    [CHIP8_OP_8XY3] = IDLE_PURE, [CHIP8_OP_8XY4] = IDLE_PURE, [CHIP8_OP_8XY5] = IDLE_PURE,
+    [CHIP8_OP_8XY6] = IDLE_PURE, [CHIP8_OP_8XY7] = IDLE_PURE, [CHIP8_OP_8XYE] = IDLE_PURE,
+    [CHIP8_OP_9XY0] = IDLE_PURE, [CHIP8_OP_ANNN] = IDLE_PURE, [CHIP8_OP_EX9E] = IDLE_FRAME,
+    [CHIP8_OP_EXA1] = IDLE_FRAME, [CHIP8_OP_FX07] = IDLE_FRAME, [CHIP8_OP_FX15] = IDLE_FRAME,
+    [CHIP8_OP_FX1E] = IDLE_PURE, [CHIP8_OP_FX29] = IDLE_PURE, [CHIP8_OP_FX65] = IDLE_PURE
+};
+
+static const CHIP8DECODED *decoded(CHIP8OBJECT *chip8, uint16_t address) {
+    const CHIP8DECODED *op = &chip8->decoded[address & MEMORY_MASK];
+
+    return op->op == CHIP8_OP_UNDECODED ? chip8_decode(chip8, address) : op;
+}
+
+// Runs one instruction on the interpreter and ticks the timers on a frame boundary, as chip8_run does.
+static void step(CHIP8OBJECT *chip8) {
+    chip8_execute_instruction(chip8);
+    if (++chip8->instructions % chip8->instructions_per_frame == 0)
+        chip8_tick_timers(chip8);
+}
+
+// Moves the instance count instructions ahead without running them, ticking the timers on every frame
+// boundary passed.
+static void skip(CHIP8OBJECT *chip8, uint64_t count) {
+    uint64_t frame = chip8->instructions_per_frame;
+    uint64_t ticks = (chip8->instructions % frame + count) / frame;
+
+    chip8->instructions += count;
+    while (ticks--) {
+        chip8_tick_timers(chip8);
+    }
+}
+
+/**
+ * Looks for a short loop around the program counter made only of idle_ops and closed by a jump back to
+ * its head. Returns IDLE_NO if there is none, otherwise IDLE_FRAME if anything in it uses the delay timer
+ * or the keys and IDLE_PURE if not.
+ */
+static int find_loop(CHIP8OBJECT *chip8, uint16_t *head, int *length) {
+    const CHIP8DECODED *op = NULL;
+    uint16_t pc = chip8->program_counter & MEMORY_MASK, address;
+    int kind = IDLE_PURE, i;
+
+    for (i = 0, address = pc; i < IDLE_MAX_LENGTH; ++i, address += 2) {
+        op = decoded(chip8, address);
+        if (op->op == CHIP8_OP_1NNN)
+            break;
+        if (idle_ops[op->op] == IDLE_NO)
+            return IDLE_NO;
+        if (idle_ops[op->op] == IDLE_FRAME)
+            kind = IDLE_FRAME;
+    }
+    // A jump back to an address of the other parity never lines up with pc, so it cannot close a loop.
+    if (i == IDLE_MAX_LENGTH || op->NNN > pc || address - op->NNN >= 2 * IDLE_MAX_LENGTH || (pc - op->NNN) & 1)
+        return IDLE_NO;
+
+    *head = op->NNN;
+    *length = (address - op->NNN) / 2 + 1;
+    for (address = op->NNN; address != pc; address += 2) {
+        op = decoded(chip8, address);
+        if (idle_ops[op->op] == IDLE_NO)
+            return IDLE_NO;
+        if (idle_ops[op->op] == IDLE_FRAME)
+            kind = IDLE_FRAME;
+    }
+
+    return kind;
+}
+
+/**
+ * Fast-forwards through busy waiting, called by chip8_run every so often before it hands instructions to
+ * the engine. Two kinds of waits are recognised: FX0A with no key down, and a short loop of register-only
+ * instructions closed by a jump back (a jump to itself, FX07 polling the delay timer, EX9E polling a key).
+ * For a loop, one iteration is run on the interpreter; if it ends at the head with the registers and I
+ * unchanged, every further iteration is the same, so whole iterations are skipped instead of run. A wait
+ * on the timer or the keys is skipped up to the end of the frame, anything else up to count. The
+ * instruction count and the timer ticks come out exactly as if every instruction had run. Returns how
+ * many of count instructions it ran or skipped, and sets how long chip8_run runs before asking again,
+ * backing off while nothing is found.
+ */
+uint64_t chip8_idle_run(CHIP8OBJECT *chip8, uint64_t count) {
+    const CHIP8DECODED *op = decoded(chip8, chip8->program_counter);
+    uint64_t frame = chip8->instructions_per_frame, done = 0, start, period, limit;
+    uint8_t V[16], delay, sp;
+    uint16_t I, head;
+    int kind, length, attempt, i;
+
+    if (op->op == CHIP8_OP_FX0A) {
+        for (i = 0; i < 16 && !chip8->buttons[i]; ++i) {
+        }
+        if (i == 16) {
+            limit = frame - chip8->instructions % frame;
+            limit = limit < count ? limit : count;
+            skip(chip8, limit);
+            chip8->idle_wait = 0;
+            return limit;
+        }
+    }
+
+    // A wait that has to be checked again every frame only pays off if the frame holds many iterations.
+    if ((kind = find_loop(chip8, &head, &length)) == IDLE_NO || (kind == IDLE_FRAME && frame < 8 * (uint64_t) length))
+        goto busy;
+
+    // Run up to the head of the loop, then iterations from there until one changes nothing. The first may
+    // still pick up a new timer value.
+    for (i = 0; i < length && (chip8->program_counter & MEMORY_MASK) != head && done < count; ++i, ++done) {
+        step(chip8);
+    }
+    if ((chip8->program_counter & MEMORY_MASK) != head)
+        goto busy;
+    for (attempt = 0;; ++attempt) {
+        if (done == count) {
+            chip8->idle_wait = 0;
+            return done;
+        }
+        memcpy(V, chip8->V, sizeof(V));
+        I = chip8->I;
+        delay = chip8->delay_timer;
+        sp = chip8->stack_pointer;
+        start = chip8->instructions;
+        for (i = 0; i < length && done < count; ++i) {
+            step(chip8);
+            ++done;
+            if ((chip8->program_counter & MEMORY_MASK) == head)
+                break;
+        }
+        period = chip8->instructions - start;
+        if ((chip8->program_counter & MEMORY_MASK) != head || sp != chip8->stack_pointer)
+            goto busy;
+        // A timer tick in the middle of the iteration spoils the comparison; the next try, from the new
+        // frame, will not have one.
+        if (kind == IDLE_FRAME && chip8->instructions / frame != start / frame) {
+            chip8->idle_wait = 0;
+            return done;
+        }
+        if (!memcmp(V, chip8->V, sizeof(V)) && I == chip8->I && (kind == IDLE_PURE || delay == chip8->delay_timer))
+            break;
+        if (attempt)
+            goto busy;
+    }
+
+    limit = count - done;
+    if (kind == IDLE_FRAME && limit > frame - chip8->instructions % frame)
+        limit = frame - chip8->instructions % frame;
+    limit -= limit % period;
+    skip(chip8, limit);
+    chip8->idle_wait = 0;
+    chip8->idle_backoff = 1;
+    return done + limit;
+
+busy:
+    if (chip8->idle_backoff < IDLE_MAX_BACKOFF)
+        chip8->idle_backoff *= 2;
+    chip8->idle_wait = chip8->idle_backoff * frame;
+    return done;
+}
@@ -1,409 +1,795 @@
-#include <SDL/SDL.h>
+#define _XOPEN_SOURCE 700
+
 #include <stdio.h>
 #include <stdbool.h>
 #include <stdlib.h>
+#include <string.h>
+
+#include "chip8.h"
 
-/* You must implement these functions in your code! */
-void chip8_init(void);
-void chip8_reset(void);
-void chip8_shutdown(void);
-void chip8_execute_instruction(void);
-
-/* These functions are available to you to use in your code. */
-uint8_t chip8_mem_read(uint16_t addr);
-void chip8_mem_write(uint16_t addr, uint8_t val);
-uint8_t chip8_register_read(uint8_t reg);
-void chip8_register_write(uint8_t reg, uint8_t val);
-void chip8_clear_frame(void);
-void chip8_mem_clear(void);
-int chip8_draw_sprite(uint16_t addr, uint8_t x, uint8_t y, uint8_t height);
-void chip8_mem_reset(void);
-
-// Struct containing variables relating to the opcode. Used to make extracting the opcode easier.
-typedef struct {
-    uint16_t unmodified;
-    uint8_t high_nibble;
-    uint16_t NNN;
-    uint8_t NN;
-    uint8_t N;
-    uint8_t X;
-    uint8_t Y;
-} CHIP8FULLOPCODE;
-
-void decode_helper(CHIP8FULLOPCODE *opcode);
 // Main opcode nibble (highest nibble)
-void nibble_0(void);
-void nibble_1(void);
-void nibble_2(void);
-void nibble_3(void);
-void nibble_4(void);
-void nibble_5(void);
-void nibble_6(void);
-void nibble_7(void);
-void nibble_8(void);
-void nibble_9(void);
-void nibble_A(void);
-void nibble_B(void);
-void nibble_C(void);
-void nibble_D(void);
-void nibble_E(void);
-void nibble_F(void);
+static void opcode_unknown(CHIP8OBJECT *chip8, const CHIP8DECODED *op);
+static void nibble_1(CHIP8OBJECT *chip8, const CHIP8DECODED *op);
+static void nibble_2(CHIP8OBJECT *chip8, const CHIP8DECODED *op);
+static void nibble_3(CHIP8OBJECT *chip8, const CHIP8DECODED *op);
+static void nibble_4(CHIP8OBJECT *chip8, const CHIP8DECODED *op);
+static void nibble_5(CHIP8OBJECT *chip8, const CHIP8DECODED *op);
+static void nibble_6(CHIP8OBJECT *chip8, const CHIP8DECODED *op);
+static void nibble_7(CHIP8OBJECT *chip8, const CHIP8DECODED *op);
+static void nibble_9(CHIP8OBJECT *chip8, const CHIP8DECODED *op);
+static void nibble_A(CHIP8OBJECT *chip8, const CHIP8DECODED *op);
+static inline void nibble_B(CHIP8OBJECT *chip8, const CHIP8DECODED *op, int quirks);
+static void nibble_C(CHIP8OBJECT *chip8, const CHIP8DECODED *op);
+static void nibble_D(CHIP8OBJECT *chip8, const CHIP8DECODED *op);
 // Subfunctions for the 0 nibble
-void opcode0_E0(void);
-void opcode0_EE(void);
+static void opcode0_E0(CHIP8OBJECT *chip8, const CHIP8DECODED *op);
+static void opcode0_EE(CHIP8OBJECT *chip8, const CHIP8DECODED *op);
 // Subfunctions for 8 nibble
-void opcode8_0(void);
-void opcode8_1(void);
-void opcode8_2(void);
-void opcode8_3(void);
-void opcode8_4(void);
-void opcode8_5(void);
-void opcode8_6(void);
-void opcode8_7(void);
-void opcode8_E(void);
+static void opcode8_0(CHIP8OBJECT *chip8, const CHIP8DECODED *op);
+static inline void opcode8_1(CHIP8OBJECT *chip8, const CHIP8DECODED *op, int quirks);
+static inline void opcode8_2(CHIP8OBJECT *chip8, const CHIP8DECODED *op, int quirks);
+static inline void opcode8_3(CHIP8OBJECT *chip8, const CHIP8DECODED *op, int quirks);
+static void opcode8_4(CHIP8OBJECT *chip8, const CHIP8DECODED *op);
+static void opcode8_5(CHIP8OBJECT *chip8, const CHIP8DECODED *op);
+static inline void opcode8_6(CHIP8OBJECT *chip8, const CHIP8DECODED *op, int quirks);
+static void opcode8_7(CHIP8OBJECT *chip8, const CHIP8DECODED *op);
+static inline void opcode8_E(CHIP8OBJECT *chip8, const CHIP8DECODED *op, int quirks);
 // Subfunctions for the E nibble
-void opcodeE_9E(void);
-void opcodeE_A1(void);
+static void opcodeE_9E(CHIP8OBJECT *chip8, const CHIP8DECODED *op);
+static void opcodeE_A1(CHIP8OBJECT *chip8, const CHIP8DECODED *op);
 // Subfunctions for the F nibble
-void opcodeF_07(void);
-void opcodeF_0A(void);
-void opcodeF_15(void);
-void opcodeF_18(void);
-void opcodeF_1E(void);
-void opcodeF_29(void);
-void opcodeF_33(void);
-void opcodeF_55(void);
-void opcodeF_65(void);
-void set_BCD(void);
-// Currently using an array of function pointers to make the program more efficient. Need a pointer type.
-typedef void (*OpcodeFunctionPtr)();
-
-// Struct containing the stack, Vx Registers, Memory address I, a stack pointer, a program counter, and
-// the opcode struct.
-// Added: Array of function pointers with OpcodeFunctionPtr type. 
-typedef struct {
-    uint16_t stack[16];
-    uint8_t V[16];
-    uint16_t I;
-    uint16_t *stack_pointer;
-    uint16_t program_counter;
-    OpcodeFunctionPtr opcode_ptr[16];
-    CHIP8FULLOPCODE opcode;
-} CHIP8OBJECT;
-CHIP8OBJECT chip8;
-
-void chip8_init(void) {
-    chip8.program_counter = 0x200;
-    chip8.I = 0x200;
-    chip8.stack_pointer = chip8.stack;
-
-    // Initializes the elements in the array to each function.
-    chip8.opcode_ptr[0x0] = nibble_0;
-    chip8.opcode_ptr[0x1] = nibble_1;
-    chip8.opcode_ptr[0x2] = nibble_2;
-    chip8.opcode_ptr[0x3] = nibble_3;
-    chip8.opcode_ptr[0x4] = nibble_4;
-    chip8.opcode_ptr[0x5] = nibble_5;
-    chip8.opcode_ptr[0x6] = nibble_6;
-    chip8.opcode_ptr[0x7] = nibble_7;
-    chip8.opcode_ptr[0x8] = nibble_8;
-    chip8.opcode_ptr[0x9] = nibble_9;
-    chip8.opcode_ptr[0xA] = nibble_A;
-    chip8.opcode_ptr[0xB] = nibble_B;
-    chip8.opcode_ptr[0xC] = nibble_C;
-    chip8.opcode_ptr[0xD] = nibble_D;
-    chip8.opcode_ptr[0xE] = nibble_E;
-    chip8.opcode_ptr[0xF] = nibble_F;
-}
-
-void chip8_reset(void) {
-    chip8_mem_reset();
-    chip8.program_counter = 0x200;
-    chip8.I = 0x200;
-    chip8.stack_pointer = chip8.stack;
-    memset(chip8.V, 0, sizeof(chip8.V));
-    memset(chip8.stack, 0, sizeof(chip8.stack));
+static void opcodeF_07(CHIP8OBJECT *chip8, const CHIP8DECODED *op);
+static void opcodeF_0A(CHIP8OBJECT *chip8, const CHIP8DECODED *op);
+static void opcodeF_15(CHIP8OBJECT *chip8, const CHIP8DECODED *op);
+static void opcodeF_18(CHIP8OBJECT *chip8, const CHIP8DECODED *op);
+static void opcodeF_1E(CHIP8OBJECT *chip8, const CHIP8DECODED *op);
+static void opcodeF_29(CHIP8OBJECT *chip8, const CHIP8DECODED *op);
+static void opcodeF_33(CHIP8OBJECT *chip8, const CHIP8DECODED *op);
+static inline void opcodeF_55(CHIP8OBJECT *chip8, const CHIP8DECODED *op, int quirks);
+static inline void opcodeF_65(CHIP8OBJECT *chip8, const CHIP8DECODED *op, int quirks);
+static void set_BCD(CHIP8OBJECT *chip8, const CHIP8DECODED *op);
+
+// The handlers that depend on the quirk profile take its quirk bits as an argument. QUIRK_HANDLER wraps one
+// of them for one profile with the bits as a constant, which the compiler folds into the inlined body, so
+// each profile gets its own copy of the handler with no quirk left to test at run time.
+#define QUIRK_HANDLER(name, profile)                                           \
+    static void name##_##profile(CHIP8OBJECT *chip8, const CHIP8DECODED *op) { \
+        name(chip8, op, CHIP8_QUIRKS(CHIP8_QUIRKS_##profile));                 \
+    }
+#define QUIRK_HANDLERS(profile)                                                                           \
+    QUIRK_HANDLER(opcode8_1, profile) QUIRK_HANDLER(opcode8_2, profile) QUIRK_HANDLER(opcode8_3, profile) \
+    QUIRK_HANDLER(opcode8_6, profile) QUIRK_HANDLER(opcode8_E, profile) QUIRK_HANDLER(nibble_B, profile)  \
+    QUIRK_HANDLER(opcodeF_55, profile) QUIRK_HANDLER(opcodeF_65, profile)
+
+QUIRK_HANDLERS(DEFAULT)
+QUIRK_HANDLERS(VIP)
+QUIRK_HANDLERS(CHIP48)
+QUIRK_HANDLERS(SCHIP)
+
+// Currently using an array of function pointers to make the program more efficient. OpcodeFunctionPtr is
+// declared in chip8.h so the recompiler can call the same handlers.
+// Array of function pointers indexed by instruction class, one per quirk profile. Decoding resolves every
+// opcode to one of these once, so executing a cached instruction is a single indirect call. The tables
+// never change, so they are shared by every instance, which only points at the one for its profile.
+#define OPCODE_TABLE(profile)                                                                                                   \
+    [CHIP8_QUIRKS_##profile] = {                                                                                                \
+        [CHIP8_OP_UNKNOWN] = opcode_unknown,                                                                                    \
+        [CHIP8_OP_00E0] = opcode0_E0, [CHIP8_OP_00EE] = opcode0_EE,                                                             \
+        [CHIP8_OP_1NNN] = nibble_1, [CHIP8_OP_2NNN] = nibble_2, [CHIP8_OP_3XNN] = nibble_3, [CHIP8_OP_4XNN] = nibble_4,         \
+        [CHIP8_OP_5XY0] = nibble_5, [CHIP8_OP_6XNN] = nibble_6, [CHIP8_OP_7XNN] = nibble_7,                                     \
+        [CHIP8_OP_8XY0] = opcode8_0, [CHIP8_OP_8XY1] = opcode8_1_##profile, [CHIP8_OP_8XY2] = opcode8_2_##profile,              \
+        [CHIP8_OP_8XY3] = opcode8_3_##profile, [CHIP8_OP_8XY4] = opcode8_4, [CHIP8_OP_8XY5] = opcode8_5,                        \
+        [CHIP8_OP_8XY6] = opcode8_6_##profile, [CHIP8_OP_8XY7] = opcode8_7, [CHIP8_OP_8XYE] = opcode8_E_##profile,              \
+        [CHIP8_OP_9XY0] = nibble_9, [CHIP8_OP_ANNN] = nibble_A, [CHIP8_OP_BNNN] = nibble_B_##profile,                           \
+        [CHIP8_OP_CXNN] = nibble_C, [CHIP8_OP_DXYN] = nibble_D, [CHIP8_OP_EX9E] = opcodeE_9E, [CHIP8_OP_EXA1] = opcodeE_A1,     \
+        [CHIP8_OP_FX07] = opcodeF_07, [CHIP8_OP_FX0A] = opcodeF_0A, [CHIP8_OP_FX15] = opcodeF_15, [CHIP8_OP_FX18] = opcodeF_18, \
+        [CHIP8_OP_FX1E] = opcodeF_1E, [CHIP8_OP_FX29] = opcodeF_29, [CHIP8_OP_FX33] = opcodeF_33,                               \
+        [CHIP8_OP_FX55] = opcodeF_55_##profile, [CHIP8_OP_FX65] = opcodeF_65_##profile                                          \
+    }
+
+static const OpcodeFunctionPtr opcode_ptr[CHIP8_QUIRKS_COUNT][CHIP8_OP_COUNT] = {
+    OPCODE_TABLE(DEFAULT), OPCODE_TABLE(VIP), OPCODE_TABLE(CHIP48), OPCODE_TABLE(SCHIP)
+};
+
+static const char *const quirks_names[CHIP8_QUIRKS_COUNT] = {
+    [CHIP8_QUIRKS_DEFAULT] = "default", [CHIP8_QUIRKS_VIP] = "vip", [CHIP8_QUIRKS_CHIP48] = "chip48",
+    [CHIP8_QUIRKS_SCHIP] = "schip"
+};
+
+// Instruction class by highest nibble. The nibbles shared by several opcodes map to 0 and are looked up
+// in a second table keyed the same way the opcodes have always been told apart: by N for 0, 8 and E and
+// by NN for F.
+static const uint8_t nibble_ops[16] = {
+    [0x1] = CHIP8_OP_1NNN, [0x2] = CHIP8_OP_2NNN, [0x3] = CHIP8_OP_3XNN, [0x4] = CHIP8_OP_4XNN,
+    [0x5] = CHIP8_OP_5XY0, [0x6] = CHIP8_OP_6XNN, [0x7] = CHIP8_OP_7XNN, [0x9] = CHIP8_OP_9XY0,
+    [0xA] = CHIP8_OP_ANNN, [0xB] = CHIP8_OP_BNNN, [0xC] = CHIP8_OP_CXNN, [0xD] = CHIP8_OP_DXYN
+};
+static const uint8_t opcode0_ops[16] = {[0x0] = CHIP8_OP_00E0, [0xE] = CHIP8_OP_00EE};
+static const uint8_t opcode8_ops[16] = {[0x0] = CHIP8_OP_8XY0, [0x1] = CHIP8_OP_8XY1, [0x2] = CHIP8_OP_8XY2,
+    [0x3] = CHIP8_OP_8XY3, [0x4] = CHIP8_OP_8XY4, [0x5] = CHIP8_OP_8XY5, [0x6] = CHIP8_OP_8XY6, [0x7] = CHIP8_OP_8XY7,
+    [0xE] = CHIP8_OP_8XYE};
+static const uint8_t opcodeE_ops[16] = {[0x1] = CHIP8_OP_EXA1, [0xE] = CHIP8_OP_EX9E};
+static const uint8_t opcodeF_ops[256] = {[0x7] = CHIP8_OP_FX07, [0xA] = CHIP8_OP_FX0A, [0x15] = CHIP8_OP_FX15,
+    [0x18] = CHIP8_OP_FX18, [0x1E] = CHIP8_OP_FX1E, [0x29] = CHIP8_OP_FX29, [0x33] = CHIP8_OP_FX33, [0x55] = CHIP8_OP_FX55,
+    [0x65] = CHIP8_OP_FX65};
+
+#define CHIP8_RNG_SEED 0x2545F491u
+
+// Allocates a new instance aligned to a cache line and initializes it. The caller still has to load a
+// ROM and reset it before executing instructions.
+CHIP8OBJECT *chip8_create(void) {
+    void *block;
+
+    if (posix_memalign(&block, 64, sizeof(CHIP8OBJECT)))
+        return NULL;
+    memset(block, 0, sizeof(CHIP8OBJECT));
+#ifdef CHIP8_PROFILE
+    if (!(((CHIP8OBJECT *) block)->profile = chip8_profile_create())) {
+        free(block);
+        return NULL;
+    }
+#endif
+    chip8_init(block);
+    return block;
+}
+
+void chip8_destroy(CHIP8OBJECT *chip8) {
+    if (!chip8)
+        return;
+    chip8_shutdown(chip8);
+    chip8_jit_destroy(chip8);
+#ifdef CHIP8_PROFILE
+    chip8_profile_destroy(chip8->profile);
+#endif
+    free(chip8->romfn);
+    free(chip8);
+}
+
+void chip8_init(CHIP8OBJECT *chip8) {
+    chip8->program_counter = 0x200;
+    chip8->I = 0x200;
+    chip8->stack_pointer = 0;
+    chip8->rng_state = CHIP8_RNG_SEED;
+    chip8->instructions_per_frame = INSTRUCTIONS_PER_FRAME;
+    chip8->quirks = CHIP8_QUIRKS_DEFAULT;
+    chip8->handlers = opcode_ptr[CHIP8_QUIRKS_DEFAULT];
+    chip8->fast_forward = 1;
+    chip8->idle_backoff = 1;
+}
+
+void chip8_reset(CHIP8OBJECT *chip8) {
+    chip8_mem_reset(chip8);
+    chip8->program_counter = 0x200;
+    chip8->I = 0x200;
+    chip8->stack_pointer = 0;
+    memset(chip8->V, 0, sizeof(chip8->V));
+    memset(chip8->stack, 0, sizeof(chip8->stack));
 }
 
 // Currently not being used.
-void chip8_shutdown(void) {
+void chip8_shutdown(CHIP8OBJECT *chip8) {
+}
+
+#ifndef CHIP8_PROFILE
+// Superinstructions. Each gets the decode cache entry of the first instruction of its sequence, with the
+// others two and four entries on, runs the sequence exactly as the separate handlers would, program counter
+// included, and returns how many instructions that was.
+static uint32_t fused_ld_ld_drw(CHIP8OBJECT *chip8, const CHIP8DECODED *op) {
+    chip8->V[op[0].X] = op[0].NN;
+    chip8->V[op[2].X] = op[2].NN;
+    chip8->program_counter += 6;
+    chip8->V[0xF] = chip8_draw_sprite(chip8, chip8->I, chip8->V[op[4].X], chip8->V[op[4].Y], op[4].NN & 0xF);
+    return 3;
+}
+
+static uint32_t fused_ldi_load(CHIP8OBJECT *chip8, const CHIP8DECODED *op) {
+    chip8->I = op[0].NNN;
+    chip8->program_counter += 4;
+    chip8->handlers[CHIP8_OP_FX65](chip8, &op[2]);
+    return 2;
+}
+
+// The jump is skipped when the register matches, which makes the sequence two instructions long.
+static uint32_t fused_add_se_jp(CHIP8OBJECT *chip8, const CHIP8DECODED *op) {
+    chip8->V[op[0].X] += op[0].NN;
+    if (chip8->V[op[2].X] == op[2].NN) {
+        chip8->program_counter += 6;
+        return 2;
+    }
+    chip8->program_counter = op[4].NNN;
+    return 3;
+}
+
+static uint32_t fused_dt_se_jp(CHIP8OBJECT *chip8, const CHIP8DECODED *op) {
+    chip8->V[op[0].X] = chip8_register_read(chip8, CHIP8_REG_DELAY);
+    if (chip8->V[op[2].X] == op[2].NN) {
+        chip8->program_counter += 6;
+        return 2;
+    }
+    chip8->program_counter = op[4].NNN;
+    return 3;
+}
+
+static uint32_t (*const fused_ptr[CHIP8_FUSED_COUNT])(CHIP8OBJECT *chip8, const CHIP8DECODED *op) = {
+    [CHIP8_FUSED_LD_LD_DRW] = fused_ld_ld_drw, [CHIP8_FUSED_LDI_LOAD] = fused_ldi_load,
+    [CHIP8_FUSED_ADD_SE_JP] = fused_add_se_jp, [CHIP8_FUSED_DT_SE_JP] = fused_dt_se_jp
+};
+#endif
+
+static const char *const fused_names[CHIP8_FUSED_COUNT] = {
+    [CHIP8_FUSED_LD_LD_DRW] = "6XNN 6YNN DXYN", [CHIP8_FUSED_LDI_LOAD] = "ANNN FX65",
+    [CHIP8_FUSED_ADD_SE_JP] = "7XNN 3XNN 1NNN", [CHIP8_FUSED_DT_SE_JP] = "FX07 3XNN 1NNN"
+};
+
+// Starts the trace record of the instruction about to run. The opcode is read before it runs, since FX33 and
+// FX55 can overwrite it; the registers are filled in after.
+static inline CHIP8TRACEENTRY *trace_begin(CHIP8OBJECT *chip8) {
+    CHIP8TRACE *trace = chip8->trace;
+    CHIP8TRACEENTRY *entry = &trace->entries[trace->count++ & trace->mask];
+    uint16_t pc = chip8->program_counter & MEMORY_MASK;
+
+    entry->pc = pc;
+    entry->opcode = chip8->mem[pc] << 8 | chip8->mem[(pc + 1) & MEMORY_MASK];
+    return entry;
 }
 
 /**
- * This function first fetches an instruction from the memory indicated by the program counter and shifts
- * bits to address big-endian and immediately updates the program counter. The function calls the decode_helper
- * function to parse the opcode. Then, checks if the highest nibble of the opcode is between 0x0 and 0xF, if so,
- * then call a function through the array of function pointers based on the highest nibble. If there are multiple opcodes
- * with the same high nibble, it uses a static array of subfunction pointers to further differentiate which opcode
- * is desired.
+ * This function looks up the instruction at the program counter in the decode cache and immediately updates the
+ * program counter. If the address has not been decoded yet, or a write to memory invalidated it, chip8_decode
+ * fetches and decodes it first. Then the handler for the instruction is called through the array of function
+ * pointers with the operands that were extracted when it was decoded.
  */
-void chip8_execute_instruction(void) {
-    // First fetch the instruction from the program counter
-    chip8.opcode.unmodified = (chip8_mem_read(chip8.program_counter) << 8) | (chip8_mem_read(chip8.program_counter + 1));
-    chip8.program_counter += 2;
-    decode_helper(&chip8.opcode);
-    if (chip8.opcode.high_nibble >= 0x0 && chip8.opcode.high_nibble <= 0xF) {
-        chip8.opcode_ptr[chip8.opcode.high_nibble]();
+void chip8_execute_instruction(CHIP8OBJECT *chip8) {
+    const CHIP8DECODED *op = &chip8->decoded[chip8->program_counter & MEMORY_MASK];
+    CHIP8TRACEENTRY *entry = NULL;
+
+    if (op->op == CHIP8_OP_UNDECODED)
+        op = chip8_decode(chip8, chip8->program_counter);
+    CHIP8_PROFILE_INSTRUCTION(chip8, chip8->program_counter, op->op);
+    if (chip8->trace)
+        entry = trace_begin(chip8);
+    chip8->program_counter += 2;
+    chip8->handlers[op->op](chip8, op);
+    if (entry) {
+        entry->I = chip8->I;
+        entry->VX = chip8->V[op->X];
+        entry->VF = chip8->V[0xF];
     }
-    else {
-        printf("Out of range");
+}
+
+#ifndef CHIP8_PROFILE
+// Runs count instructions on the interpreter, a whole superinstruction at a time where the decoder marked
+// one, none of its instructions has been written over since, and all of it fits in count, so none runs past
+// a timer tick.
+static void interpret(CHIP8OBJECT *chip8, uint64_t count) {
+    const CHIP8DECODED *op;
+    uint64_t end = chip8->instructions + count;
+    uint32_t done;
+    uint16_t pc;
+    uint8_t fused;
+
+    chip8->interpreted += count;
+    while (chip8->instructions < end) {
+        pc = chip8->program_counter & MEMORY_MASK;
+        op = &chip8->decoded[pc];
+        fused = chip8->fused[pc];
+        if (fused && end - chip8->instructions >= CHIP8_FUSED_MAX && op[0].op != CHIP8_OP_UNDECODED &&
+            op[2].op != CHIP8_OP_UNDECODED && op[4].op != CHIP8_OP_UNDECODED) {
+            done = fused_ptr[fused](chip8, op);
+            ++chip8->fused_runs[fused];
+            chip8->fused_instructions += done;
+            chip8->instructions += done;
+            continue;
+        }
+        // What chip8_execute_instruction does, less the trace.
+        if (op->op == CHIP8_OP_UNDECODED)
+            op = chip8_decode(chip8, pc);
+        chip8->program_counter += 2;
+        chip8->handlers[op->op](chip8, op);
+        ++chip8->instructions;
     }
 }
+#endif
 
-// Highest Nibble: 0
-void nibble_0(void) {
-    static OpcodeFunctionPtr opcode0[16] = {[0x0] = opcode0_E0, [0xE] = opcode0_EE};
-    if (chip8.opcode.N >= 0x0 && chip8.opcode.N <= 0xF) {
-        opcode0[chip8.opcode.N]();
+static void run_engine(CHIP8OBJECT *chip8, uint64_t count) {
+    uint64_t i, n, start;
+
+    if (chip8->engine == CHIP8_ENGINE_THREADED && !chip8->trace) {
+        chip8_threaded_run(chip8, count);
+        return;
     }
-    else {
-        printf("Out of range");
+
+    while (count) {
+        start = chip8->instructions;
+        n = chip8->instructions_per_frame - start % chip8->instructions_per_frame;
+        if (n > count)
+            n = count;
+        // Only the interpreter writes the trace.
+        switch (chip8->trace ? CHIP8_ENGINE_INTERPRETER : chip8->engine) {
+            case CHIP8_ENGINE_JIT:
+                chip8_jit_run(chip8, n);
+                break;
+            case CHIP8_ENGINE_AOT:
+                chip8_aot_run(chip8, n);
+                break;
+            default:
+#ifndef CHIP8_PROFILE
+                // Traced and profiled runs see every instruction on its own.
+                if (!chip8->trace) {
+                    interpret(chip8, n);
+                    break;
+                }
+#endif
+                for (i = 0; i < n; ++i, ++chip8->instructions) {
+                    chip8_execute_instruction(chip8);
+                }
+                break;
+        }
+        chip8->instructions = start + n;
+        count -= n;
+        if (chip8->instructions % chip8->instructions_per_frame == 0)
+            chip8_tick_timers(chip8);
+    }
+}
+
+// Executes count instructions. The timers tick once every instructions_per_frame instructions counted
+// from creation, so running one frame at a time in the window and millions at a time headless behave the same.
+// While an instruction runs, chip8->instructions is the number executed before it, which is how the sound
+// timer knows when FX18 ran within the frame. Every so often chip8_idle_run gets a look first, and skips
+// the instructions of a busy-wait loop instead of having the engine run them.
+void chip8_run(CHIP8OBJECT *chip8, uint64_t count) {
+    uint64_t n;
+
+    while (count) {
+        n = count;
+        if (chip8->fast_forward) {
+            if (!chip8->idle_wait) {
+                count -= chip8_idle_run(chip8, count);
+                continue;
+            }
+            if (n > chip8->idle_wait)
+                n = chip8->idle_wait;
+            chip8->idle_wait -= n;
+        }
+        run_engine(chip8, n);
+        count -= n;
+    }
+}
+
+// Turns idle-loop fast-forward on or off; it is on by default. It never changes what a ROM does, only how
+// much host time waiting takes.
+void chip8_set_fast_forward(CHIP8OBJECT *chip8, int enable) {
+    chip8->fast_forward = enable != 0;
+    chip8->idle_wait = 0;
+}
+
+// Sets how many instructions run per 60 Hz timer tick, which makes the CPU speed count * CHIP8_FRAME_RATE
+// instructions per second. Frames are counted from creation, so changing it mid-run can shorten one frame.
+void chip8_set_frame_instructions(CHIP8OBJECT *chip8, uint32_t count) {
+    chip8->instructions_per_frame = count ? count : 1;
+}
+
+// Seeds the generator CXNN draws from. xorshift never leaves 0, so a seed of 0 picks the default seed.
+void chip8_seed(CHIP8OBJECT *chip8, uint32_t seed) {
+    chip8->rng_state = seed ? seed : CHIP8_RNG_SEED;
+}
+
+// Selects the engine that chip8_run uses and returns the one actually selected, which is the interpreter
+// when the requested engine is not available on this host, or for CHIP8_ENGINE_AOT when no compiled ROM
+// linked into the program matches the one loaded. Profiling builds have neither recompiler, since
+// translated code runs whole blocks without passing through the profiling hook.
+int chip8_set_engine(CHIP8OBJECT *chip8, int engine) {
+    chip8->aot = NULL;
+    chip8->aot_valid = 0;
+#ifndef CHIP8_PROFILE
+    if (engine == CHIP8_ENGINE_AOT && (chip8->aot = chip8_aot_find(chip8))) {
+        chip8_jit_destroy(chip8);
+        chip8->aot_valid = 1;
+        chip8->engine = CHIP8_ENGINE_AOT;
+        return chip8->engine;
     }
+    if (engine == CHIP8_ENGINE_JIT && (chip8->jit || !chip8_jit_create(chip8))) {
+        chip8->engine = CHIP8_ENGINE_JIT;
+        return chip8->engine;
+    }
+#endif
+
+    chip8_jit_destroy(chip8);
+#ifdef CHIP8_HAVE_THREADED
+    if (engine == CHIP8_ENGINE_THREADED)
+        chip8->engine = CHIP8_ENGINE_THREADED;
+    else
+#endif
+        chip8->engine = CHIP8_ENGINE_INTERPRETER;
+
+    return chip8->engine;
 }
+
+// Selects the quirk profile the instance runs with, normally once when the ROM is loaded. Every engine
+// has a copy compiled for each profile, so this only repoints the instance at those; code the recompiler
+// translated for the previous profile is thrown away.
+void chip8_set_quirks(CHIP8OBJECT *chip8, int profile) {
+    if (profile < 0 || profile >= CHIP8_QUIRKS_COUNT)
+        profile = CHIP8_QUIRKS_DEFAULT;
+    if (chip8->quirks == profile)
+        return;
+    if (chip8->jit)
+        chip8_jit_flush(chip8);
+    chip8->quirks = profile;
+    chip8->handlers = opcode_ptr[profile];
+    if (chip8->aot)
+        chip8_aot_validate(chip8);
+}
+
+// Prints how much of what the interpreter ran went through superinstructions, and how often each ran.
+void chip8_fused_report(const CHIP8OBJECT *chip8, FILE *out) {
+    int i;
+
+    fprintf(out, "Fused:             %.1f%% of %llu interpreted instructions\n",
+            chip8->interpreted ? 100.0 * chip8->fused_instructions / chip8->interpreted : 0.0,
+            (unsigned long long) chip8->interpreted);
+    for (i = CHIP8_FUSED_NONE + 1; i < CHIP8_FUSED_COUNT; ++i) {
+        fprintf(out, "  %-16s %14llu runs\n", fused_names[i], (unsigned long long) chip8->fused_runs[i]);
+    }
+}
+
+// Looks a quirk profile up by name, returns -1 if there is none by that name.
+int chip8_find_quirks(const char *name) {
+    int profile;
+
+    for (profile = 0; profile < CHIP8_QUIRKS_COUNT; ++profile) {
+        if (!strcmp(name, quirks_names[profile]))
+            return profile;
+    }
+    return -1;
+}
+
+const char *chip8_quirks_name(int profile) {
+    return profile >= 0 && profile < CHIP8_QUIRKS_COUNT ? quirks_names[profile] : "unknown";
+}
+
+// The handler the instance's quirk profile runs op with.
+OpcodeFunctionPtr chip8_opcode_handler(const CHIP8OBJECT *chip8, uint8_t op) {
+    return op < CHIP8_OP_COUNT ? chip8->handlers[op] : NULL;
+}
+
+// xorshift32, kept per instance so CXNN neither shares state between instances nor takes libc's lock.
+uint8_t chip8_random(CHIP8OBJECT *chip8) {
+    uint32_t x = chip8->rng_state;
+
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    chip8->rng_state = x;
+    return x >> 24;
+}
+
+// Opcodes that are not part of the instruction set, including 0NNN, do nothing.
+static void opcode_unknown(CHIP8OBJECT *chip8, const CHIP8DECODED *op) {
+}
+
+// Highest Nibble: 0
 // 00E0
-void opcode0_E0(void) {
-    chip8_clear_frame();
+static void opcode0_E0(CHIP8OBJECT *chip8, const CHIP8DECODED *op) {
+    chip8_clear_frame(chip8);
 }
 // 00EE
-void opcode0_EE(void) {
-    chip8.stack_pointer--;
-    chip8.program_counter = *chip8.stack_pointer;
+static void opcode0_EE(CHIP8OBJECT *chip8, const CHIP8DECODED *op) {
+    chip8->stack_pointer = (chip8->stack_pointer - 1) & STACK_MASK;
+    chip8->program_counter = chip8->stack[chip8->stack_pointer];
 }
 
 // Highest Nibble: 1
-void nibble_1(void) {
-    chip8.program_counter = chip8.opcode.NNN;
+static void nibble_1(CHIP8OBJECT *chip8, const CHIP8DECODED *op) {
+    chip8->program_counter = op->NNN;
 }
 
 // Highest Nibble: 2
-void nibble_2(void) {
-    *chip8.stack_pointer = chip8.program_counter;
-    chip8.program_counter = chip8.opcode.NNN;
-    chip8.stack_pointer++;
+static void nibble_2(CHIP8OBJECT *chip8, const CHIP8DECODED *op) {
+    chip8->stack[chip8->stack_pointer] = chip8->program_counter;
+    chip8->program_counter = op->NNN;
+    chip8->stack_pointer = (chip8->stack_pointer + 1) & STACK_MASK;
 }
 
 // Highest Nibble: 3
-void nibble_3(void) {
-    if (chip8.V[chip8.opcode.X] == chip8.opcode.NN) {
-        chip8.program_counter += 2;
+static void nibble_3(CHIP8OBJECT *chip8, const CHIP8DECODED *op) {
+    if (chip8->V[op->X] == op->NN) {
+        chip8->program_counter += 2;
     }
 }
 
 // Highest Nibble: 4
-void nibble_4(void) {
-    if (chip8.V[chip8.opcode.X] != chip8.opcode.NN) {
-        chip8.program_counter += 2;
+static void nibble_4(CHIP8OBJECT *chip8, const CHIP8DECODED *op) {
+    if (chip8->V[op->X] != op->NN) {
+        chip8->program_counter += 2;
     }
 }
 
 // Highest Nibble: 5
-void nibble_5(void) {
-    if (chip8.V[chip8.opcode.X] == chip8.V[chip8.opcode.Y]) {
-        chip8.program_counter += 2;
+static void nibble_5(CHIP8OBJECT *chip8, const CHIP8DECODED *op) {
+    if (chip8->V[op->X] == chip8->V[op->Y]) {
+        chip8->program_counter += 2;
     }
 }
 
 // Highest Nibble: 6
-void nibble_6(void) {
-    chip8.V[chip8.opcode.X] = chip8.opcode.NN;
+static void nibble_6(CHIP8OBJECT *chip8, const CHIP8DECODED *op) {
+    chip8->V[op->X] = op->NN;
 }
 
 // Highest Nibble: 7
-void nibble_7(void) {
-    chip8.V[chip8.opcode.X] += chip8.opcode.NN;
+static void nibble_7(CHIP8OBJECT *chip8, const CHIP8DECODED *op) {
+    chip8->V[op->X] += op->NN;
 }
 
 // Highest Nibble: 8
-void nibble_8(void) {
-    static OpcodeFunctionPtr opcode8[16] = {[0x0] = opcode8_0, [0x1] = opcode8_1, [0x2] = opcode8_2,
-    [0x3] = opcode8_3, [0x4] = opcode8_4, [0x5] = opcode8_5, [0x6] = opcode8_6, [0x7] = opcode8_7,
-    [0xE] = opcode8_E};
-    if (chip8.opcode.N >= 0x0 && chip8.opcode.N <= 0xF) {
-        opcode8[chip8.opcode.N]();
-    }
-    else {
-        printf("Out of range");
-    }
-}
 // 8XY0
-void opcode8_0(void) {
-    chip8.V[chip8.opcode.X] = chip8.V[chip8.opcode.Y];
+static void opcode8_0(CHIP8OBJECT *chip8, const CHIP8DECODED *op) {
+    chip8->V[op->X] = chip8->V[op->Y];
 }
 // 8XY1
-void opcode8_1(void) {
-    chip8.V[chip8.opcode.X] |= chip8.V[chip8.opcode.Y];
+static inline void opcode8_1(CHIP8OBJECT *chip8, const CHIP8DECODED *op, int quirks) {
+    chip8->V[op->X] |= chip8->V[op->Y];
+    if (quirks & CHIP8_QUIRK_VF_RESET)
+        chip8->V[0xF] = 0;
 }
 // 8XY2
-void opcode8_2(void) {
-    chip8.V[chip8.opcode.X] &= chip8.V[chip8.opcode.Y];
+static inline void opcode8_2(CHIP8OBJECT *chip8, const CHIP8DECODED *op, int quirks) {
+    chip8->V[op->X] &= chip8->V[op->Y];
+    if (quirks & CHIP8_QUIRK_VF_RESET)
+        chip8->V[0xF] = 0;
 }
 // 8XY3
-void opcode8_3(void) {
-    chip8.V[chip8.opcode.X] ^= chip8.V[chip8.opcode.Y];
+static inline void opcode8_3(CHIP8OBJECT *chip8, const CHIP8DECODED *op, int quirks) {
+    chip8->V[op->X] ^= chip8->V[op->Y];
+    if (quirks & CHIP8_QUIRK_VF_RESET)
+        chip8->V[0xF] = 0;
 }
 // 8XY4
-void opcode8_4(void) {
-    if (chip8.V[chip8.opcode.X] + chip8.V[chip8.opcode.Y] > 0xFF) {
-        chip8.V[0xF] = 1;
+static void opcode8_4(CHIP8OBJECT *chip8, const CHIP8DECODED *op) {
+    if (chip8->V[op->X] + chip8->V[op->Y] > 0xFF) {
+        chip8->V[0xF] = 1;
     }
     else {
-        chip8.V[0xF] = 0;
+        chip8->V[0xF] = 0;
     }
-    chip8.V[chip8.opcode.X] += chip8.V[chip8.opcode.Y];
+    chip8->V[op->X] += chip8->V[op->Y];
 }
 // 8XY5
-void opcode8_5(void) {
-    if (chip8.V[chip8.opcode.X] >= chip8.V[chip8.opcode.Y]) {
-        chip8.V[0xF] = 1;
+static void opcode8_5(CHIP8OBJECT *chip8, const CHIP8DECODED *op) {
+    if (chip8->V[op->X] >= chip8->V[op->Y]) {
+        chip8->V[0xF] = 1;
     }
     else {
-        chip8.V[0xF] = 0;
+        chip8->V[0xF] = 0;
     }
-    chip8.V[chip8.opcode.X] -= chip8.V[chip8.opcode.Y];
+    chip8->V[op->X] -= chip8->V[op->Y];
 }
 // 8XY6
-void opcode8_6(void) {
-    chip8.V[0xF] = chip8.V[chip8.opcode.X] & 0x1;
-    chip8.V[chip8.opcode.X] >>= 1;
+static inline void opcode8_6(CHIP8OBJECT *chip8, const CHIP8DECODED *op, int quirks) {
+    if (quirks & CHIP8_QUIRK_SHIFT_VY)
+        chip8->V[op->X] = chip8->V[op->Y];
+    chip8->V[0xF] = chip8->V[op->X] & 0x1;
+    chip8->V[op->X] >>= 1;
 }
 // 8XY7
-void opcode8_7(void) {
-    if (chip8.V[chip8.opcode.Y] >= chip8.V[chip8.opcode.X]) {
-        chip8.V[0xF] = 1;
+static void opcode8_7(CHIP8OBJECT *chip8, const CHIP8DECODED *op) {
+    if (chip8->V[op->Y] >= chip8->V[op->X]) {
+        chip8->V[0xF] = 1;
     }
     else {
-        chip8.V[0xF] = 0;
+        chip8->V[0xF] = 0;
     }
-    chip8.V[chip8.opcode.X] = chip8.V[chip8.opcode.Y] - chip8.V[chip8.opcode.X];
+    chip8->V[op->X] = chip8->V[op->Y] - chip8->V[op->X];
 }
 // 8XYE
-void opcode8_E(void) {
-    if ((chip8.V[chip8.opcode.X] & 0x80) == 0x80) {
-        chip8.V[0xF] = 1;
+static inline void opcode8_E(CHIP8OBJECT *chip8, const CHIP8DECODED *op, int quirks) {
+    if (quirks & CHIP8_QUIRK_SHIFT_VY)
+        chip8->V[op->X] = chip8->V[op->Y];
+    if ((chip8->V[op->X] & 0x80) == 0x80) {
+        chip8->V[0xF] = 1;
     }
     else {
-        chip8.V[0xF] = 0;
+        chip8->V[0xF] = 0;
     }
-    chip8.V[chip8.opcode.X] <<= 1;
+    chip8->V[op->X] <<= 1;
 }
 
 // Highest Nibble: 9
-void nibble_9(void) {
-    if (chip8.V[chip8.opcode.X] != chip8.V[chip8.opcode.Y]) {
-        chip8.program_counter += 2;
+static void nibble_9(CHIP8OBJECT *chip8, const CHIP8DECODED *op) {
+    if (chip8->V[op->X] != chip8->V[op->Y]) {
+        chip8->program_counter += 2;
     }
 }
 
 // Highest Nibble: A
-void nibble_A(void) {
-    chip8.I = chip8.opcode.NNN;
+static void nibble_A(CHIP8OBJECT *chip8, const CHIP8DECODED *op) {
+    chip8->I = op->NNN;
 }
 
 // Highest Nibble: B
-void nibble_B(void) {
-    chip8.program_counter = chip8.opcode.NNN + chip8.V[0x0];
+static inline void nibble_B(CHIP8OBJECT *chip8, const CHIP8DECODED *op, int quirks) {
+    chip8->program_counter = op->NNN + chip8->V[quirks & CHIP8_QUIRK_JUMP_VX ? op->X : 0x0];
 }
 
 // Highest Nibble: C
-void nibble_C(void) {
-    chip8.V[chip8.opcode.X] = (rand() % 256) & chip8.opcode.NN;
+static void nibble_C(CHIP8OBJECT *chip8, const CHIP8DECODED *op) {
+    chip8->V[op->X] = chip8_random(chip8) & op->NN;
 }
 
 // Highest Nibble: D
-void nibble_D(void) {
-    int collision = chip8_draw_sprite(chip8.I, chip8.V[chip8.opcode.X], chip8.V[chip8.opcode.Y], chip8.opcode.N);
-    chip8.V[0xF] = collision;
+static void nibble_D(CHIP8OBJECT *chip8, const CHIP8DECODED *op) {
+    int collision = chip8_draw_sprite(chip8, chip8->I, chip8->V[op->X], chip8->V[op->Y], (op->NN & 0xF));
+    chip8->V[0xF] = collision;
 }
 
 // Highest Nibble: E
-void nibble_E(void) {
-    static OpcodeFunctionPtr opcodeE[16] = {[0x1] = opcodeE_A1, [0xE] = opcodeE_9E};
-    if (chip8.opcode.N >= 0x0 && chip8.opcode.N <= 0xF) {
-        opcodeE[chip8.opcode.N]();
-    }
-    else {
-        printf("Out of range");
-    }
-}
 // EXA1
-void opcodeE_A1(void) {
-    if (!chip8_register_read(chip8.V[chip8.opcode.X] & 0xF)) {
-        chip8.program_counter += 2;
+static void opcodeE_A1(CHIP8OBJECT *chip8, const CHIP8DECODED *op) {
+    if (!chip8_register_read(chip8, chip8->V[op->X] & 0xF)) {
+        chip8->program_counter += 2;
     }
 }
 // EX9E
-void opcodeE_9E(void) {
-    if (chip8_register_read(chip8.V[chip8.opcode.X] & 0xF)) {
-        chip8.program_counter += 2;
+static void opcodeE_9E(CHIP8OBJECT *chip8, const CHIP8DECODED *op) {
+    if (chip8_register_read(chip8, chip8->V[op->X] & 0xF)) {
+        chip8->program_counter += 2;
     }
 }
 
 // Highest Nibble: F
-void nibble_F(void) {
-    static OpcodeFunctionPtr opcodeF[256] = {[0x7] = opcodeF_07, [0xA] = opcodeF_0A, [0x15] = opcodeF_15,
-    [0x18] = opcodeF_18, [0x1E] = opcodeF_1E, [0x29] = opcodeF_29, [0x33] = opcodeF_33, [0x55] = opcodeF_55,
-    [0x65] = opcodeF_65};
-    if (chip8.opcode.NN >= 0x0 && chip8.opcode.NN <= 0xFF) {
-        opcodeF[chip8.opcode.NN]();
-    }
-    else {
-        printf("Out of range");
-    }
-}
 // FX07
-void opcodeF_07(void) {
-    chip8.V[chip8.opcode.X] = chip8_register_read(0x10);
+static void opcodeF_07(CHIP8OBJECT *chip8, const CHIP8DECODED *op) {
+    chip8->V[op->X] = chip8_register_read(chip8, 0x10);
 }
 // FX0A
-void opcodeF_0A(void) {
-    chip8.program_counter -= 2;
+static void opcodeF_0A(CHIP8OBJECT *chip8, const CHIP8DECODED *op) {
+    chip8->program_counter -= 2;
     for (uint8_t i = 0x0; i < 0x10; i++) {
-        if (chip8_register_read(i)) {
-            chip8.V[chip8.opcode.X] = chip8_register_read(i);
-            chip8.program_counter += 2;
+        if (chip8_register_read(chip8, i)) {
+            chip8->V[op->X] = chip8_register_read(chip8, i);
+            chip8->program_counter += 2;
             return;
         }
     }
 }
 // FX15
-void opcodeF_15(void) {
-    chip8_register_write(0x10, chip8.V[chip8.opcode.X]);
+static void opcodeF_15(CHIP8OBJECT *chip8, const CHIP8DECODED *op) {
+    chip8_register_write(chip8, 0x10, chip8->V[op->X]);
 }
 // FX18
-void opcodeF_18(void) {
-    chip8_register_write(0x11, chip8.V[chip8.opcode.X]);
+static void opcodeF_18(CHIP8OBJECT *chip8, const CHIP8DECODED *op) {
+    chip8_register_write(chip8, 0x11, chip8->V[op->X]);
 }
 // FX1E
-void opcodeF_1E(void) {
-    chip8.I += (uint16_t)chip8.V[chip8.opcode.X];
+static void opcodeF_1E(CHIP8OBJECT *chip8, const CHIP8DECODED *op) {
+    chip8->I += (uint16_t)chip8->V[op->X];
 }
 // FX29
-void opcodeF_29(void) {
-    chip8.I = 5 * (chip8.V[chip8.opcode.X] & 0xF);
+static void opcodeF_29(CHIP8OBJECT *chip8, const CHIP8DECODED *op) {
+    chip8->I = 5 * (chip8->V[op->X] & 0xF);
 }
 // FX33
-void opcodeF_33(void) {
-    set_BCD();
+static void opcodeF_33(CHIP8OBJECT *chip8, const CHIP8DECODED *op) {
+    set_BCD(chip8, op);
 }
 // This helper function parses the data in V[x] register and writes it to memory based on the hundreds, tens, and ones digits for opcode FX33.
-void set_BCD(void) {
-    chip8_mem_write(chip8.I, chip8.V[chip8.opcode.X] / 100);
-    chip8_mem_write(chip8.I + 1, (chip8.V[chip8.opcode.X] / 10) % 10);
-    chip8_mem_write(chip8.I + 2, chip8.V[chip8.opcode.X] % 10);
+static void set_BCD(CHIP8OBJECT *chip8, const CHIP8DECODED *op) {
+    chip8_mem_write(chip8, chip8->I, chip8->V[op->X] / 100);
+    chip8_mem_write(chip8, chip8->I + 1, (chip8->V[op->X] / 10) % 10);
+    chip8_mem_write(chip8, chip8->I + 2, chip8->V[op->X] % 10);
 }
 // FX55
-void opcodeF_55(void) {
-    for (uint8_t i = 0x0; i <= chip8.opcode.X; i++) {
-        chip8_mem_write(chip8.I + i, chip8.V[i]);
+static inline void opcodeF_55(CHIP8OBJECT *chip8, const CHIP8DECODED *op, int quirks) {
+    for (uint8_t i = 0x0; i <= op->X; i++) {
+        chip8_mem_write(chip8, chip8->I + i, chip8->V[i]);
     }
+    if (quirks & CHIP8_QUIRK_LOAD_X1)
+        chip8->I += op->X + 1;
+    if (quirks & CHIP8_QUIRK_LOAD_X)
+        chip8->I += op->X;
 }
 // FX65
-void opcodeF_65(void) {
-    for (uint8_t i = 0x0; i <= chip8.opcode.X; i++) {
-        chip8.V[i] = chip8_mem_read(chip8.I + i);
+static inline void opcodeF_65(CHIP8OBJECT *chip8, const CHIP8DECODED *op, int quirks) {
+    for (uint8_t i = 0x0; i <= op->X; i++) {
+        chip8->V[i] = chip8_mem_read(chip8, chip8->I + i);
+    }
+    if (quirks & CHIP8_QUIRK_LOAD_X1)
+        chip8->I += op->X + 1;
+    if (quirks & CHIP8_QUIRK_LOAD_X)
+        chip8->I += op->X;
+}
+
+
+// Resolves a parsed opcode to its instruction class through the nibble tables.
+uint8_t chip8_resolve_op(const CHIP8FULLOPCODE *opcode) {
+    uint8_t op;
+
+    switch (opcode->high_nibble) {
+        case 0x0:
+            op = opcode0_ops[opcode->N];
+            break;
+        case 0x8:
+            op = opcode8_ops[opcode->N];
+            break;
+        case 0xE:
+            op = opcodeE_ops[opcode->N];
+            break;
+        case 0xF:
+            op = opcodeF_ops[opcode->NN];
+            break;
+        default:
+            op = nibble_ops[opcode->high_nibble];
+            break;
     }
+
+    return op ? op : CHIP8_OP_UNKNOWN;
+}
+
+// Fetches the opcode at address, shifting the bytes to address big-endian, parses it with decode_helper and
+// stores the result in the decode cache entry for that address. The superinstruction marks of the sequences
+// the instruction can be part of are dropped, since it may no longer be what they were made from.
+static const CHIP8DECODED *decode(CHIP8OBJECT *chip8, uint16_t address) {
+    CHIP8DECODED *entry = &chip8->decoded[address & MEMORY_MASK];
+    CHIP8FULLOPCODE opcode;
+
+    chip8->fused[address & MEMORY_MASK] = CHIP8_FUSED_NONE;
+    chip8->fused[(address - 2) & MEMORY_MASK] = CHIP8_FUSED_NONE;
+    chip8->fused[(address - 4) & MEMORY_MASK] = CHIP8_FUSED_NONE;
+
+    opcode.unmodified = (chip8_mem_read(chip8, address) << 8) | chip8_mem_read(chip8, address + 1);
+    decode_helper(&opcode);
+    entry->X = opcode.X;
+    entry->Y = opcode.Y;
+    entry->NN = opcode.NN;
+    entry->NNN = opcode.NNN;
+    entry->op = chip8_resolve_op(&opcode);
+    return entry;
+}
+
+// Marks the superinstruction, if any, that starts at address. The two instructions after the first are
+// recognised from their bytes, which is all the sequences need, and only decoded when they complete one;
+// sequences that would wrap around memory are left alone. A write to any of the bytes invalidates one of the
+// three decode cache entries, and decoding it again drops the mark.
+static void fuse(CHIP8OBJECT *chip8, uint16_t address, uint8_t first) {
+    const uint8_t *next = &chip8->mem[address + 2];
+    uint8_t fused = CHIP8_FUSED_NONE;
+
+    if (address > MEMORY_SIZE - CHIP8_FUSED_BYTES)
+        return;
+    if (first == CHIP8_OP_6XNN && next[0] >> 4 == 0x6 && next[2] >> 4 == 0xD)
+        fused = CHIP8_FUSED_LD_LD_DRW;
+    else if (first == CHIP8_OP_ANNN && next[0] >> 4 == 0xF && next[1] == 0x65)
+        fused = CHIP8_FUSED_LDI_LOAD;
+    else if (first == CHIP8_OP_7XNN && next[0] >> 4 == 0x3 && next[2] >> 4 == 0x1)
+        fused = CHIP8_FUSED_ADD_SE_JP;
+    else if (first == CHIP8_OP_FX07 && next[0] >> 4 == 0x3 && next[2] >> 4 == 0x1)
+        fused = CHIP8_FUSED_DT_SE_JP;
+    if (!fused)
+        return;
+    // Both may start sequences of their own. Decoding only moves forward from here, so this ends.
+    if (chip8->decoded[address + 2].op == CHIP8_OP_UNDECODED)
+        chip8_decode(chip8, address + 2);
+    if (chip8->decoded[address + 4].op == CHIP8_OP_UNDECODED)
+        chip8_decode(chip8, address + 4);
+    chip8->fused[address] = fused;
 }
 
+// Decodes the instruction at address into the decode cache and, when it is one that begins a
+// superinstruction, looks for the rest of the sequence.
+const CHIP8DECODED *chip8_decode(CHIP8OBJECT *chip8, uint16_t address) {
+    const CHIP8DECODED *entry = decode(chip8, address);
+
+    switch (entry->op) {
+        case CHIP8_OP_6XNN:
+        case CHIP8_OP_7XNN:
+        case CHIP8_OP_ANNN:
+        case CHIP8_OP_FX07:
+            fuse(chip8, address & MEMORY_MASK, entry->op);
+            break;
+    }
+    return entry;
+}
 
 // This function parses the opcode and bit masks them for simplicity.
 void decode_helper(CHIP8FULLOPCODE *opcode) {
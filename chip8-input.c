@@ -0,0 +1,250 @@
+#define _XOPEN_SOURCE 700
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "chip8.h"
+
+#define CHIP8_INPUT_MAGIC 0x49384843u // "CH8I" read as a little-endian word
+#define CHIP8_INPUT_VERSION 1
+
+// File header, followed by one varint instruction delta and one (type << 4 | key) byte per event. Like
+// save states it is written in host byte order.
+typedef struct {
+    uint32_t magic;
+    uint16_t version;
+    uint8_t quirks;
+    uint8_t reserved;
+    uint32_t instructions_per_frame;
+    uint32_t rng_state;
+    uint64_t start;
+    uint64_t end;
+    uint64_t hash;
+    uint64_t count;
+} CHIP8INPUTHEADER;
+
+/**
+ * Starts a recording of the instance from where it is now. Replaying it needs an instance in the same
+ * state, which after chip8_reset is any instance with the same ROM; the RNG state, speed and quirk profile
+ * are stored so those do not have to be given again.
+ */
+CHIP8RECORDING *chip8_recording_create(const CHIP8OBJECT *chip8) {
+    CHIP8RECORDING *recording;
+
+    if (!(recording = calloc(1, sizeof(CHIP8RECORDING))))
+        return NULL;
+    recording->instructions_per_frame = chip8->instructions_per_frame;
+    recording->rng_state = chip8->rng_state;
+    recording->quirks = chip8->quirks;
+    recording->start = chip8->instructions;
+    return recording;
+}
+
+void chip8_recording_destroy(CHIP8RECORDING *recording) {
+    if (!recording)
+        return;
+    free(recording->events);
+    free(recording);
+}
+
+static int append(CHIP8RECORDING *recording, uint64_t instructions, uint8_t type, uint8_t key) {
+    CHIP8INPUT *events;
+    size_t capacity;
+
+    if (recording->count == recording->capacity) {
+        capacity = recording->capacity ? recording->capacity * 2 : 256;
+        if (!(events = realloc(recording->events, capacity * sizeof(CHIP8INPUT))))
+            return -1;
+        recording->events = events;
+        recording->capacity = capacity;
+    }
+
+    recording->events[recording->count].instructions = instructions;
+    recording->events[recording->count].type = type;
+    recording->events[recording->count].key = key;
+    ++recording->count;
+    return 0;
+}
+
+// Presses or releases a key on the instance and logs it if it changed anything. recording may be NULL,
+// so the front end calls this whether it is recording or not.
+int chip8_record_key(CHIP8RECORDING *recording, CHIP8OBJECT *chip8, uint8_t key, int pressed) {
+    pressed = pressed != 0;
+    if (chip8->buttons[key & 0xF] == pressed)
+        return 0;
+
+    chip8->buttons[key & 0xF] = (uint8_t) pressed;
+    if (!recording)
+        return 0;
+    return append(recording, chip8->instructions, pressed ? CHIP8_INPUT_KEY_DOWN : CHIP8_INPUT_KEY_UP, key & 0xF);
+}
+
+int chip8_record_reset(CHIP8RECORDING *recording, CHIP8OBJECT *chip8) {
+    chip8_reset(chip8);
+    if (!recording)
+        return 0;
+    return append(recording, chip8->instructions, CHIP8_INPUT_RESET, 0);
+}
+
+// Forgets every event from instructions on, for when the instance is rewound to a state saved at that
+// point: the state was saved before the input that arrived at the same instruction count was applied.
+void chip8_recording_truncate(CHIP8RECORDING *recording, uint64_t instructions) {
+    while (recording->count && recording->events[recording->count - 1].instructions >= instructions) {
+        --recording->count;
+    }
+}
+
+static uint8_t *put_varint(uint8_t *out, uint64_t value) {
+    while (value >= 0x80) {
+        *out++ = (uint8_t) (value | 0x80);
+        value >>= 7;
+    }
+    *out++ = (uint8_t) value;
+    return out;
+}
+
+// Ends the recording at the instance's current instruction count and framebuffer, which replay checks it
+// arrives at, and writes it out. Most events are two or three bytes.
+int chip8_recording_write(CHIP8RECORDING *recording, const CHIP8OBJECT *chip8, const char *filename) {
+    CHIP8INPUTHEADER header;
+    FILE *fileptr;
+    uint8_t *buffer, *p;
+    uint64_t last;
+    size_t i;
+    int result = 0;
+
+    recording->end = chip8->instructions;
+    recording->hash = chip8_framebuffer_hash(chip8);
+
+    memset(&header, 0, sizeof(header));
+    header.magic = CHIP8_INPUT_MAGIC;
+    header.version = CHIP8_INPUT_VERSION;
+    header.instructions_per_frame = recording->instructions_per_frame;
+    header.rng_state = recording->rng_state;
+    header.quirks = recording->quirks;
+    header.start = recording->start;
+    header.end = recording->end;
+    header.hash = recording->hash;
+    header.count = recording->count;
+
+    if (!(buffer = malloc(recording->count * 11 + 1)))
+        return -1;
+    p = buffer;
+    last = recording->start;
+    for (i = 0; i < recording->count; ++i) {
+        p = put_varint(p, recording->events[i].instructions - last);
+        *p++ = (uint8_t) (recording->events[i].type << 4 | recording->events[i].key);
+        last = recording->events[i].instructions;
+    }
+
+    if (!(fileptr = fopen(filename, "wb"))) {
+        fprintf(stderr, "Could not create input recording: %s\n", filename);
+        free(buffer);
+        return -1;
+    }
+    if (fwrite(&header, sizeof(header), 1, fileptr) != 1 ||
+        fwrite(buffer, 1, (size_t) (p - buffer), fileptr) != (size_t) (p - buffer)) {
+        fprintf(stderr, "Could not write input recording: %s\n", filename);
+        result = -1;
+    }
+
+    free(buffer);
+    if (fclose(fileptr))
+        result = -1;
+    return result;
+}
+
+static int get_varint(FILE *fileptr, uint64_t *value) {
+    int c, shift = 0;
+
+    *value = 0;
+    do {
+        if ((c = fgetc(fileptr)) == EOF || shift > 63)
+            return -1;
+        *value |= (uint64_t) (c & 0x7F) << shift;
+        shift += 7;
+    } while (c & 0x80);
+    return 0;
+}
+
+CHIP8RECORDING *chip8_recording_read(const char *filename) {
+    CHIP8INPUTHEADER header;
+    CHIP8RECORDING *recording = NULL;
+    FILE *fileptr;
+    uint64_t delta, last, i;
+    int c;
+
+    if (!(fileptr = fopen(filename, "rb"))) {
+        fprintf(stderr, "Could not open input recording: %s\n", filename);
+        return NULL;
+    }
+    if (fread(&header, sizeof(header), 1, fileptr) != 1 || header.magic != CHIP8_INPUT_MAGIC ||
+        header.version != CHIP8_INPUT_VERSION) {
+        fprintf(stderr, "Not an input recording of this version: %s\n", filename);
+        goto fail;
+    }
+    if (!(recording = calloc(1, sizeof(CHIP8RECORDING))) ||
+        (header.count && !(recording->events = malloc(header.count * sizeof(CHIP8INPUT)))))
+        goto fail;
+
+    recording->instructions_per_frame = header.instructions_per_frame;
+    recording->rng_state = header.rng_state;
+    recording->quirks = header.quirks;
+    recording->start = header.start;
+    recording->end = header.end;
+    recording->hash = header.hash;
+    recording->capacity = header.count;
+
+    last = header.start;
+    for (i = 0; i < header.count; ++i) {
+        if (get_varint(fileptr, &delta) || (c = fgetc(fileptr)) == EOF) {
+            fprintf(stderr, "Input recording is truncated: %s\n", filename);
+            goto fail;
+        }
+        last += delta;
+        recording->events[i].instructions = last;
+        recording->events[i].type = (uint8_t) (c >> 4);
+        recording->events[i].key = (uint8_t) (c & 0xF);
+    }
+    recording->count = header.count;
+
+    fclose(fileptr);
+    return recording;
+
+fail:
+    chip8_recording_destroy(recording);
+    fclose(fileptr);
+    return NULL;
+}
+
+/**
+ * Runs the instance from the start of the recording to its end as fast as the engine goes, applying each
+ * event after exactly as many instructions as it was recorded after. The instance must be where the
+ * recording started (same ROM, reset or loaded from the same save state); returns -1 if its instruction
+ * count says otherwise. Compare chip8_framebuffer_hash with recording->hash afterwards to check that the
+ * session was reproduced.
+ */
+int chip8_replay(CHIP8OBJECT *chip8, const CHIP8RECORDING *recording) {
+    const CHIP8INPUT *event;
+    size_t i;
+
+    if (chip8->instructions != recording->start)
+        return -1;
+
+    chip8->rng_state = recording->rng_state;
+    chip8_set_quirks(chip8, recording->quirks);
+    chip8_set_frame_instructions(chip8, recording->instructions_per_frame);
+    for (i = 0; i < recording->count; ++i) {
+        event = &recording->events[i];
+        chip8_run(chip8, event->instructions - chip8->instructions);
+        if (event->type == CHIP8_INPUT_RESET)
+            chip8_reset(chip8);
+        else
+            chip8->buttons[event->key] = event->type == CHIP8_INPUT_KEY_DOWN;
+    }
+    chip8_run(chip8, recording->end - chip8->instructions);
+
+    return 0;
+}
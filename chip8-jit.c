@@ -0,0 +1,786 @@
+#define _XOPEN_SOURCE 700
+#define _DEFAULT_SOURCE
+
+#include <stddef.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "chip8.h"
+
+#if defined(__x86_64__) && defined(__unix__)
+
+#include <sys/mman.h>
+
+// Translates CHIP-8 basic blocks into x86-64 code. A block runs until the first instruction that changes
+// the program counter (1NNN, 2NNN, 00EE, BNNN, the skips, FX0A) or may write memory (FX33, FX55), or
+// until MAX_BLOCK_LENGTH instructions. Blocks are entered through a trampoline that pins the instance in
+// rbx, the instruction budget in r12 and the block table in r13. Every instruction is preceded by a check
+// of the budget that, once it is spent, leaves the block with the exact program counter reached, so a run
+// stops right at the timer tick even in the middle of a block. A block ends by jumping straight to its
+// successor through the block table, so hot loops never return to C. Table slots of blocks that are not
+// compiled point at the exit stub, which returns the remaining budget.
+//
+// Inside a block the V registers used are kept in host registers and written back before the block exits
+// or calls one of the C handlers. The handlers are the same ones the interpreter uses, for the
+// instructions that touch the display, memory or the random number generator.
+//
+// Any write to a byte that compiled code was translated from throws all compiled code away, exactly like
+// the decode cache entries, so self-modifying ROMs stay correct.
+
+#define CODE_SIZE (256 * 1024)
+#define CODE_SLACK 4096
+#define MAX_BLOCK_LENGTH 16
+
+typedef uint64_t (*CHIP8JITENTRY)(CHIP8OBJECT *chip8, uint64_t budget, void **table, void *code);
+
+typedef struct CHIP8JIT {
+    void *table[MEMORY_SIZE];
+    uint8_t code_map[MEMORY_SIZE];
+    uint8_t *code;
+    size_t used;
+    size_t reset_point;
+    CHIP8JITENTRY enter;
+    void *exit_stub;
+} CHIP8JIT;
+
+// x86-64 register numbers.
+enum { RAX, RCX, RDX, RBX, RSP, RBP, RSI, RDI, R8, R9, R10, R11, R12, R13, R14, R15 };
+
+// Host registers that may hold a V register inside a block.
+static const int pool_regs[] = {R8, R9, R10, R11, R14, R15, RBP, RSI, RDI};
+#define POOL_SIZE ((int) (sizeof(pool_regs) / sizeof(pool_regs[0])))
+
+typedef struct {
+    uint8_t *p;
+    int8_t host[16];
+    uint8_t dirty[16];
+    int8_t owner[16];
+    uint16_t locked;
+    int next_evict;
+} CHIP8CODEGEN;
+
+// A budget check inside a block, whose exit is emitted after the block with the V registers cached at
+// the check.
+typedef struct {
+    uint8_t *patch;
+    int8_t host[16];
+    uint8_t dirty[16];
+    int length;
+    uint16_t pc;
+} CHIP8BUDGETCHECK;
+
+#define OFF_V ((int32_t) offsetof(CHIP8OBJECT, V))
+#define OFF_STACK ((int32_t) offsetof(CHIP8OBJECT, stack))
+#define OFF_I ((int32_t) offsetof(CHIP8OBJECT, I))
+#define OFF_PC ((int32_t) offsetof(CHIP8OBJECT, program_counter))
+#define OFF_SP ((int32_t) offsetof(CHIP8OBJECT, stack_pointer))
+#define OFF_DELAY ((int32_t) offsetof(CHIP8OBJECT, delay_timer))
+#define OFF_BUTTONS ((int32_t) offsetof(CHIP8OBJECT, buttons))
+
+// Condition codes for jcc/setcc/cmovcc.
+#define CC_B 0x2
+#define CC_AE 0x3
+#define CC_E 0x4
+#define CC_NE 0x5
+#define CC_A 0x7
+
+/* Instruction encoding */
+
+static void emit8(CHIP8CODEGEN *cg, uint8_t b) {
+    *cg->p++ = b;
+}
+
+static void emit16(CHIP8CODEGEN *cg, uint16_t v) {
+    memcpy(cg->p, &v, 2);
+    cg->p += 2;
+}
+
+static void emit32(CHIP8CODEGEN *cg, uint32_t v) {
+    memcpy(cg->p, &v, 4);
+    cg->p += 4;
+}
+
+static void emit64(CHIP8CODEGEN *cg, uint64_t v) {
+    memcpy(cg->p, &v, 8);
+    cg->p += 8;
+}
+
+// Emits the REX prefix if one is needed. byte_regs lists the register operands that are used as 8-bit
+// registers, since spl/bpl/sil/dil are only reachable with a REX prefix.
+static void emit_rex(CHIP8CODEGEN *cg, int w, int reg, int index, int base, int byte_regs) {
+    uint8_t rex = 0x40 | (w << 3) | ((reg >> 3) & 1) << 2 | ((index >> 3) & 1) << 1 | ((base >> 3) & 1);
+
+    if (rex != 0x40 || byte_regs)
+        emit8(cg, rex);
+}
+
+static int needs_byte_rex(int reg) {
+    return reg >= RSP && reg <= RDI;
+}
+
+// op reg, rm (register direct).
+static void emit_rr(CHIP8CODEGEN *cg, int w, int byteop, const uint8_t *opcode, int oplen, int reg, int rm) {
+    int i;
+
+    emit_rex(cg, w, reg, 0, rm, byteop && (needs_byte_rex(reg) || needs_byte_rex(rm)));
+    for (i = 0; i < oplen; ++i) {
+        emit8(cg, opcode[i]);
+    }
+    emit8(cg, 0xC0 | (reg & 7) << 3 | (rm & 7));
+}
+
+// op reg, [base + index * (1 << scale) + disp]. Always uses a 32-bit displacement, which sidesteps the
+// special encodings of rbp/r13 as a base.
+static void emit_rm(CHIP8CODEGEN *cg, int w, int byteop, const uint8_t *opcode, int oplen, int reg, int base,
+        int index, int scale, int32_t disp) {
+    int i;
+
+    emit_rex(cg, w, reg, index < 0 ? 0 : index, base, byteop && needs_byte_rex(reg));
+    for (i = 0; i < oplen; ++i) {
+        emit8(cg, opcode[i]);
+    }
+    if (index >= 0 || (base & 7) == RSP) {
+        emit8(cg, 0x80 | (reg & 7) << 3 | 0x4);
+        emit8(cg, scale << 6 | ((index < 0 ? RSP : index) & 7) << 3 | (base & 7));
+    }
+    else {
+        emit8(cg, 0x80 | (reg & 7) << 3 | (base & 7));
+    }
+    emit32(cg, (uint32_t) disp);
+}
+
+#define OP(...) (const uint8_t[]) {__VA_ARGS__}, (int) sizeof((const uint8_t[]) {__VA_ARGS__})
+
+static void emit_mov_imm32(CHIP8CODEGEN *cg, int reg, uint32_t imm) {
+    emit_rex(cg, 0, 0, 0, reg, 0);
+    emit8(cg, 0xB8 | (reg & 7));
+    emit32(cg, imm);
+}
+
+static void emit_mov_imm64(CHIP8CODEGEN *cg, int reg, uint64_t imm) {
+    emit_rex(cg, 1, 0, 0, reg, 0);
+    emit8(cg, 0xB8 | (reg & 7));
+    emit64(cg, imm);
+}
+
+// movzx reg32, byte [rbx + disp]
+static void emit_load_byte(CHIP8CODEGEN *cg, int reg, int32_t disp) {
+    emit_rm(cg, 0, 0, OP(0x0F, 0xB6), reg, RBX, -1, 0, disp);
+}
+
+// mov byte [rbx + disp], reg8
+static void emit_store_byte(CHIP8CODEGEN *cg, int reg, int32_t disp) {
+    emit_rm(cg, 0, 1, OP(0x88), reg, RBX, -1, 0, disp);
+}
+
+// mov word [rbx + disp], imm16
+static void emit_store_word_imm(CHIP8CODEGEN *cg, int32_t disp, uint16_t imm) {
+    emit8(cg, 0x66);
+    emit_rm(cg, 0, 0, OP(0xC7), 0, RBX, -1, 0, disp);
+    emit16(cg, imm);
+}
+
+// mov word [rbx + disp], reg16
+static void emit_store_word(CHIP8CODEGEN *cg, int reg, int32_t disp) {
+    emit8(cg, 0x66);
+    emit_rm(cg, 0, 0, OP(0x89), reg, RBX, -1, 0, disp);
+}
+
+// mov dst32, src32
+static void emit_mov_rr(CHIP8CODEGEN *cg, int dst, int src) {
+    emit_rr(cg, 0, 0, OP(0x89), src, dst);
+}
+
+// movzx dst32, src8
+static void emit_movzx_rr(CHIP8CODEGEN *cg, int dst, int src) {
+    emit_rr(cg, 0, 1, OP(0x0F, 0xB6), dst, src);
+}
+
+// op8 rm, imm8 with /ext as in 0x80 /ext ib.
+static void emit_alu8_imm(CHIP8CODEGEN *cg, int ext, int rm, uint8_t imm) {
+    emit_rr(cg, 0, 1, OP(0x80), ext, rm);
+    emit8(cg, imm);
+}
+
+// op8 dst, src for the classic ALU opcodes (add 0x00, or 0x08, and 0x20, sub 0x28, xor 0x30, cmp 0x38).
+static void emit_alu8_rr(CHIP8CODEGEN *cg, uint8_t opcode, int dst, int src) {
+    emit_rr(cg, 0, 1, &opcode, 1, src, dst);
+}
+
+static void emit_setcc_al(CHIP8CODEGEN *cg, int cc) {
+    emit8(cg, 0x0F);
+    emit8(cg, 0x90 | cc);
+    emit8(cg, 0xC0);
+}
+
+// jmp rel32 / jcc rel32 to an absolute address inside the code buffer.
+static void emit_jmp(CHIP8CODEGEN *cg, const void *target) {
+    emit8(cg, 0xE9);
+    emit32(cg, (uint32_t) ((const uint8_t *) target - (cg->p + 4)));
+}
+
+static void emit_jcc(CHIP8CODEGEN *cg, int cc, const void *target) {
+    emit8(cg, 0x0F);
+    emit8(cg, 0x80 | cc);
+    emit32(cg, (uint32_t) ((const uint8_t *) target - (cg->p + 4)));
+}
+
+/* V register cache */
+
+static void flush_reg(CHIP8CODEGEN *cg, int v) {
+    if (cg->host[v] >= 0 && cg->dirty[v]) {
+        emit_store_byte(cg, cg->host[v], OFF_V + v);
+        cg->dirty[v] = 0;
+    }
+}
+
+static void flush_all(CHIP8CODEGEN *cg) {
+    int v;
+
+    for (v = 0; v < 16; ++v) {
+        flush_reg(cg, v);
+    }
+}
+
+// Forgets every mapping; used after calling a handler, which reads and writes V in memory.
+static void drop_all(CHIP8CODEGEN *cg) {
+    int i;
+
+    for (i = 0; i < 16; ++i) {
+        cg->host[i] = -1;
+        cg->dirty[i] = 0;
+        cg->owner[i] = -1;
+    }
+}
+
+// Returns the host register holding V[v], loading it from memory when load is set. Registers locked for
+// the instruction being translated are never evicted to make room.
+static int vreg(CHIP8CODEGEN *cg, int v, int load) {
+    int i, reg, victim;
+
+    if (cg->host[v] >= 0) {
+        cg->locked |= 1 << v;
+        return cg->host[v];
+    }
+
+    reg = -1;
+    for (i = 0; i < POOL_SIZE; ++i) {
+        if (cg->owner[pool_regs[i]] < 0) {
+            reg = pool_regs[i];
+            break;
+        }
+    }
+    while (reg < 0) {
+        reg = pool_regs[cg->next_evict];
+        cg->next_evict = (cg->next_evict + 1) % POOL_SIZE;
+        victim = cg->owner[reg];
+        if (cg->locked & (1 << victim)) {
+            reg = -1;
+            continue;
+        }
+        flush_reg(cg, victim);
+        cg->host[victim] = -1;
+    }
+
+    cg->owner[reg] = v;
+    cg->host[v] = reg;
+    cg->dirty[v] = 0;
+    cg->locked |= 1 << v;
+    if (load)
+        emit_load_byte(cg, reg, OFF_V + v);
+    return reg;
+}
+
+/* Block exits. All of them charge the block's instructions to the budget first. */
+
+static void emit_charge(CHIP8CODEGEN *cg, int length) {
+    emit_rr(cg, 1, 0, OP(0x81), 5, R12);
+    emit32(cg, (uint32_t) length);
+}
+
+// Continues at a program counter known at translation time.
+static void emit_exit_static(CHIP8JIT *jit, CHIP8CODEGEN *cg, int length, uint16_t pc) {
+    flush_all(cg);
+    emit_store_word_imm(cg, OFF_PC, pc);
+    emit_charge(cg, length);
+    if (pc > MEMORY_MASK) {
+        emit_jmp(cg, jit->exit_stub);
+    }
+    else {
+        // jmp qword [r13 + pc * 8]
+        emit_rm(cg, 0, 0, OP(0xFF), 4, R13, -1, 0, pc * 8);
+    }
+}
+
+// Stops at pc, a known address inside the block, with the budget spent.
+static void emit_exit_budget(CHIP8JIT *jit, CHIP8CODEGEN *cg, int length, uint16_t pc) {
+    flush_all(cg);
+    emit_store_word_imm(cg, OFF_PC, pc);
+    emit_charge(cg, length);
+    emit_jmp(cg, jit->exit_stub);
+}
+
+// Continues at the program counter in eax, which has already been stored.
+static void emit_exit_dynamic(CHIP8JIT *jit, CHIP8CODEGEN *cg, int length) {
+    emit_charge(cg, length);
+    // cmp eax, MEMORY_MASK; ja exit; jmp qword [r13 + rax * 8]
+    emit8(cg, 0x3D);
+    emit32(cg, MEMORY_MASK);
+    emit_jcc(cg, CC_A, jit->exit_stub);
+    emit_rm(cg, 0, 0, OP(0xFF), 4, R13, RAX, 3, 0);
+}
+
+// Continues at the program counter a handler left in memory.
+static void emit_exit_from_memory(CHIP8JIT *jit, CHIP8CODEGEN *cg, int length) {
+    emit_rm(cg, 0, 0, OP(0x0F, 0xB7), RAX, RBX, -1, 0, OFF_PC);
+    emit_exit_dynamic(jit, cg, length);
+}
+
+// Skips: the flags for cc are already set. Continues at pc + 2 if cc holds and at pc otherwise, where pc
+// is the address after the skip instruction.
+static void emit_exit_skip(CHIP8JIT *jit, CHIP8CODEGEN *cg, int length, int cc, uint16_t pc) {
+    flush_all(cg);
+    emit_mov_imm32(cg, RAX, pc);
+    emit_mov_imm32(cg, RCX, (uint16_t) (pc + 2));
+    emit_rr(cg, 0, 0, OP(0x0F, 0x40 | cc), RAX, RCX);
+    emit_store_word(cg, RAX, OFF_PC);
+    emit_exit_dynamic(jit, cg, length);
+}
+
+// Calls the interpreter's handler for the instruction, the one compiled for the instance's quirk profile,
+// with the program counter already advanced past it as the handler expects.
+static void emit_call_handler(const CHIP8OBJECT *chip8, CHIP8CODEGEN *cg, const CHIP8DECODED *op, uint16_t next_pc) {
+    flush_all(cg);
+    emit_store_word_imm(cg, OFF_PC, next_pc);
+    emit_rr(cg, 1, 0, OP(0x89), RBX, RDI);
+    emit_mov_imm64(cg, RSI, (uint64_t) (uintptr_t) op);
+    emit_mov_imm64(cg, RAX, (uint64_t) (uintptr_t) chip8_opcode_handler(chip8, op->op));
+    emit8(cg, 0xFF);
+    emit8(cg, 0xD0);
+    drop_all(cg);
+}
+
+/* Translation */
+
+static void jit_reset(CHIP8JIT *jit) {
+    int i;
+
+    for (i = 0; i < MEMORY_SIZE; ++i) {
+        jit->table[i] = jit->exit_stub;
+    }
+    memset(jit->code_map, 0, sizeof(jit->code_map));
+    jit->used = jit->reset_point;
+}
+
+// Emits the trampoline and exit stub at the start of the code buffer.
+static void emit_runtime(CHIP8JIT *jit) {
+    CHIP8CODEGEN cg;
+    static const int saved[] = {RBX, RBP, R12, R13, R14, R15};
+    int i;
+
+    cg.p = jit->code;
+    jit->enter = (CHIP8JITENTRY) (void *) cg.p;
+    for (i = 0; i < 6; ++i) {
+        emit_rex(&cg, 0, 0, 0, saved[i], 0);
+        emit8(&cg, 0x50 | (saved[i] & 7));
+    }
+    // Six pushes leave rsp 8 bytes off the 16-byte alignment the handlers expect.
+    emit8(&cg, 0x48); emit8(&cg, 0x83); emit8(&cg, 0xEC); emit8(&cg, 0x08);
+    emit_rr(&cg, 1, 0, OP(0x89), RDI, RBX);
+    emit_rr(&cg, 1, 0, OP(0x89), RSI, R12);
+    emit_rr(&cg, 1, 0, OP(0x89), RDX, R13);
+    // jmp rcx
+    emit8(&cg, 0xFF);
+    emit8(&cg, 0xE1);
+
+    jit->exit_stub = cg.p;
+    emit_rr(&cg, 1, 0, OP(0x89), R12, RAX);
+    emit8(&cg, 0x48); emit8(&cg, 0x83); emit8(&cg, 0xC4); emit8(&cg, 0x08);
+    for (i = 5; i >= 0; --i) {
+        emit_rex(&cg, 0, 0, 0, saved[i], 0);
+        emit8(&cg, 0x58 | (saved[i] & 7));
+    }
+    emit8(&cg, 0xC3);
+
+    jit->reset_point = (size_t) (cg.p - jit->code);
+}
+
+// Translates the block starting at address. Returns 0 when nothing could be translated, in which case
+// the caller interprets the instruction instead.
+static int jit_compile(CHIP8OBJECT *chip8, CHIP8JIT *jit, uint16_t address) {
+    CHIP8CODEGEN cg;
+    CHIP8BUDGETCHECK checks[MAX_BLOCK_LENGTH];
+    const CHIP8DECODED *op;
+    uint8_t *start;
+    uint16_t pc = address;
+    int length = 0, done = 0, rx, ry, rf, i;
+    // The quirk profile is fixed for the life of the translated code (changing it flushes), so its quirks
+    // are settled here and never tested by the code emitted.
+    int quirks = CHIP8_QUIRKS(chip8->quirks);
+
+    if (address > MEMORY_SIZE - 2)
+        return 0;
+    // FX18 is always interpreted, so that the sound timer learns exactly which instruction started a beep.
+    op = &chip8->decoded[address];
+    if (op->op == CHIP8_OP_UNDECODED)
+        op = chip8_decode(chip8, address);
+    if (op->op == CHIP8_OP_FX18)
+        return 0;
+    if (jit->used + CODE_SLACK > CODE_SIZE)
+        jit_reset(jit);
+
+    memset(&cg, 0, sizeof(cg));
+    drop_all(&cg);
+    start = cg.p = jit->code + jit->used;
+
+    if (mprotect(jit->code, CODE_SIZE, PROT_READ | PROT_WRITE))
+        return 0;
+
+    while (!done) {
+        if (length == MAX_BLOCK_LENGTH || pc > MEMORY_SIZE - 2) {
+            emit_exit_static(jit, &cg, length, pc);
+            break;
+        }
+
+        op = &chip8->decoded[pc];
+        if (op->op == CHIP8_OP_UNDECODED)
+            op = chip8_decode(chip8, pc);
+        if (op->op == CHIP8_OP_FX18) {
+            emit_exit_static(jit, &cg, length, pc);
+            break;
+        }
+
+        // Budget check: cmp r12, length; je exit. Before the first instruction nothing needs writing back.
+        emit_rr(&cg, 1, 0, OP(0x81), 7, R12);
+        emit32(&cg, (uint32_t) length);
+        if (!length) {
+            emit_jcc(&cg, CC_E, jit->exit_stub);
+        }
+        else {
+            emit_jcc(&cg, CC_E, cg.p);
+            checks[length].patch = cg.p - 4;
+            memcpy(checks[length].host, cg.host, sizeof(cg.host));
+            memcpy(checks[length].dirty, cg.dirty, sizeof(cg.dirty));
+            checks[length].length = length;
+            checks[length].pc = pc;
+        }
+
+        jit->code_map[pc] = 1;
+        jit->code_map[pc + 1] = 1;
+        ++length;
+        pc += 2;
+        cg.locked = 0;
+
+        switch (op->op) {
+            case CHIP8_OP_6XNN:
+                rx = vreg(&cg, op->X, 0);
+                emit_mov_imm32(&cg, rx, op->NN);
+                cg.dirty[op->X] = 1;
+                break;
+            case CHIP8_OP_7XNN:
+                rx = vreg(&cg, op->X, 1);
+                emit_alu8_imm(&cg, 0, rx, op->NN);
+                cg.dirty[op->X] = 1;
+                break;
+            case CHIP8_OP_8XY0:
+                ry = vreg(&cg, op->Y, 1);
+                rx = vreg(&cg, op->X, 0);
+                emit_mov_rr(&cg, rx, ry);
+                cg.dirty[op->X] = 1;
+                break;
+            case CHIP8_OP_8XY1:
+            case CHIP8_OP_8XY2:
+            case CHIP8_OP_8XY3:
+                ry = vreg(&cg, op->Y, 1);
+                rx = vreg(&cg, op->X, 1);
+                emit_alu8_rr(&cg, op->op == CHIP8_OP_8XY1 ? 0x08 : op->op == CHIP8_OP_8XY2 ? 0x20 : 0x30, rx, ry);
+                cg.dirty[op->X] = 1;
+                if (quirks & CHIP8_QUIRK_VF_RESET) {
+                    rf = vreg(&cg, 0xF, 0);
+                    emit_mov_imm32(&cg, rf, 0);
+                    cg.dirty[0xF] = 1;
+                }
+                break;
+            // The flag instructions set VF first and then update VX from the current registers, in the
+            // same order as the handlers, so they agree when X or Y is F.
+            case CHIP8_OP_8XY4:
+            case CHIP8_OP_8XY5:
+            case CHIP8_OP_8XY7:
+                ry = vreg(&cg, op->Y, 1);
+                rx = vreg(&cg, op->X, 1);
+                if (op->op == CHIP8_OP_8XY4) {
+                    emit_mov_rr(&cg, RAX, rx);
+                    emit_alu8_rr(&cg, 0x00, RAX, ry);
+                    emit_setcc_al(&cg, CC_B);
+                }
+                else if (op->op == CHIP8_OP_8XY5) {
+                    emit_alu8_rr(&cg, 0x38, rx, ry);
+                    emit_setcc_al(&cg, CC_AE);
+                }
+                else {
+                    emit_alu8_rr(&cg, 0x38, ry, rx);
+                    emit_setcc_al(&cg, CC_AE);
+                }
+                rf = vreg(&cg, 0xF, 0);
+                emit_movzx_rr(&cg, rf, RAX);
+                cg.dirty[0xF] = 1;
+                rx = cg.host[op->X];
+                ry = cg.host[op->Y];
+                if (op->op == CHIP8_OP_8XY4) {
+                    emit_alu8_rr(&cg, 0x00, rx, ry);
+                }
+                else if (op->op == CHIP8_OP_8XY5) {
+                    emit_alu8_rr(&cg, 0x28, rx, ry);
+                }
+                else {
+                    emit_mov_rr(&cg, RAX, ry);
+                    emit_alu8_rr(&cg, 0x28, RAX, rx);
+                    emit_movzx_rr(&cg, rx, RAX);
+                }
+                cg.dirty[op->X] = 1;
+                break;
+            case CHIP8_OP_8XY6:
+            case CHIP8_OP_8XYE:
+                if (quirks & CHIP8_QUIRK_SHIFT_VY) {
+                    ry = vreg(&cg, op->Y, 1);
+                    rx = vreg(&cg, op->X, 0);
+                    emit_mov_rr(&cg, rx, ry);
+                    cg.dirty[op->X] = 1;
+                }
+                else {
+                    rx = vreg(&cg, op->X, 1);
+                }
+                emit_mov_rr(&cg, RAX, rx);
+                if (op->op == CHIP8_OP_8XY6) {
+                    // and eax, 1
+                    emit8(&cg, 0x83); emit8(&cg, 0xE0); emit8(&cg, 0x01);
+                }
+                else {
+                    // shr eax, 7
+                    emit8(&cg, 0xC1); emit8(&cg, 0xE8); emit8(&cg, 0x07);
+                }
+                rf = vreg(&cg, 0xF, 0);
+                emit_mov_rr(&cg, rf, RAX);
+                cg.dirty[0xF] = 1;
+                rx = cg.host[op->X];
+                emit_rr(&cg, 0, 1, OP(0xD0), op->op == CHIP8_OP_8XY6 ? 5 : 4, rx);
+                cg.dirty[op->X] = 1;
+                break;
+            case CHIP8_OP_ANNN:
+                emit_store_word_imm(&cg, OFF_I, op->NNN);
+                break;
+            case CHIP8_OP_FX1E:
+                rx = vreg(&cg, op->X, 1);
+                emit_movzx_rr(&cg, RAX, rx);
+                // add word [rbx + I], ax
+                emit8(&cg, 0x66);
+                emit_rm(&cg, 0, 0, OP(0x01), RAX, RBX, -1, 0, OFF_I);
+                break;
+            case CHIP8_OP_FX29:
+                rx = vreg(&cg, op->X, 1);
+                emit_movzx_rr(&cg, RAX, rx);
+                // and eax, 0xF; lea eax, [rax + rax * 4]
+                emit8(&cg, 0x83); emit8(&cg, 0xE0); emit8(&cg, 0x0F);
+                emit_rm(&cg, 0, 0, OP(0x8D), RAX, RAX, RAX, 2, 0);
+                emit_store_word(&cg, RAX, OFF_I);
+                break;
+            case CHIP8_OP_FX07:
+                rx = vreg(&cg, op->X, 0);
+                emit_load_byte(&cg, rx, OFF_DELAY);
+                cg.dirty[op->X] = 1;
+                break;
+            case CHIP8_OP_UNKNOWN:
+                break;
+            case CHIP8_OP_00E0:
+            case CHIP8_OP_CXNN:
+            case CHIP8_OP_DXYN:
+            case CHIP8_OP_FX15:
+            case CHIP8_OP_FX65:
+                emit_call_handler(chip8, &cg, op, pc);
+                break;
+
+            // Everything below ends the block.
+            case CHIP8_OP_FX0A:
+            case CHIP8_OP_FX33:
+            case CHIP8_OP_FX55:
+                emit_call_handler(chip8, &cg, op, pc);
+                emit_exit_from_memory(jit, &cg, length);
+                done = 1;
+                break;
+            case CHIP8_OP_1NNN:
+                emit_exit_static(jit, &cg, length, op->NNN);
+                done = 1;
+                break;
+            case CHIP8_OP_2NNN:
+                flush_all(&cg);
+                // movzx eax, byte [rbx + sp]; mov word [rbx + stack + rax * 2], pc; inc byte [rbx + sp];
+                // and byte [rbx + sp], STACK_MASK
+                emit_load_byte(&cg, RAX, OFF_SP);
+                emit8(&cg, 0x66);
+                emit_rm(&cg, 0, 0, OP(0xC7), 0, RBX, RAX, 1, OFF_STACK);
+                emit16(&cg, pc);
+                emit_rm(&cg, 0, 0, OP(0xFE), 0, RBX, -1, 0, OFF_SP);
+                emit_rm(&cg, 0, 0, OP(0x80), 4, RBX, -1, 0, OFF_SP);
+                emit8(&cg, STACK_MASK);
+                emit_exit_static(jit, &cg, length, op->NNN);
+                done = 1;
+                break;
+            case CHIP8_OP_00EE:
+                flush_all(&cg);
+                // dec byte [rbx + sp]; and byte [rbx + sp], STACK_MASK; movzx eax, byte [rbx + sp];
+                // movzx eax, word [rbx + stack + rax * 2]
+                emit_rm(&cg, 0, 0, OP(0xFE), 1, RBX, -1, 0, OFF_SP);
+                emit_rm(&cg, 0, 0, OP(0x80), 4, RBX, -1, 0, OFF_SP);
+                emit8(&cg, STACK_MASK);
+                emit_load_byte(&cg, RAX, OFF_SP);
+                emit_rm(&cg, 0, 0, OP(0x0F, 0xB7), RAX, RBX, RAX, 1, OFF_STACK);
+                emit_store_word(&cg, RAX, OFF_PC);
+                emit_exit_dynamic(jit, &cg, length);
+                done = 1;
+                break;
+            case CHIP8_OP_BNNN:
+                rx = vreg(&cg, quirks & CHIP8_QUIRK_JUMP_VX ? op->X : 0, 1);
+                emit_movzx_rr(&cg, RAX, rx);
+                flush_all(&cg);
+                // add eax, NNN
+                emit8(&cg, 0x05);
+                emit32(&cg, op->NNN);
+                emit_store_word(&cg, RAX, OFF_PC);
+                emit_exit_dynamic(jit, &cg, length);
+                done = 1;
+                break;
+            case CHIP8_OP_3XNN:
+            case CHIP8_OP_4XNN:
+                rx = vreg(&cg, op->X, 1);
+                emit_alu8_imm(&cg, 7, rx, op->NN);
+                emit_exit_skip(jit, &cg, length, op->op == CHIP8_OP_3XNN ? CC_E : CC_NE, pc);
+                done = 1;
+                break;
+            case CHIP8_OP_5XY0:
+            case CHIP8_OP_9XY0:
+                ry = vreg(&cg, op->Y, 1);
+                rx = vreg(&cg, op->X, 1);
+                emit_alu8_rr(&cg, 0x38, rx, ry);
+                emit_exit_skip(jit, &cg, length, op->op == CHIP8_OP_5XY0 ? CC_E : CC_NE, pc);
+                done = 1;
+                break;
+            case CHIP8_OP_EX9E:
+            case CHIP8_OP_EXA1:
+                rx = vreg(&cg, op->X, 1);
+                emit_movzx_rr(&cg, RAX, rx);
+                emit8(&cg, 0x83); emit8(&cg, 0xE0); emit8(&cg, 0x0F);
+                // cmp byte [rbx + buttons + rax], 0
+                emit_rm(&cg, 0, 0, OP(0x80), 7, RBX, RAX, 0, OFF_BUTTONS);
+                emit8(&cg, 0);
+                emit_exit_skip(jit, &cg, length, op->op == CHIP8_OP_EX9E ? CC_NE : CC_E, pc);
+                done = 1;
+                break;
+            default:
+                fprintf(stderr, "JIT: no translation for instruction class %d\n", op->op);
+                abort();
+        }
+    }
+
+    // The budget exits, out of the way of the straight-line code.
+    for (i = 1; i < length; ++i) {
+        memcpy(checks[i].patch, &(uint32_t) {(uint32_t) (cg.p - (checks[i].patch + 4))}, 4);
+        memcpy(cg.host, checks[i].host, sizeof(cg.host));
+        memcpy(cg.dirty, checks[i].dirty, sizeof(cg.dirty));
+        emit_exit_budget(jit, &cg, checks[i].length, checks[i].pc);
+    }
+
+    jit->used = (size_t) (cg.p - jit->code);
+    jit->table[address] = start;
+    mprotect(jit->code, CODE_SIZE, PROT_READ | PROT_EXEC);
+    return 1;
+}
+
+int chip8_jit_create(CHIP8OBJECT *chip8) {
+    CHIP8JIT *jit;
+
+    if (chip8->jit)
+        return 0;
+    if (!(jit = calloc(1, sizeof(CHIP8JIT))))
+        return -1;
+    jit->code = mmap(NULL, CODE_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (jit->code == MAP_FAILED) {
+        free(jit);
+        return -1;
+    }
+    emit_runtime(jit);
+    jit_reset(jit);
+    if (mprotect(jit->code, CODE_SIZE, PROT_READ | PROT_EXEC)) {
+        munmap(jit->code, CODE_SIZE);
+        free(jit);
+        return -1;
+    }
+
+    chip8->jit = jit;
+    return 0;
+}
+
+void chip8_jit_destroy(CHIP8OBJECT *chip8) {
+    if (!chip8->jit)
+        return;
+    munmap(chip8->jit->code, CODE_SIZE);
+    free(chip8->jit);
+    chip8->jit = NULL;
+}
+
+// Called for every memory write while the recompiler is active.
+void chip8_jit_invalidate(CHIP8OBJECT *chip8, uint16_t address) {
+    if (chip8->jit->code_map[address & MEMORY_MASK])
+        jit_reset(chip8->jit);
+}
+
+void chip8_jit_flush(CHIP8OBJECT *chip8) {
+    jit_reset(chip8->jit);
+}
+
+// Executes exactly count instructions. A block entered with budget left runs at least one instruction.
+// Addresses that cannot be translated are handled by the interpreter one instruction at a time, with the
+// instruction counter brought up to date first; chip8_run sets it once the count is done.
+void chip8_jit_run(CHIP8OBJECT *chip8, uint32_t count) {
+    CHIP8JIT *jit = chip8->jit;
+    uint64_t budget = count, start = chip8->instructions;
+    uint16_t pc;
+
+    while (budget) {
+        pc = chip8->program_counter;
+        if (pc > MEMORY_MASK || (jit->table[pc] == jit->exit_stub && !jit_compile(chip8, jit, pc))) {
+            chip8->instructions = start + count - budget;
+            chip8_execute_instruction(chip8);
+            --budget;
+            continue;
+        }
+
+        budget = jit->enter(chip8, budget, jit->table, jit->table[pc]);
+    }
+}
+
+#else
+
+int chip8_jit_create(CHIP8OBJECT *chip8) {
+    return -1;
+}
+
+void chip8_jit_destroy(CHIP8OBJECT *chip8) {
+}
+
+void chip8_jit_run(CHIP8OBJECT *chip8, uint32_t count) {
+    uint32_t i;
+
+    for (i = 0; i < count; ++i, ++chip8->instructions) {
+        chip8_execute_instruction(chip8);
+    }
+}
+
+void chip8_jit_invalidate(CHIP8OBJECT *chip8, uint16_t address) {
+}
+
+void chip8_jit_flush(CHIP8OBJECT *chip8) {
+}
+
+#endif
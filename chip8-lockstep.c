@@ -0,0 +1,782 @@
+#define _XOPEN_SOURCE 700
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__SSE2__)
+#include <immintrin.h>
+#endif
+
+#include "chip8.h"
+
+// Lockstep batch core for many instances of one ROM, as in a sweep over seeds. The instances that are at the
+// same address with the same stack depth form a group whose registers are kept as a structure of arrays, one
+// row per register with a column per instance, so every instruction is fetched and decoded once, from the
+// first column's instance, and then executed for the whole row at once, with AVX2 where the host has it.
+// Memory and the framebuffer stay in the instances. An instance leaves the group when it goes somewhere else,
+// on a skip, a return or a computed jump, and runs the rest of the frame on its own through chip8_run; at
+// every frame boundary the ones back at the group's address join again. When fewer than two are left, the
+// group is formed afresh around the address most instances are at.
+//
+// Lanes can also differ in memory, after FX33 or FX55. divergent flags every address where some lane of the
+// group may hold a different byte than the first column: whatever FX33 and FX55 wrote, and the bytes found
+// to differ when an instance joins. Fetching from a flagged address compares the lanes first and drops those
+// that hold another instruction there.
+
+#define LANE_BLOCK 32
+
+struct CHIP8LOCKSTEP {
+    CHIP8OBJECT **objs;
+    CHIP8OBJECT **scalar;
+    int count;
+    int scalar_count;
+    int capacity;
+    uint32_t instructions_per_frame;
+    uint8_t quirks;
+    uint16_t pc;
+    uint8_t sp;
+    uint64_t instructions;
+    uint64_t lockstep;
+    uint64_t separate;
+    uint8_t *V;
+    uint16_t *stack;
+    uint16_t *I;
+    uint8_t *delay_timer;
+    uint8_t *sound_timer;
+    uint32_t *rng_state;
+    uint8_t *taken;
+    uint8_t *peel;
+    uint16_t *target;
+    uint8_t divergent[MEMORY_SIZE];
+    uint32_t pcs[MEMORY_SIZE];
+};
+
+// Rows are capacity columns long, a whole number of blocks, so the vector loops need no tail.
+#define ROW(ls, row) ((ls)->V + (size_t) (row) * (ls)->capacity)
+#define STACK_ROW(ls, row) ((ls)->stack + (size_t) (row) * (ls)->capacity)
+
+/**
+ * Sets up a batch over count instances, which all have the same ROM loaded, the same quirk profile, speed and
+ * instruction count and neither a beeper nor a trace. Returns NULL, with a message, if they do not. The
+ * instances keep their own engines for the stretches they run apart from the group.
+ */
+CHIP8LOCKSTEP *chip8_lockstep_create(CHIP8OBJECT **vms, int count) {
+    CHIP8LOCKSTEP *ls;
+    int i;
+
+    if (count <= 0)
+        return NULL;
+    for (i = 0; i < count; ++i) {
+        if (vms[i]->quirks != vms[0]->quirks || vms[i]->instructions_per_frame != vms[0]->instructions_per_frame ||
+            vms[i]->instructions != vms[0]->instructions || memcmp(vms[i]->image, vms[0]->image, MEMORY_SIZE)) {
+            fprintf(stderr, "Lockstep instance %d does not match the first\n", i);
+            return NULL;
+        }
+        if (vms[i]->audio || vms[i]->trace) {
+            fprintf(stderr, "Lockstep instance %d has a beeper or a trace\n", i);
+            return NULL;
+        }
+    }
+
+    if (!(ls = calloc(1, sizeof(CHIP8LOCKSTEP))))
+        return NULL;
+    ls->capacity = (count + LANE_BLOCK - 1) / LANE_BLOCK * LANE_BLOCK;
+    ls->instructions_per_frame = vms[0]->instructions_per_frame;
+    ls->quirks = CHIP8_QUIRKS(vms[0]->quirks);
+    ls->objs = malloc(ls->capacity * sizeof(CHIP8OBJECT *));
+    ls->scalar = malloc(count * sizeof(CHIP8OBJECT *));
+    if (posix_memalign((void **) &ls->V, 64, 16 * (size_t) ls->capacity) ||
+        posix_memalign((void **) &ls->stack, 64, 16 * sizeof(uint16_t) * ls->capacity) ||
+        posix_memalign((void **) &ls->I, 64, sizeof(uint16_t) * ls->capacity) ||
+        posix_memalign((void **) &ls->delay_timer, 64, ls->capacity) ||
+        posix_memalign((void **) &ls->sound_timer, 64, ls->capacity) ||
+        posix_memalign((void **) &ls->rng_state, 64, sizeof(uint32_t) * ls->capacity) ||
+        posix_memalign((void **) &ls->taken, 64, ls->capacity) ||
+        posix_memalign((void **) &ls->peel, 64, ls->capacity) ||
+        posix_memalign((void **) &ls->target, 64, sizeof(uint16_t) * ls->capacity) || !ls->objs || !ls->scalar) {
+        fprintf(stderr, "Out of memory allocating %d lockstep lanes\n", count);
+        chip8_lockstep_destroy(ls);
+        return NULL;
+    }
+    // Padding columns are computed along with the rest and never read back.
+    memset(ls->V, 0, 16 * (size_t) ls->capacity);
+    memset(ls->stack, 0, 16 * sizeof(uint16_t) * ls->capacity);
+    memset(ls->I, 0, sizeof(uint16_t) * ls->capacity);
+    memset(ls->delay_timer, 0, ls->capacity);
+    memset(ls->sound_timer, 0, ls->capacity);
+    memset(ls->rng_state, 0, sizeof(uint32_t) * ls->capacity);
+    memset(ls->taken, 0, ls->capacity);
+    memset(ls->peel, 0, ls->capacity);
+    memcpy(ls->scalar, vms, count * sizeof(CHIP8OBJECT *));
+    ls->scalar_count = count;
+    ls->instructions = vms[0]->instructions;
+    return ls;
+}
+
+void chip8_lockstep_destroy(CHIP8LOCKSTEP *ls) {
+    if (!ls)
+        return;
+    free(ls->objs);
+    free(ls->scalar);
+    free(ls->V);
+    free(ls->stack);
+    free(ls->I);
+    free(ls->delay_timer);
+    free(ls->sound_timer);
+    free(ls->rng_state);
+    free(ls->taken);
+    free(ls->peel);
+    free(ls->target);
+    free(ls);
+}
+
+// Writes the registers of column k back to its instance, which is left at pc after instructions.
+static void scatter(CHIP8LOCKSTEP *ls, int k, uint16_t pc, uint64_t instructions) {
+    CHIP8OBJECT *chip8 = ls->objs[k];
+    int r;
+
+    for (r = 0; r < 16; ++r) {
+        chip8->V[r] = ROW(ls, r)[k];
+        chip8->stack[r] = STACK_ROW(ls, r)[k];
+    }
+    chip8->I = ls->I[k];
+    chip8->program_counter = pc;
+    chip8->stack_pointer = ls->sp;
+    chip8->delay_timer = ls->delay_timer[k];
+    chip8->sound_timer = ls->sound_timer[k];
+    chip8->rng_state = ls->rng_state[k];
+    chip8->instructions = instructions;
+}
+
+// Adds an instance to the group as its last column. Lines neither it nor the first column ever wrote still
+// hold the ROM in both; the others are compared and the bytes that differ flagged.
+static void join(CHIP8LOCKSTEP *ls, CHIP8OBJECT *chip8) {
+    const CHIP8OBJECT *first = ls->count ? ls->objs[0] : chip8;
+    uint64_t lines = ls->count ? chip8->mem_dirty | first->mem_dirty : 0;
+    int k = ls->count++, r, a, line;
+
+    for (line = 0; lines; ++line, lines >>= 1) {
+        if (!(lines & 1) || !memcmp(&chip8->mem[line * MEMORY_LINE], &first->mem[line * MEMORY_LINE], MEMORY_LINE))
+            continue;
+        for (a = line * MEMORY_LINE; a < (line + 1) * MEMORY_LINE; ++a) {
+            if (chip8->mem[a] != first->mem[a])
+                ls->divergent[a] = 1;
+        }
+    }
+
+    ls->objs[k] = chip8;
+    for (r = 0; r < 16; ++r) {
+        ROW(ls, r)[k] = chip8->V[r];
+        STACK_ROW(ls, r)[k] = chip8->stack[r];
+    }
+    ls->I[k] = chip8->I;
+    ls->delay_timer[k] = chip8->delay_timer;
+    ls->sound_timer[k] = chip8->sound_timer;
+    ls->rng_state[k] = chip8->rng_state;
+}
+
+// Hands every column with peel set back to its instance, at its target address after instructions, and closes
+// up the gaps. The order of the columns that stay is kept.
+static void compact(CHIP8LOCKSTEP *ls, uint64_t instructions) {
+    int k, j, r;
+
+    for (k = 0; k < ls->count; ++k) {
+        if (ls->peel[k]) {
+            scatter(ls, k, ls->target[k], instructions);
+            ls->scalar[ls->scalar_count++] = ls->objs[k];
+        }
+    }
+    for (k = j = 0; k < ls->count; ++k) {
+        if (ls->peel[k])
+            continue;
+        for (r = 0; r < 16; ++r) {
+            ROW(ls, r)[j] = ROW(ls, r)[k];
+            STACK_ROW(ls, r)[j] = STACK_ROW(ls, r)[k];
+        }
+        ls->I[j] = ls->I[k];
+        ls->delay_timer[j] = ls->delay_timer[k];
+        ls->sound_timer[j] = ls->sound_timer[k];
+        ls->rng_state[j] = ls->rng_state[k];
+        ls->objs[j++] = ls->objs[k];
+    }
+    memset(ls->peel, 0, ls->count);
+    ls->count = j;
+}
+
+// Continues the group at pc after an instruction whose columns went to the addresses in target, and drops the
+// columns that went elsewhere.
+static void diverge(CHIP8LOCKSTEP *ls, uint16_t pc) {
+    int k, peeled = 0;
+
+    for (k = 0; k < ls->count; ++k) {
+        ls->peel[k] = ls->target[k] != pc;
+        peeled |= ls->peel[k];
+    }
+    ls->pc = pc;
+    if (peeled)
+        compact(ls, ls->instructions + 1);
+}
+
+// Skips go whichever way most of the group went. taken holds 1 in every column that skips.
+static void skip(CHIP8LOCKSTEP *ls) {
+    const uint8_t *taken = ls->taken;
+    uint16_t pc = ls->pc;
+    int k, skipped = 0;
+
+    for (k = 0; k < ls->count; ++k) {
+        skipped += taken[k];
+        ls->target[k] = pc + 2 * taken[k];
+    }
+    if (skipped && skipped < ls->count)
+        diverge(ls, skipped * 2 > ls->count ? pc + 2 : pc);
+    else if (skipped)
+        ls->pc += 2;
+}
+
+// Drops the columns whose bytes at the flagged address a, or the one after it, differ from the first column's.
+// The rest agree, so the flags can go.
+static void check_fetch(CHIP8LOCKSTEP *ls, uint16_t a) {
+    const uint8_t *first = ls->objs[0]->mem;
+    uint16_t b = (a + 1) & MEMORY_MASK;
+    int k, peeled = 0;
+
+    for (k = 1; k < ls->count; ++k) {
+        ls->peel[k] = ls->objs[k]->mem[a] != first[a] || ls->objs[k]->mem[b] != first[b];
+        ls->target[k] = ls->pc;
+        peeled |= ls->peel[k];
+    }
+    if (peeled)
+        compact(ls, ls->instructions);
+    ls->divergent[a] = ls->divergent[b] = 0;
+}
+
+// The AVX2 halves of the row kernels: they go LANE_BLOCK columns at a time, into the padding of the rows,
+// and return the column they stopped at for the scalar loop.
+#ifdef CHIP8_HAVE_AVX2
+CHIP8_AVX2 static int compare_rows_avx2(const CHIP8LOCKSTEP *ls, const uint8_t *x, const uint8_t *y, uint8_t *out) {
+    int k;
+
+    for (k = 0; k < ls->count; k += LANE_BLOCK) {
+        __m256i eq = _mm256_cmpeq_epi8(_mm256_load_si256((const __m256i *) &x[k]),
+                                       _mm256_load_si256((const __m256i *) &y[k]));
+        _mm256_store_si256((__m256i *) &out[k], _mm256_and_si256(eq, _mm256_set1_epi8(1)));
+    }
+    return k;
+}
+#endif
+
+// Compares two registers in every column: 1 where they are equal.
+static void compare_rows(CHIP8LOCKSTEP *ls, const uint8_t *x, const uint8_t *y, uint8_t *out) {
+    int k = 0;
+
+#ifdef CHIP8_HAVE_AVX2
+    if (chip8_host_avx2())
+        k = compare_rows_avx2(ls, x, y, out);
+#endif
+    for (; k < ls->count; ++k) {
+        out[k] = x[k] == y[k];
+    }
+}
+
+#ifdef CHIP8_HAVE_AVX2
+CHIP8_AVX2 static int alu_avx2(CHIP8LOCKSTEP *ls, const CHIP8DECODED *op) {
+    uint8_t *vx = ROW(ls, op->X), *vy = ROW(ls, op->Y), *vf = ROW(ls, 0xF);
+    int quirks = ls->quirks;
+    const __m256i one = _mm256_set1_epi8(1);
+    __m256i x, y;
+    int k;
+
+    for (k = 0; k < ls->count; k += LANE_BLOCK) {
+        switch (op->op) {
+            case CHIP8_OP_8XY0:
+                _mm256_store_si256((__m256i *) &vx[k], _mm256_load_si256((const __m256i *) &vy[k]));
+                break;
+            case CHIP8_OP_8XY1:
+            case CHIP8_OP_8XY2:
+            case CHIP8_OP_8XY3:
+                x = _mm256_load_si256((const __m256i *) &vx[k]);
+                y = _mm256_load_si256((const __m256i *) &vy[k]);
+                x = op->op == CHIP8_OP_8XY1 ? _mm256_or_si256(x, y) :
+                    op->op == CHIP8_OP_8XY2 ? _mm256_and_si256(x, y) : _mm256_xor_si256(x, y);
+                _mm256_store_si256((__m256i *) &vx[k], x);
+                if (quirks & CHIP8_QUIRK_VF_RESET)
+                    _mm256_store_si256((__m256i *) &vf[k], _mm256_setzero_si256());
+                break;
+            case CHIP8_OP_8XY4:
+                // Carries out when x > 255 - y, that is when x is not the larger of x and ~y.
+                x = _mm256_load_si256((const __m256i *) &vx[k]);
+                y = _mm256_xor_si256(_mm256_load_si256((const __m256i *) &vy[k]), _mm256_set1_epi8(-1));
+                _mm256_store_si256((__m256i *) &vf[k],
+                                   _mm256_andnot_si256(_mm256_cmpeq_epi8(_mm256_max_epu8(x, y), y), one));
+                _mm256_store_si256((__m256i *) &vx[k], _mm256_add_epi8(_mm256_load_si256((const __m256i *) &vx[k]),
+                                                                       _mm256_load_si256((const __m256i *) &vy[k])));
+                break;
+            case CHIP8_OP_8XY5:
+            case CHIP8_OP_8XY7:
+                x = _mm256_load_si256((const __m256i *) &vx[k]);
+                y = _mm256_load_si256((const __m256i *) &vy[k]);
+                if (op->op == CHIP8_OP_8XY7) {
+                    __m256i t = x;
+                    x = y;
+                    y = t;
+                }
+                _mm256_store_si256((__m256i *) &vf[k],
+                                   _mm256_and_si256(_mm256_cmpeq_epi8(_mm256_max_epu8(x, y), x), one));
+                x = _mm256_load_si256((const __m256i *) &vx[k]);
+                y = _mm256_load_si256((const __m256i *) &vy[k]);
+                _mm256_store_si256((__m256i *) &vx[k],
+                                   op->op == CHIP8_OP_8XY5 ? _mm256_sub_epi8(x, y) : _mm256_sub_epi8(y, x));
+                break;
+            case CHIP8_OP_8XY6:
+            case CHIP8_OP_8XYE:
+                if (quirks & CHIP8_QUIRK_SHIFT_VY)
+                    _mm256_store_si256((__m256i *) &vx[k], _mm256_load_si256((const __m256i *) &vy[k]));
+                x = _mm256_load_si256((const __m256i *) &vx[k]);
+                // There are no byte shifts; shifting words and masking off what crossed over does the same.
+                _mm256_store_si256((__m256i *) &vf[k], op->op == CHIP8_OP_8XY6 ? _mm256_and_si256(x, one) :
+                                   _mm256_and_si256(_mm256_srli_epi16(x, 7), one));
+                x = _mm256_load_si256((const __m256i *) &vx[k]);
+                _mm256_store_si256((__m256i *) &vx[k], op->op == CHIP8_OP_8XY6 ?
+                                   _mm256_and_si256(_mm256_srli_epi16(x, 1), _mm256_set1_epi8(0x7F)) :
+                                   _mm256_add_epi8(x, x));
+                break;
+        }
+    }
+    return k;
+}
+#endif
+
+// The 8XY_ instructions for every column, in the same order as the handlers, so VF written first is what
+// the result is computed from when X or Y is F.
+static void alu(CHIP8LOCKSTEP *ls, const CHIP8DECODED *op) {
+    uint8_t *vx = ROW(ls, op->X), *vy = ROW(ls, op->Y), *vf = ROW(ls, 0xF);
+    int quirks = ls->quirks, k = 0;
+
+#ifdef CHIP8_HAVE_AVX2
+    if (chip8_host_avx2())
+        k = alu_avx2(ls, op);
+#endif
+    for (; k < ls->count; ++k) {
+        switch (op->op) {
+            case CHIP8_OP_8XY0:
+                vx[k] = vy[k];
+                break;
+            case CHIP8_OP_8XY1:
+                vx[k] |= vy[k];
+                if (quirks & CHIP8_QUIRK_VF_RESET)
+                    vf[k] = 0;
+                break;
+            case CHIP8_OP_8XY2:
+                vx[k] &= vy[k];
+                if (quirks & CHIP8_QUIRK_VF_RESET)
+                    vf[k] = 0;
+                break;
+            case CHIP8_OP_8XY3:
+                vx[k] ^= vy[k];
+                if (quirks & CHIP8_QUIRK_VF_RESET)
+                    vf[k] = 0;
+                break;
+            case CHIP8_OP_8XY4:
+                vf[k] = vx[k] + vy[k] > 0xFF;
+                vx[k] += vy[k];
+                break;
+            case CHIP8_OP_8XY5:
+                vf[k] = vx[k] >= vy[k];
+                vx[k] -= vy[k];
+                break;
+            case CHIP8_OP_8XY6:
+                if (quirks & CHIP8_QUIRK_SHIFT_VY)
+                    vx[k] = vy[k];
+                vf[k] = vx[k] & 0x1;
+                vx[k] >>= 1;
+                break;
+            case CHIP8_OP_8XY7:
+                vf[k] = vy[k] >= vx[k];
+                vx[k] = vy[k] - vx[k];
+                break;
+            case CHIP8_OP_8XYE:
+                if (quirks & CHIP8_QUIRK_SHIFT_VY)
+                    vx[k] = vy[k];
+                vf[k] = vx[k] >> 7;
+                vx[k] <<= 1;
+                break;
+        }
+    }
+}
+
+#ifdef CHIP8_HAVE_AVX2
+CHIP8_AVX2 static int random_row_avx2(CHIP8LOCKSTEP *ls, uint8_t *vx, uint8_t nn) {
+    uint32_t *state = ls->rng_state;
+    const __m256i order = _mm256_setr_epi32(0, 4, 1, 5, 2, 6, 3, 7);
+    __m256i s[4], r;
+    int j, k;
+
+    for (k = 0; k < ls->count; k += LANE_BLOCK) {
+        for (j = 0; j < 4; ++j) {
+            s[j] = _mm256_load_si256((const __m256i *) &state[k + 8 * j]);
+            s[j] = _mm256_xor_si256(s[j], _mm256_slli_epi32(s[j], 13));
+            s[j] = _mm256_xor_si256(s[j], _mm256_srli_epi32(s[j], 17));
+            s[j] = _mm256_xor_si256(s[j], _mm256_slli_epi32(s[j], 5));
+            _mm256_store_si256((__m256i *) &state[k + 8 * j], s[j]);
+            s[j] = _mm256_srli_epi32(s[j], 24);
+        }
+        // Packing works within 128-bit halves, which leaves the four-byte groups to be put back in order.
+        r = _mm256_packus_epi16(_mm256_packus_epi32(s[0], s[1]), _mm256_packus_epi32(s[2], s[3]));
+        r = _mm256_permutevar8x32_epi32(r, order);
+        _mm256_store_si256((__m256i *) &vx[k], _mm256_and_si256(r, _mm256_set1_epi8(nn)));
+    }
+    return k;
+}
+#endif
+
+// CXNN: every column steps its own xorshift32 generator, eight columns to a vector.
+static void random_row(CHIP8LOCKSTEP *ls, uint8_t *vx, uint8_t nn) {
+    uint32_t *state = ls->rng_state, x;
+    int k = 0;
+
+#ifdef CHIP8_HAVE_AVX2
+    if (chip8_host_avx2())
+        k = random_row_avx2(ls, vx, nn);
+#endif
+    for (; k < ls->count; ++k) {
+        x = state[k];
+        x ^= x << 13;
+        x ^= x >> 17;
+        x ^= x << 5;
+        state[k] = x;
+        vx[k] = (x >> 24) & nn;
+    }
+}
+
+#ifdef CHIP8_HAVE_AVX2
+CHIP8_AVX2 static int tick_timers_avx2(CHIP8LOCKSTEP *ls) {
+    const __m256i one = _mm256_set1_epi8(1);
+    int k;
+
+    for (k = 0; k < ls->count; k += LANE_BLOCK) {
+        _mm256_store_si256((__m256i *) &ls->delay_timer[k],
+                           _mm256_subs_epu8(_mm256_load_si256((const __m256i *) &ls->delay_timer[k]), one));
+        _mm256_store_si256((__m256i *) &ls->sound_timer[k],
+                           _mm256_subs_epu8(_mm256_load_si256((const __m256i *) &ls->sound_timer[k]), one));
+    }
+    return k;
+}
+#endif
+
+// Timer tick for every column: saturating decrements.
+static void tick_timers(CHIP8LOCKSTEP *ls) {
+    int k = 0;
+
+#ifdef CHIP8_HAVE_AVX2
+    if (chip8_host_avx2())
+        k = tick_timers_avx2(ls);
+#endif
+    for (; k < ls->count; ++k) {
+        if (ls->delay_timer[k])
+            --ls->delay_timer[k];
+        if (ls->sound_timer[k])
+            --ls->sound_timer[k];
+    }
+}
+
+// FX33 and FX55 write each column's own memory, at its own I. The bytes written are flagged, since the
+// columns may have written different values or at different addresses.
+static void store(CHIP8LOCKSTEP *ls, const CHIP8DECODED *op) {
+    uint16_t addr;
+    uint8_t value;
+    int k, i;
+
+    for (k = 0; k < ls->count; ++k) {
+        addr = ls->I[k];
+        if (op->op == CHIP8_OP_FX33) {
+            value = ROW(ls, op->X)[k];
+            chip8_mem_write(ls->objs[k], addr, value / 100);
+            chip8_mem_write(ls->objs[k], addr + 1, (value / 10) % 10);
+            chip8_mem_write(ls->objs[k], addr + 2, value % 10);
+            for (i = 0; i < 3; ++i) {
+                ls->divergent[(addr + i) & MEMORY_MASK] = 1;
+            }
+            continue;
+        }
+        for (i = 0; i <= op->X; ++i) {
+            chip8_mem_write(ls->objs[k], addr + i, ROW(ls, i)[k]);
+            ls->divergent[(addr + i) & MEMORY_MASK] = 1;
+        }
+        if (ls->quirks & CHIP8_QUIRK_LOAD_X1)
+            ls->I[k] += op->X + 1;
+        if (ls->quirks & CHIP8_QUIRK_LOAD_X)
+            ls->I[k] += op->X;
+    }
+}
+
+/**
+ * Runs the group for up to count instructions, all within one frame, and returns how many it ran before it
+ * ran out of columns. Each instruction is executed for every column exactly as its handler in
+ * chip8-implementation.c would, with the program counter already past it; where the columns end up at
+ * different addresses, the group goes on with one of them and the others are handed back to their instances.
+ */
+static uint64_t run_group(CHIP8LOCKSTEP *ls, uint64_t count) {
+    CHIP8DECODED decoded;
+    const CHIP8DECODED *op;
+    CHIP8OBJECT *first;
+    uint8_t *vx;
+    uint16_t a, pc;
+    uint64_t done;
+    int k, i, idle = 0;
+
+    for (done = 0; done < count && ls->count; ++done, ++ls->instructions) {
+        a = ls->pc & MEMORY_MASK;
+        if (ls->divergent[a] || ls->divergent[(a + 1) & MEMORY_MASK]) {
+            check_fetch(ls, a);
+            if (!ls->count)
+                break;
+        }
+        ls->lockstep += ls->count;
+        first = ls->objs[0];
+        // A copy, since FX33 and FX55 in the first column can invalidate the entry before the others run.
+        decoded = first->decoded[a];
+        if (decoded.op == CHIP8_OP_UNDECODED)
+            decoded = *chip8_decode(first, ls->pc);
+        op = &decoded;
+        ls->pc += 2;
+        vx = ROW(ls, op->X);
+
+        switch (op->op) {
+            case CHIP8_OP_00E0:
+                for (k = 0; k < ls->count; ++k) {
+                    chip8_clear_frame(ls->objs[k]);
+                }
+                break;
+            case CHIP8_OP_00EE:
+                ls->sp = (ls->sp - 1) & STACK_MASK;
+                memcpy(ls->target, STACK_ROW(ls, ls->sp), ls->count * sizeof(uint16_t));
+                diverge(ls, ls->target[0]);
+                break;
+            case CHIP8_OP_1NNN:
+                idle = op->NNN == ls->pc - 2;
+                ls->pc = op->NNN;
+                break;
+            case CHIP8_OP_2NNN:
+                for (k = 0; k < ls->count; ++k) {
+                    STACK_ROW(ls, ls->sp)[k] = ls->pc;
+                }
+                ls->pc = op->NNN;
+                ls->sp = (ls->sp + 1) & STACK_MASK;
+                break;
+            case CHIP8_OP_3XNN:
+            case CHIP8_OP_4XNN:
+                for (k = 0; k < ls->count; ++k) {
+                    ls->taken[k] = (vx[k] == op->NN) == (op->op == CHIP8_OP_3XNN);
+                }
+                skip(ls);
+                break;
+            case CHIP8_OP_5XY0:
+            case CHIP8_OP_9XY0:
+                compare_rows(ls, vx, ROW(ls, op->Y), ls->taken);
+                if (op->op == CHIP8_OP_9XY0) {
+                    for (k = 0; k < ls->count; ++k) {
+                        ls->taken[k] ^= 1;
+                    }
+                }
+                skip(ls);
+                break;
+            case CHIP8_OP_6XNN:
+                memset(vx, op->NN, ls->count);
+                break;
+            case CHIP8_OP_7XNN:
+                for (k = 0; k < ls->count; ++k) {
+                    vx[k] += op->NN;
+                }
+                break;
+            case CHIP8_OP_8XY0:
+            case CHIP8_OP_8XY1:
+            case CHIP8_OP_8XY2:
+            case CHIP8_OP_8XY3:
+            case CHIP8_OP_8XY4:
+            case CHIP8_OP_8XY5:
+            case CHIP8_OP_8XY6:
+            case CHIP8_OP_8XY7:
+            case CHIP8_OP_8XYE:
+                alu(ls, op);
+                break;
+            case CHIP8_OP_ANNN:
+                for (k = 0; k < ls->count; ++k) {
+                    ls->I[k] = op->NNN;
+                }
+                break;
+            case CHIP8_OP_BNNN:
+                vx = ROW(ls, ls->quirks & CHIP8_QUIRK_JUMP_VX ? op->X : 0x0);
+                for (k = 0; k < ls->count; ++k) {
+                    ls->target[k] = op->NNN + vx[k];
+                }
+                diverge(ls, ls->target[0]);
+                break;
+            case CHIP8_OP_CXNN:
+                random_row(ls, vx, op->NN);
+                break;
+            case CHIP8_OP_DXYN:
+                for (k = 0; k < ls->count; ++k) {
+                    ROW(ls, 0xF)[k] = chip8_draw_sprite(ls->objs[k], ls->I[k], vx[k], ROW(ls, op->Y)[k], op->NN & 0xF);
+                }
+                break;
+            case CHIP8_OP_EX9E:
+            case CHIP8_OP_EXA1:
+                for (k = 0; k < ls->count; ++k) {
+                    ls->taken[k] = !chip8_register_read(ls->objs[k], vx[k] & 0xF) == (op->op == CHIP8_OP_EXA1);
+                }
+                skip(ls);
+                break;
+            case CHIP8_OP_FX07:
+                memcpy(vx, ls->delay_timer, ls->count);
+                break;
+            case CHIP8_OP_FX0A:
+                // Waits at the instruction until a key is down.
+                pc = ls->pc;
+                for (k = 0; k < ls->count; ++k) {
+                    ls->target[k] = pc - 2;
+                    for (i = 0; i < 0x10; ++i) {
+                        if (chip8_register_read(ls->objs[k], i)) {
+                            vx[k] = chip8_register_read(ls->objs[k], i);
+                            ls->target[k] = pc;
+                            break;
+                        }
+                    }
+                }
+                diverge(ls, ls->target[0]);
+                idle = ls->pc == pc - 2;
+                break;
+            case CHIP8_OP_FX15:
+                memcpy(ls->delay_timer, vx, ls->count);
+                break;
+            case CHIP8_OP_FX18:
+                memcpy(ls->sound_timer, vx, ls->count);
+                break;
+            case CHIP8_OP_FX1E:
+                for (k = 0; k < ls->count; ++k) {
+                    ls->I[k] += vx[k];
+                }
+                break;
+            case CHIP8_OP_FX29:
+                for (k = 0; k < ls->count; ++k) {
+                    ls->I[k] = 5 * (vx[k] & 0xF);
+                }
+                break;
+            case CHIP8_OP_FX33:
+            case CHIP8_OP_FX55:
+                store(ls, op);
+                break;
+            case CHIP8_OP_FX65:
+                for (k = 0; k < ls->count; ++k) {
+                    for (i = 0; i <= op->X; ++i) {
+                        ROW(ls, i)[k] = chip8_mem_read(ls->objs[k], ls->I[k] + i);
+                    }
+                    if (ls->quirks & CHIP8_QUIRK_LOAD_X1)
+                        ls->I[k] += op->X + 1;
+                    if (ls->quirks & CHIP8_QUIRK_LOAD_X)
+                        ls->I[k] += op->X;
+                }
+                break;
+        }
+        // A jump to itself, or waiting for a key none of the instances has down, does nothing until the keys or
+        // the timers change, which is not before the frame is over.
+        if (idle) {
+            idle = 0;
+            ls->lockstep += (count - done - 1) * ls->count;
+            ls->instructions += count - done - 1;
+            done = count - 1;
+        }
+    }
+    return done;
+}
+
+// Called at every frame boundary. Instances running apart that are back at the group's address, with the same
+// stack depth, join it; if the group is down to one column or none, it is formed afresh around the address
+// most instances are at.
+static void regroup(CHIP8LOCKSTEP *ls) {
+    CHIP8OBJECT *chip8;
+    uint16_t best = 0;
+    int i, k;
+
+    if (ls->count < 2) {
+        for (k = 0; k < ls->count; ++k) {
+            ls->peel[k] = 1;
+            ls->target[k] = ls->pc;
+        }
+        compact(ls, ls->instructions);
+        memset(ls->divergent, 0, sizeof(ls->divergent));
+        memset(ls->pcs, 0, sizeof(ls->pcs));
+        for (i = 0; i < ls->scalar_count; ++i) {
+            k = ls->scalar[i]->program_counter & MEMORY_MASK;
+            if (++ls->pcs[k] > ls->pcs[best])
+                best = k;
+        }
+        if (ls->pcs[best] < 2)
+            return;
+        for (i = 0; i < ls->scalar_count; ++i) {
+            if ((ls->scalar[i]->program_counter & MEMORY_MASK) == best) {
+                ls->pc = ls->scalar[i]->program_counter;
+                ls->sp = ls->scalar[i]->stack_pointer;
+                break;
+            }
+        }
+    }
+
+    for (i = 0; i < ls->scalar_count;) {
+        chip8 = ls->scalar[i];
+        if (chip8->program_counter != ls->pc || chip8->stack_pointer != ls->sp) {
+            ++i;
+            continue;
+        }
+        join(ls, chip8);
+        ls->scalar[i] = ls->scalar[--ls->scalar_count];
+    }
+}
+
+/**
+ * Runs every instance of the batch for count instructions, with the same result as chip8_run on each of them.
+ * Between calls the instances hold their whole state, so they can be inspected, saved or given input, as long
+ * as they are not run on their own.
+ */
+void chip8_lockstep_run(CHIP8LOCKSTEP *ls, uint64_t count) {
+    uint32_t frame = ls->instructions_per_frame;
+    uint64_t n, end, left;
+    int i, k;
+
+    // Instances start apart, with the state they were left in, and are grouped from scratch.
+    ls->count = 0;
+    while (count) {
+        n = frame - ls->instructions % frame;
+        if (n > count)
+            n = count;
+        end = ls->instructions + n;
+
+        regroup(ls);
+        run_group(ls, n);
+        ls->instructions = end;
+        if (end % frame == 0)
+            tick_timers(ls);
+        for (i = 0; i < ls->scalar_count; ++i) {
+            left = end - ls->scalar[i]->instructions;
+            ls->separate += left;
+            if (left)
+                chip8_run(ls->scalar[i], left);
+            else if (end % frame == 0)
+                chip8_tick_timers(ls->scalar[i]);
+        }
+        count -= n;
+    }
+
+    for (k = 0; k < ls->count; ++k) {
+        scatter(ls, k, ls->pc, ls->instructions);
+        ls->scalar[ls->scalar_count++] = ls->objs[k];
+    }
+    ls->count = 0;
+}
+
+// How many instructions, summed over the instances, the batch has run as a group and how many apart.
+void chip8_lockstep_counts(const CHIP8LOCKSTEP *ls, uint64_t *lockstep, uint64_t *separate) {
+    *lockstep = ls->lockstep;
+    *separate = ls->separate;
+}
@@ -0,0 +1,307 @@
+#define _XOPEN_SOURCE 700
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Every x86-64 compiler has SSE2, which also covers the AVX2 kernels compiled for AVX2 on their own.
+#if defined(__SSE2__)
+#include <immintrin.h>
+#endif
+
+#include "chip8.h"
+
+static const uint8_t font[80] = {
+    0xF0, 0x90, 0x90, 0x90, 0xF0,
+    0x20, 0x60, 0x20, 0x20, 0x70,
+    0xF0, 0x10, 0xF0, 0x80, 0xF0,
+    0xF0, 0x10, 0xF0, 0x10, 0xF0,
+    0x90, 0x90, 0xF0, 0x10, 0x10,
+    0xF0, 0x80, 0xF0, 0x10, 0xF0,
+    0xF0, 0x80, 0xF0, 0x90, 0xF0,
+    0xF0, 0x10, 0x20, 0x40, 0x40,
+    0xF0, 0x90, 0xF0, 0x90, 0xF0,
+    0xF0, 0x90, 0xF0, 0x10, 0xF0,
+    0xF0, 0x90, 0xF0, 0x90, 0x90,
+    0xE0, 0x90, 0xE0, 0x90, 0xE0,
+    0xF0, 0x80, 0x80, 0x80, 0xF0,
+    0xE0, 0x90, 0x90, 0x90, 0xE0,
+    0xF0, 0x80, 0xF0, 0x80, 0xF0,
+    0xF0, 0x80, 0xF0, 0x80, 0x80
+};
+
+uint8_t chip8_mem_read(CHIP8OBJECT *chip8, uint16_t address) {
+    return chip8->mem[address & MEMORY_MASK];
+}
+
+// Writing a byte invalidates the decode cache entries of the two instructions that can contain it, the one
+// starting at the address and the one starting just before it, so self-modifying code is decoded again,
+// and marks its line for chip8_mem_reset.
+void chip8_mem_write(CHIP8OBJECT *chip8, uint16_t address, uint8_t value) {
+    chip8->mem[address & MEMORY_MASK] = value;
+    chip8->mem_dirty |= 1ull << ((address & MEMORY_MASK) / MEMORY_LINE);
+    chip8->decoded[address & MEMORY_MASK].op = CHIP8_OP_UNDECODED;
+    chip8->decoded[(address - 1) & MEMORY_MASK].op = CHIP8_OP_UNDECODED;
+    if (chip8->jit)
+        chip8_jit_invalidate(chip8, address);
+    // Writing a byte an ahead-of-time translation was made from retires it, see chip8-aot.c.
+    if (chip8->aot_valid && chip8->aot->code[(address & MEMORY_MASK) >> 3] >> (address & 7) & 1)
+        chip8->aot_valid = 0;
+}
+
+uint8_t chip8_register_read(CHIP8OBJECT *chip8, uint8_t regis) {
+    if (regis < CHIP8_REG_DELAY)
+        return chip8->buttons[regis];
+    else if (regis == CHIP8_REG_DELAY)
+        return chip8->delay_timer;
+    else if (regis == CHIP8_REG_SOUND)
+        return chip8->sound_timer;
+
+    return 0;
+}
+
+// Setting the sound timer is also passed on to the beeper, if there is one, as the exact point the beep
+// starts or stops.
+void chip8_register_write(CHIP8OBJECT *chip8, uint8_t regis, uint8_t value) {
+    if (regis == CHIP8_REG_DELAY) {
+        chip8->delay_timer = value;
+    }
+    else if (regis == CHIP8_REG_SOUND) {
+        chip8->sound_timer = value;
+        if (chip8->audio)
+            chip8_audio_sound(chip8->audio, chip8->instructions, chip8->instructions_per_frame, value);
+    }
+}
+
+void chip8_tick_timers(CHIP8OBJECT *chip8) {
+    if (chip8->delay_timer)
+        --chip8->delay_timer;
+    if (chip8->sound_timer)
+        --chip8->sound_timer;
+}
+
+// Rows that already were blank are not marked dirty, so clearing an empty screen costs the front end nothing.
+void chip8_clear_frame(CHIP8OBJECT *chip8) {
+    int y;
+
+    for (y = 0; y < 32; ++y) {
+        if (chip8->framebuffer[y])
+            chip8->dirty_rows |= 1u << y;
+    }
+    memset(chip8->framebuffer, 0, sizeof(chip8->framebuffer));
+}
+
+// Returns the rows changed since the last call, bit y set for row y, and starts tracking afresh.
+uint32_t chip8_take_dirty_rows(CHIP8OBJECT *chip8) {
+    uint32_t dirty = chip8->dirty_rows;
+
+    chip8->dirty_rows = 0;
+    return dirty;
+}
+
+void chip8_mem_clear(CHIP8OBJECT *chip8) {
+    memset(chip8->mem, 0, sizeof(chip8->mem));
+    chip8->mem_dirty = ~0ull;
+    chip8_invalidate_decoded(chip8);
+}
+
+void chip8_invalidate_decoded(CHIP8OBJECT *chip8) {
+    memset(chip8->decoded, 0, sizeof(chip8->decoded));
+    if (chip8->jit)
+        chip8_jit_flush(chip8);
+    if (chip8->aot)
+        chip8_aot_validate(chip8);
+}
+
+// The framebuffer holds one 64-bit word per row with the leftmost pixel in the top bit, so a sprite row is
+// placed with a single shift (pixels past the right edge fall off) and drawn with an AND for the collision
+// test and an XOR. Rows are independent, so they are done several at a time with SSE2 or AVX2.
+#ifdef CHIP8_HAVE_AVX2
+// Draws four rows at a time as far as they go and returns how many it drew.
+CHIP8_AVX2 static int draw_rows_avx2(uint64_t *fb, const uint64_t *rows, int height, uint64_t *hit) {
+    __m256i acc = _mm256_setzero_si256();
+    int i;
+
+    for (i = 0; i + 4 <= height; i += 4) {
+        __m256i sprite = _mm256_loadu_si256((const __m256i *) &rows[i]);
+        __m256i screen = _mm256_loadu_si256((const __m256i *) &fb[i]);
+        acc = _mm256_or_si256(acc, _mm256_and_si256(screen, sprite));
+        _mm256_storeu_si256((__m256i *) &fb[i], _mm256_xor_si256(screen, sprite));
+    }
+    *hit |= !_mm256_testz_si256(acc, acc);
+    return i;
+}
+#endif
+
+static inline int draw_sprite(CHIP8OBJECT *chip8, uint16_t address, uint8_t x, uint8_t y, uint8_t height) {
+    uint64_t rows[16], *fb;
+    uint64_t hit = 0;
+    uint32_t dirty = 0;
+    int i = 0;
+
+    y &= 0x1F;
+    x &= 0x3F;
+    if ((height + y) > 32)
+        height = 32 - y;
+
+    fb = &chip8->framebuffer[y];
+    for (i = 0; i < height; ++i) {
+        rows[i] = (uint64_t) chip8_mem_read(chip8, address + i) << 56 >> x;
+        if (rows[i])
+            dirty |= 1u << i;
+    }
+    chip8->dirty_rows |= dirty << y;
+
+    i = 0;
+#ifdef CHIP8_HAVE_AVX2
+    if (chip8_host_avx2())
+        i = draw_rows_avx2(fb, rows, height, &hit);
+#endif
+#if defined(__SSE2__)
+    {
+        __m128i acc = _mm_setzero_si128();
+        for (; i + 2 <= height; i += 2) {
+            __m128i sprite = _mm_loadu_si128((const __m128i *) &rows[i]);
+            __m128i screen = _mm_loadu_si128((const __m128i *) &fb[i]);
+            acc = _mm_or_si128(acc, _mm_and_si128(screen, sprite));
+            _mm_storeu_si128((__m128i *) &fb[i], _mm_xor_si128(screen, sprite));
+        }
+        hit |= _mm_movemask_epi8(_mm_cmpeq_epi8(acc, _mm_setzero_si128())) != 0xFFFF;
+    }
+#endif
+    for (; i < height; ++i) {
+        hit |= fb[i] & rows[i];
+        fb[i] ^= rows[i];
+    }
+
+    return hit != 0;
+}
+
+int chip8_draw_sprite(CHIP8OBJECT *chip8, uint16_t address, uint8_t x, uint8_t y, uint8_t height) {
+#ifdef CHIP8_PROFILE
+    uint64_t start = chip8_profile_clock();
+    int hit = draw_sprite(chip8, address, x, y, height);
+
+    chip8_profile_time(chip8->profile, CHIP8_PROFILE_SPRITE, start);
+    return hit;
+#else
+    return draw_sprite(chip8, address, x, y, height);
+#endif
+}
+
+// Copies the lines marked in dirty back from the image and forgets whatever was decoded or compiled from
+// them, including the instruction that starts in the last byte before a line.
+static void restore_lines(CHIP8OBJECT *chip8, uint64_t dirty) {
+    int line, start;
+
+    if (!dirty)
+        return;
+    for (line = 0; dirty; ++line, dirty >>= 1) {
+        if (!(dirty & 1))
+            continue;
+        start = line * MEMORY_LINE;
+        memcpy(&chip8->mem[start], &chip8->image[start], MEMORY_LINE);
+        memset(&chip8->decoded[start], 0, MEMORY_LINE * sizeof(CHIP8DECODED));
+        chip8->decoded[(start - 1) & MEMORY_MASK].op = CHIP8_OP_UNDECODED;
+    }
+    if (chip8->jit)
+        chip8_jit_flush(chip8);
+    if (chip8->aot)
+        chip8_aot_validate(chip8);
+}
+
+/**
+ * Makes size bytes at data the instance's ROM: they and the font become its image and are copied into
+ * memory, along with whatever the old ROM or the program had changed, so loading a ROM costs about as much
+ * as the memory it touches. Used by chip8_load_rom and directly by the fuzzing harness.
+ */
+int chip8_load_rom_data(CHIP8OBJECT *chip8, const uint8_t *data, size_t size) {
+    uint64_t lines;
+    int end, n;
+
+    if (size > MEMORY_SIZE - 0x200) {
+        fprintf(stderr, "ROM size too large, bailing out\n");
+        return -1;
+    }
+
+    end = chip8->image_end > 0x200 + size ? chip8->image_end : 0x200 + (int) size;
+    memset(chip8->image + 0x200, 0, end - 0x200);
+    memcpy(chip8->image + 0x200, data, size);
+    memcpy(chip8->image, font, 80);
+    chip8->image_end = 0x200 + size;
+
+    // A mask of all 64 lines cannot be made by shifting.
+    n = (end + MEMORY_LINE - 1) / MEMORY_LINE;
+    lines = n >= 64 ? ~0ull : (1ull << n) - 1;
+    restore_lines(chip8, chip8->mem_dirty | lines);
+    chip8->mem_dirty = 0;
+    memset(chip8->buttons, 0, 16);
+    chip8_clear_frame(chip8);
+    return 0;
+}
+
+int chip8_load_rom(CHIP8OBJECT *chip8, const char *filename) {
+    uint8_t data[MEMORY_SIZE - 0x200];
+    FILE *fileptr;
+    long size;
+
+    if (!(fileptr = fopen(filename, "rb"))) {
+        fprintf(stderr, "Could not open ROM: %s\n", filename);
+        return -1;
+    }
+
+    // Size of file
+    fseek(fileptr, 0, SEEK_END);
+    size = ftell(fileptr);
+    fseek(fileptr, 0, SEEK_SET);
+
+    if (size > MEMORY_SIZE - 0x200) {
+        fprintf(stderr, "ROM size too large, bailing out\n");
+        fclose(fileptr);
+        return -1;
+    }
+
+    if (fread(data, 1, size, fileptr) != (size_t) size) {
+        fprintf(stderr, "Could not read ROM\n");
+        fclose(fileptr);
+        return -1;
+    }
+
+    fclose(fileptr);
+
+    if (chip8_load_rom_data(chip8, data, size))
+        return -1;
+
+    if (!chip8->romfn)
+        chip8->romfn = strdup(filename);
+
+    return 0;
+}
+
+// Puts memory back the way the ROM was loaded without going back to the file: only the lines written to
+// since are copied from the image.
+void chip8_mem_reset(CHIP8OBJECT *chip8) {
+    restore_lines(chip8, chip8->mem_dirty);
+    chip8->mem_dirty = 0;
+    memset(chip8->buttons, 0, 16);
+    chip8_clear_frame(chip8);
+    chip8_register_write(chip8, CHIP8_REG_DELAY, 0);
+    chip8_register_write(chip8, CHIP8_REG_SOUND, 0);
+}
+
+// FNV-1a over the framebuffer, one 64-bit row at a time from the leftmost pixel, so the hash only
+// depends on which pixels are lit.
+uint64_t chip8_framebuffer_hash(const CHIP8OBJECT *chip8) {
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    int y, b;
+
+    for (y = 0; y < 32; ++y) {
+        for (b = 56; b >= 0; b -= 8) {
+            hash ^= (chip8->framebuffer[y] >> b) & 0xff;
+            hash *= 0x100000001b3ULL;
+        }
+    }
+
+    return hash;
+}
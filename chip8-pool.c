@@ -0,0 +1,297 @@
+#define _XOPEN_SOURCE 700
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "chip8.h"
+
+// Instructions a batch job runs before going back to its worker's queue, so that idle workers can
+// steal the remaining instances while a busy worker is still in the middle of its own.
+#define BATCH_SLICE (INSTRUCTIONS_PER_FRAME * 600)
+#define DEQUE_INITIAL_CAPACITY 64
+
+typedef struct {
+    CHIP8TaskFn fn;
+    void *arg;
+} CHIP8TASK;
+
+// Per worker double-ended queue. The owner pushes and pops at the tail (newest first, which keeps a
+// resubmitted VM hot in the owner's cache), thieves take from the head (oldest first). Each deque
+// sits on its own cache lines so workers never contend on each other's locks unless they steal.
+typedef struct {
+    pthread_mutex_t lock;
+    CHIP8TASK *tasks;
+    size_t capacity;
+    size_t head;
+    size_t tail;
+} __attribute__((aligned(64))) CHIP8DEQUE;
+
+struct CHIP8POOL {
+    int threads;
+    pthread_t *workers;
+    CHIP8DEQUE *deques;
+    pthread_mutex_t lock;
+    pthread_cond_t work_cond;
+    pthread_cond_t done_cond;
+    size_t queued;
+    size_t pending;
+    unsigned next;
+    int shutdown;
+};
+
+typedef struct {
+    CHIP8POOL *pool;
+    int index;
+} CHIP8WORKERARG;
+
+typedef struct {
+    CHIP8OBJECT *vm;
+    uint64_t remaining;
+} CHIP8BATCHJOB;
+
+static __thread CHIP8POOL *current_pool;
+static __thread int current_worker = -1;
+
+static void deque_push(CHIP8DEQUE *deque, CHIP8TASK task) {
+    CHIP8TASK *grown;
+    size_t i, count;
+
+    pthread_mutex_lock(&deque->lock);
+    count = deque->tail - deque->head;
+    if (count == deque->capacity) {
+        grown = malloc(2 * deque->capacity * sizeof(CHIP8TASK));
+        if (!grown) {
+            fprintf(stderr, "Out of memory growing the work queue\n");
+            abort();
+        }
+        for (i = 0; i < count; ++i) {
+            grown[i] = deque->tasks[(deque->head + i) & (deque->capacity - 1)];
+        }
+        free(deque->tasks);
+        deque->tasks = grown;
+        deque->capacity *= 2;
+        deque->head = 0;
+        deque->tail = count;
+    }
+    deque->tasks[deque->tail++ & (deque->capacity - 1)] = task;
+    pthread_mutex_unlock(&deque->lock);
+}
+
+static int deque_pop(CHIP8DEQUE *deque, CHIP8TASK *task) {
+    int found = 0;
+
+    pthread_mutex_lock(&deque->lock);
+    if (deque->tail != deque->head) {
+        *task = deque->tasks[--deque->tail & (deque->capacity - 1)];
+        found = 1;
+    }
+    pthread_mutex_unlock(&deque->lock);
+    return found;
+}
+
+static int deque_steal(CHIP8DEQUE *deque, CHIP8TASK *task) {
+    int found = 0;
+
+    pthread_mutex_lock(&deque->lock);
+    if (deque->tail != deque->head) {
+        *task = deque->tasks[deque->head++ & (deque->capacity - 1)];
+        found = 1;
+    }
+    pthread_mutex_unlock(&deque->lock);
+    return found;
+}
+
+// Takes work from the worker's own deque first and otherwise tries every other worker once, starting
+// at a different victim each time so thieves spread out instead of all hitting worker 0.
+static int find_task(CHIP8POOL *pool, int self, unsigned *seed, CHIP8TASK *task) {
+    int i, victim;
+
+    if (deque_pop(&pool->deques[self], task))
+        return 1;
+
+    *seed = *seed * 1103515245u + 12345u;
+    victim = (*seed >> 16) % pool->threads;
+    for (i = 0; i < pool->threads; ++i, victim = (victim + 1) % pool->threads) {
+        if (victim != self && deque_steal(&pool->deques[victim], task))
+            return 1;
+    }
+
+    return 0;
+}
+
+static void *worker_main(void *data) {
+    CHIP8WORKERARG *worker = data;
+    CHIP8POOL *pool = worker->pool;
+    int self = worker->index;
+    unsigned seed = 0x9E3779B9u * (self + 1);
+    CHIP8TASK task;
+
+    free(worker);
+    current_pool = pool;
+    current_worker = self;
+
+    for (;;) {
+        if (find_task(pool, self, &seed, &task)) {
+            __atomic_sub_fetch(&pool->queued, 1, __ATOMIC_ACQ_REL);
+            task.fn(pool, task.arg);
+            if (__atomic_sub_fetch(&pool->pending, 1, __ATOMIC_ACQ_REL) == 0) {
+                pthread_mutex_lock(&pool->lock);
+                pthread_cond_broadcast(&pool->done_cond);
+                pthread_mutex_unlock(&pool->lock);
+            }
+            continue;
+        }
+
+        pthread_mutex_lock(&pool->lock);
+        while (!pool->shutdown && __atomic_load_n(&pool->queued, __ATOMIC_ACQUIRE) == 0) {
+            pthread_cond_wait(&pool->work_cond, &pool->lock);
+        }
+        if (pool->shutdown && __atomic_load_n(&pool->queued, __ATOMIC_ACQUIRE) == 0) {
+            pthread_mutex_unlock(&pool->lock);
+            break;
+        }
+        pthread_mutex_unlock(&pool->lock);
+    }
+
+    return NULL;
+}
+
+// Creates a pool with the given number of worker threads, or one per online core when threads is 0.
+CHIP8POOL *chip8_pool_create(int threads) {
+    CHIP8POOL *pool;
+    CHIP8WORKERARG *worker;
+    void *deques;
+    int i;
+
+    if (threads <= 0) {
+        threads = (int) sysconf(_SC_NPROCESSORS_ONLN);
+        if (threads <= 0)
+            threads = 1;
+    }
+
+    if (!(pool = calloc(1, sizeof(CHIP8POOL))))
+        return NULL;
+    if (posix_memalign(&deques, 64, threads * sizeof(CHIP8DEQUE))) {
+        free(pool);
+        return NULL;
+    }
+    memset(deques, 0, threads * sizeof(CHIP8DEQUE));
+    pool->deques = deques;
+    pool->workers = calloc(threads, sizeof(pthread_t));
+    pool->threads = threads;
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->work_cond, NULL);
+    pthread_cond_init(&pool->done_cond, NULL);
+
+    for (i = 0; i < threads; ++i) {
+        pthread_mutex_init(&pool->deques[i].lock, NULL);
+        pool->deques[i].capacity = DEQUE_INITIAL_CAPACITY;
+        pool->deques[i].tasks = malloc(DEQUE_INITIAL_CAPACITY * sizeof(CHIP8TASK));
+    }
+
+    for (i = 0; i < threads; ++i) {
+        worker = malloc(sizeof(CHIP8WORKERARG));
+        worker->pool = pool;
+        worker->index = i;
+        if (pthread_create(&pool->workers[i], NULL, worker_main, worker)) {
+            fprintf(stderr, "Could not start worker thread %d\n", i);
+            abort();
+        }
+    }
+
+    return pool;
+}
+
+void chip8_pool_destroy(CHIP8POOL *pool) {
+    int i;
+
+    if (!pool)
+        return;
+
+    pthread_mutex_lock(&pool->lock);
+    pool->shutdown = 1;
+    pthread_cond_broadcast(&pool->work_cond);
+    pthread_mutex_unlock(&pool->lock);
+
+    for (i = 0; i < pool->threads; ++i) {
+        pthread_join(pool->workers[i], NULL);
+    }
+    for (i = 0; i < pool->threads; ++i) {
+        pthread_mutex_destroy(&pool->deques[i].lock);
+        free(pool->deques[i].tasks);
+    }
+
+    pthread_cond_destroy(&pool->done_cond);
+    pthread_cond_destroy(&pool->work_cond);
+    pthread_mutex_destroy(&pool->lock);
+    free(pool->deques);
+    free(pool->workers);
+    free(pool);
+}
+
+int chip8_pool_threads(const CHIP8POOL *pool) {
+    return pool->threads;
+}
+
+// Queues a task. Tasks submitted from inside a worker go onto that worker's own deque; everything
+// else is dealt round-robin across the workers.
+void chip8_pool_submit(CHIP8POOL *pool, CHIP8TaskFn fn, void *arg) {
+    CHIP8TASK task = {fn, arg};
+    int target;
+
+    __atomic_add_fetch(&pool->pending, 1, __ATOMIC_ACQ_REL);
+    if (current_pool == pool)
+        target = current_worker;
+    else
+        target = __atomic_fetch_add(&pool->next, 1, __ATOMIC_RELAXED) % pool->threads;
+    __atomic_add_fetch(&pool->queued, 1, __ATOMIC_ACQ_REL);
+    deque_push(&pool->deques[target], task);
+
+    pthread_mutex_lock(&pool->lock);
+    pthread_cond_signal(&pool->work_cond);
+    pthread_mutex_unlock(&pool->lock);
+}
+
+// Blocks until every submitted task, including the ones those tasks submitted, has finished.
+void chip8_pool_wait(CHIP8POOL *pool) {
+    pthread_mutex_lock(&pool->lock);
+    while (__atomic_load_n(&pool->pending, __ATOMIC_ACQUIRE)) {
+        pthread_cond_wait(&pool->done_cond, &pool->lock);
+    }
+    pthread_mutex_unlock(&pool->lock);
+}
+
+static void batch_slice(CHIP8POOL *pool, void *arg) {
+    CHIP8BATCHJOB *job = arg;
+    uint64_t n = job->remaining < BATCH_SLICE ? job->remaining : BATCH_SLICE;
+
+    chip8_run(job->vm, n);
+    job->remaining -= n;
+    if (job->remaining)
+        chip8_pool_submit(pool, batch_slice, job);
+}
+
+// Runs every instance in vms for the given number of instructions and returns once all are done.
+void chip8_pool_run(CHIP8POOL *pool, CHIP8OBJECT **vms, int count, uint64_t instructions) {
+    CHIP8BATCHJOB *jobs;
+    int i;
+
+    if (count <= 0 || !instructions)
+        return;
+    if (!(jobs = malloc(count * sizeof(CHIP8BATCHJOB)))) {
+        fprintf(stderr, "Out of memory allocating batch jobs\n");
+        return;
+    }
+
+    for (i = 0; i < count; ++i) {
+        jobs[i].vm = vms[i];
+        jobs[i].remaining = instructions;
+        chip8_pool_submit(pool, batch_slice, &jobs[i]);
+    }
+    chip8_pool_wait(pool);
+    free(jobs);
+}
@@ -0,0 +1,193 @@
+#define _XOPEN_SOURCE 700
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "chip8.h"
+
+#define PROFILE_TOP 16
+
+struct CHIP8PROFILE {
+    uint64_t instructions;
+    uint64_t ops[CHIP8_OP_COUNT];
+    uint64_t pcs[MEMORY_SIZE];
+    uint64_t blocks[MEMORY_SIZE];
+    uint8_t pc_ops[MEMORY_SIZE];
+    uint16_t next_pc;
+    uint8_t branched;
+    uint64_t calls[CHIP8_PROFILE_TIMERS];
+    uint64_t ns[CHIP8_PROFILE_TIMERS];
+};
+
+static const char *const op_names[CHIP8_OP_COUNT] = {
+    [CHIP8_OP_UNDECODED] = "undecoded", [CHIP8_OP_UNKNOWN] = "unknown",
+    [CHIP8_OP_00E0] = "00E0", [CHIP8_OP_00EE] = "00EE", [CHIP8_OP_1NNN] = "1NNN", [CHIP8_OP_2NNN] = "2NNN",
+    [CHIP8_OP_3XNN] = "3XNN", [CHIP8_OP_4XNN] = "4XNN", [CHIP8_OP_5XY0] = "5XY0", [CHIP8_OP_6XNN] = "6XNN",
+    [CHIP8_OP_7XNN] = "7XNN", [CHIP8_OP_8XY0] = "8XY0", [CHIP8_OP_8XY1] = "8XY1", [CHIP8_OP_8XY2] = "8XY2",
+    [CHIP8_OP_8XY3] = "8XY3", [CHIP8_OP_8XY4] = "8XY4", [CHIP8_OP_8XY5] = "8XY5", [CHIP8_OP_8XY6] = "8XY6",
+    [CHIP8_OP_8XY7] = "8XY7", [CHIP8_OP_8XYE] = "8XYE", [CHIP8_OP_9XY0] = "9XY0", [CHIP8_OP_ANNN] = "ANNN",
+    [CHIP8_OP_BNNN] = "BNNN", [CHIP8_OP_CXNN] = "CXNN", [CHIP8_OP_DXYN] = "DXYN", [CHIP8_OP_EX9E] = "EX9E",
+    [CHIP8_OP_EXA1] = "EXA1", [CHIP8_OP_FX07] = "FX07", [CHIP8_OP_FX0A] = "FX0A", [CHIP8_OP_FX15] = "FX15",
+    [CHIP8_OP_FX18] = "FX18", [CHIP8_OP_FX1E] = "FX1E", [CHIP8_OP_FX29] = "FX29", [CHIP8_OP_FX33] = "FX33",
+    [CHIP8_OP_FX55] = "FX55", [CHIP8_OP_FX65] = "FX65"
+};
+
+// Instructions after which the next one starts a basic block, whether or not the branch was taken.
+static const uint8_t branches[CHIP8_OP_COUNT] = {
+    [CHIP8_OP_00EE] = 1, [CHIP8_OP_1NNN] = 1, [CHIP8_OP_2NNN] = 1, [CHIP8_OP_3XNN] = 1, [CHIP8_OP_4XNN] = 1,
+    [CHIP8_OP_5XY0] = 1, [CHIP8_OP_9XY0] = 1, [CHIP8_OP_BNNN] = 1, [CHIP8_OP_EX9E] = 1, [CHIP8_OP_EXA1] = 1,
+    [CHIP8_OP_FX0A] = 1
+};
+
+static const char *const timer_names[CHIP8_PROFILE_TIMERS] = {
+    [CHIP8_PROFILE_SPRITE] = "chip8_draw_sprite", [CHIP8_PROFILE_PRESENT] = "draw_framebuffer"
+};
+
+CHIP8PROFILE *chip8_profile_create(void) {
+    CHIP8PROFILE *profile;
+
+    if (!(profile = calloc(1, sizeof(CHIP8PROFILE))))
+        return NULL;
+    profile->branched = 1;
+    return profile;
+}
+
+void chip8_profile_destroy(CHIP8PROFILE *profile) {
+    free(profile);
+}
+
+/**
+ * Counts one instruction of class op at pc, called by the interpreters just before they execute it. An
+ * instruction starts a basic block when it follows a branch or is not at the address after the previous
+ * one, so the block counts say how often each block was entered.
+ */
+void chip8_profile_instruction(CHIP8PROFILE *profile, uint16_t pc, uint8_t op) {
+    pc &= MEMORY_MASK;
+    ++profile->instructions;
+    ++profile->ops[op];
+    ++profile->pcs[pc];
+    profile->pc_ops[pc] = op;
+    if (profile->branched || pc != profile->next_pc)
+        ++profile->blocks[pc];
+    profile->branched = branches[op];
+    profile->next_pc = (pc + 2) & MEMORY_MASK;
+}
+
+uint64_t chip8_profile_clock(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000u + ts.tv_nsec;
+}
+
+// Adds the host time since start, taken with chip8_profile_clock, to one of the timers.
+void chip8_profile_time(CHIP8PROFILE *profile, int timer, uint64_t start) {
+    ++profile->calls[timer];
+    profile->ns[timer] += chip8_profile_clock() - start;
+}
+
+// Picks the indices of the count largest non-zero entries, largest first. Returns how many there were.
+static int top(const uint64_t *counts, int size, int *indices, int count) {
+    int found = 0, i, j;
+
+    for (i = 0; i < size; ++i) {
+        if (!counts[i])
+            continue;
+        for (j = found < count ? found++ : count; j > 0 && counts[indices[j - 1]] < counts[i]; --j) {
+            if (j < count)
+                indices[j] = indices[j - 1];
+        }
+        if (j < count)
+            indices[j] = i;
+    }
+
+    return found;
+}
+
+static double percent(uint64_t part, uint64_t total) {
+    return total ? 100.0 * part / total : 0.0;
+}
+
+static void report_text(const CHIP8PROFILE *profile, FILE *out) {
+    int indices[CHIP8_OP_COUNT > PROFILE_TOP ? CHIP8_OP_COUNT : PROFILE_TOP];
+    int i, n;
+
+    fprintf(out, "Profile:           %llu instructions\n", (unsigned long long) profile->instructions);
+    fprintf(out, "Instruction classes:\n");
+    n = top(profile->ops, CHIP8_OP_COUNT, indices, CHIP8_OP_COUNT);
+    for (i = 0; i < n; ++i) {
+        fprintf(out, "  %-9s %14llu  %5.1f%%\n", op_names[indices[i]],
+                (unsigned long long) profile->ops[indices[i]], percent(profile->ops[indices[i]], profile->instructions));
+    }
+
+    fprintf(out, "Hottest addresses:\n");
+    n = top(profile->pcs, MEMORY_SIZE, indices, PROFILE_TOP);
+    for (i = 0; i < n; ++i) {
+        fprintf(out, "  0x%03x  %-9s %14llu  %5.1f%%\n", indices[i], op_names[profile->pc_ops[indices[i]]],
+                (unsigned long long) profile->pcs[indices[i]], percent(profile->pcs[indices[i]], profile->instructions));
+    }
+
+    fprintf(out, "Most entered basic blocks:\n");
+    n = top(profile->blocks, MEMORY_SIZE, indices, PROFILE_TOP);
+    for (i = 0; i < n; ++i) {
+        fprintf(out, "  0x%03x  %14llu entries\n", indices[i], (unsigned long long) profile->blocks[indices[i]]);
+    }
+
+    fprintf(out, "Host time:\n");
+    for (i = 0; i < CHIP8_PROFILE_TIMERS; ++i) {
+        fprintf(out, "  %-18s %12llu calls  %10.3f ms  %8.0f ns/call\n", timer_names[i],
+                (unsigned long long) profile->calls[i], profile->ns[i] / 1e6,
+                profile->calls[i] ? (double) profile->ns[i] / profile->calls[i] : 0.0);
+    }
+}
+
+static void report_json(const CHIP8PROFILE *profile, FILE *out) {
+    const char *separator = "";
+    int i;
+
+    fprintf(out, "{\n  \"instructions\": %llu,\n  \"ops\": {", (unsigned long long) profile->instructions);
+    for (i = 0; i < CHIP8_OP_COUNT; ++i) {
+        if (!profile->ops[i])
+            continue;
+        fprintf(out, "%s\n    \"%s\": %llu", separator, op_names[i], (unsigned long long) profile->ops[i]);
+        separator = ",";
+    }
+
+    fprintf(out, "\n  },\n  \"pcs\": [");
+    separator = "";
+    for (i = 0; i < MEMORY_SIZE; ++i) {
+        if (!profile->pcs[i])
+            continue;
+        fprintf(out, "%s\n    {\"pc\": %d, \"op\": \"%s\", \"count\": %llu}", separator, i,
+                op_names[profile->pc_ops[i]], (unsigned long long) profile->pcs[i]);
+        separator = ",";
+    }
+
+    fprintf(out, "\n  ],\n  \"blocks\": [");
+    separator = "";
+    for (i = 0; i < MEMORY_SIZE; ++i) {
+        if (!profile->blocks[i])
+            continue;
+        fprintf(out, "%s\n    {\"pc\": %d, \"entries\": %llu}", separator, i, (unsigned long long) profile->blocks[i]);
+        separator = ",";
+    }
+
+    fprintf(out, "\n  ],\n  \"host_time\": {");
+    for (i = 0; i < CHIP8_PROFILE_TIMERS; ++i) {
+        fprintf(out, "%s\n    \"%s\": {\"calls\": %llu, \"ns\": %llu}", i ? "," : "", timer_names[i],
+                (unsigned long long) profile->calls[i], (unsigned long long) profile->ns[i]);
+    }
+    fprintf(out, "\n  }\n}\n");
+}
+
+// Writes the counters as a readable summary of the top entries, or with json set, every non-zero counter
+// as one JSON object.
+void chip8_profile_report(const CHIP8PROFILE *profile, FILE *out, int json) {
+    if (json)
+        report_json(profile, out);
+    else
+        report_text(profile, out);
+}
@@ -0,0 +1,447 @@
+#define _XOPEN_SOURCE 700
+
+#include <dirent.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "chip8.h"
+
+// ROM regression runner. Every .ch8 file in a directory is run headless for a fixed number of instructions,
+// one ROM per task on the work-stealing pool so the ROMs spread over all cores, and at evenly spaced
+// checkpoints the instance's state (framebuffer, registers, stack, timers and memory) is hashed. A ROM with a
+// recording next to it (pong.ch8 and pong.rec, as written with -E) gets its keys pressed and released at the
+// recorded instruction counts, with the recording's quirk profile, speed and random seed. The hashes are
+// compared with a golden manifest, one line per ROM: its name, the instructions between checkpoints and the
+// hash at each checkpoint. A ROM that has a line there is run for exactly that many checkpoints that far
+// apart, whatever -n and -c say, so old manifests stay comparable. -u writes the manifest from this run instead.
+// Every ROM is reported with its throughput and, when it mismatches, where the run diverged. With -T or -J that is
+// the exact instruction, found by running the engine and the interpreter again to the last checkpoint that
+// matched and stepping them side by side; otherwise it is the first checkpoint that differs and the last one that
+// still matched, which bracket it.
+
+#define DEFAULT_INSTRUCTIONS 1000000
+#define DEFAULT_CHECKPOINTS 10
+#define MAX_CHECKPOINTS 4096
+#define MANIFEST_NAME "golden.txt"
+
+enum {
+    RESULT_OK,
+    RESULT_MISMATCH,
+    RESULT_NEW,
+    RESULT_MISSING,
+    RESULT_ERROR
+};
+
+typedef struct {
+    char *name;
+    uint64_t interval;
+    int count;
+    uint64_t *hashes;
+} GOLDEN;
+
+typedef struct {
+    char *name;
+    char path[1024];
+    const GOLDEN *golden;
+    uint64_t interval;
+    int count;
+    uint64_t *hashes;
+    double seconds;
+    int result;
+    int diverged;
+    uint64_t first_difference;
+} REGRESSROM;
+
+static int engine = CHIP8_ENGINE_INTERPRETER;
+static int quirks = CHIP8_QUIRKS_DEFAULT;
+
+static double monotonic_seconds(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static uint64_t fnv(uint64_t hash, const void *data, size_t size) {
+    const uint8_t *bytes = data;
+    size_t i;
+
+    for (i = 0; i < size; ++i) {
+        hash ^= bytes[i];
+        hash *= 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+// Everything a program can observe of the machine, so every engine must arrive at the same hash.
+static uint64_t state_hash(const CHIP8OBJECT *chip8) {
+    uint64_t hash = chip8_framebuffer_hash(chip8);
+
+    hash = fnv(hash, chip8->V, sizeof(chip8->V));
+    hash = fnv(hash, chip8->stack, sizeof(chip8->stack));
+    hash = fnv(hash, &chip8->I, sizeof(chip8->I));
+    hash = fnv(hash, &chip8->program_counter, sizeof(chip8->program_counter));
+    hash = fnv(hash, &chip8->stack_pointer, sizeof(chip8->stack_pointer));
+    hash = fnv(hash, &chip8->delay_timer, sizeof(chip8->delay_timer));
+    hash = fnv(hash, &chip8->sound_timer, sizeof(chip8->sound_timer));
+    return fnv(hash, chip8->mem, sizeof(chip8->mem));
+}
+
+// Runs to instruction target, applying every recorded event that comes before it at its instruction count.
+static void run_to(CHIP8OBJECT *chip8, const CHIP8RECORDING *recording, size_t *next, uint64_t target) {
+    const CHIP8INPUT *event;
+
+    while (recording && *next < recording->count && recording->events[*next].instructions < target) {
+        event = &recording->events[(*next)++];
+        chip8_run(chip8, event->instructions - chip8->instructions);
+        if (event->type == CHIP8_INPUT_RESET)
+            chip8_reset(chip8);
+        else
+            chip8->buttons[event->key] = event->type == CHIP8_INPUT_KEY_DOWN;
+    }
+    chip8_run(chip8, target - chip8->instructions);
+}
+
+// Creates an instance of the ROM as every run of it starts: reset, with the quirk profile, and with the
+// recording next to the ROM, if there is one, loaded into recording. Returns NULL if either fails to load.
+static CHIP8OBJECT *start_rom(const REGRESSROM *rom, int with_engine, CHIP8RECORDING **recording) {
+    CHIP8OBJECT *chip8;
+    char path[1040];
+
+    *recording = NULL;
+    if (!(chip8 = chip8_create()) || chip8_load_rom(chip8, rom->path)) {
+        chip8_destroy(chip8);
+        return NULL;
+    }
+    chip8_reset(chip8);
+    chip8_set_quirks(chip8, quirks);
+    snprintf(path, sizeof(path), "%.*s.rec", (int) (strlen(rom->path) - 4), rom->path);
+    if (!access(path, R_OK)) {
+        if (!(*recording = chip8_recording_read(path)) || (*recording)->start != chip8->instructions) {
+            if (*recording)
+                fprintf(stderr, "Recording does not start at reset: %s\n", path);
+            chip8_recording_destroy(*recording);
+            *recording = NULL;
+            chip8_destroy(chip8);
+            return NULL;
+        }
+        chip8->rng_state = (*recording)->rng_state;
+        chip8_set_quirks(chip8, (*recording)->quirks);
+        chip8_set_frame_instructions(chip8, (*recording)->instructions_per_frame);
+    }
+    chip8_set_engine(chip8, with_engine);
+    return chip8;
+}
+
+/**
+ * Finds the exact instruction a mismatching ROM went wrong at. The engine under test and the interpreter run
+ * again from reset to the last checkpoint that matched, then step one instruction at a time, with the state
+ * hashes compared after each, up to the first checkpoint that differs. The interpreter stands in for the golden
+ * state between checkpoints, so it only counts if it arrives at the manifest's hash there. Returns the number
+ * of instructions run when the states first differ, or 0 if that cannot be told: the engine under test is the
+ * interpreter, the interpreter does not match the manifest either, or stepping does not reproduce the mismatch.
+ */
+static uint64_t find_first_difference(const REGRESSROM *rom) {
+    CHIP8RECORDING *recording = NULL, *reference_recording = NULL;
+    CHIP8OBJECT *chip8 = NULL, *reference = NULL;
+    uint64_t matched = rom->diverged * rom->interval, end = matched + rom->interval, found = 0;
+    size_t next = 0, reference_next = 0;
+
+    if (engine == CHIP8_ENGINE_INTERPRETER || !(chip8 = start_rom(rom, engine, &recording)) ||
+        !(reference = start_rom(rom, CHIP8_ENGINE_INTERPRETER, &reference_recording)))
+        goto done;
+    run_to(chip8, recording, &next, matched);
+    run_to(reference, reference_recording, &reference_next, matched);
+    while (reference->instructions < end) {
+        run_to(chip8, recording, &next, chip8->instructions + 1);
+        run_to(reference, reference_recording, &reference_next, reference->instructions + 1);
+        if (state_hash(chip8) != state_hash(reference)) {
+            found = reference->instructions;
+            break;
+        }
+    }
+    run_to(reference, reference_recording, &reference_next, end);
+    if (state_hash(reference) != rom->golden->hashes[rom->diverged])
+        found = 0;
+
+done:
+    chip8_recording_destroy(recording);
+    chip8_recording_destroy(reference_recording);
+    chip8_destroy(chip8);
+    chip8_destroy(reference);
+    return found;
+}
+
+// Pool task: runs one ROM through all its checkpoints and compares them with its golden hashes, if any.
+static void run_rom(CHIP8POOL *pool, void *arg) {
+    REGRESSROM *rom = arg;
+    CHIP8RECORDING *recording;
+    CHIP8OBJECT *chip8;
+    size_t next = 0;
+    double start;
+    int i;
+
+    rom->result = RESULT_ERROR;
+    if (!(chip8 = start_rom(rom, engine, &recording)))
+        return;
+
+    start = monotonic_seconds();
+    for (i = 0; i < rom->count; ++i) {
+        run_to(chip8, recording, &next, (i + 1) * rom->interval);
+        rom->hashes[i] = state_hash(chip8);
+    }
+    rom->seconds = monotonic_seconds() - start;
+
+    rom->result = rom->golden ? RESULT_OK : RESULT_NEW;
+    for (i = 0; rom->golden && i < rom->count; ++i) {
+        if (rom->hashes[i] != rom->golden->hashes[i]) {
+            rom->result = RESULT_MISMATCH;
+            rom->diverged = i;
+            break;
+        }
+    }
+    if (rom->result == RESULT_MISMATCH)
+        rom->first_difference = find_first_difference(rom);
+
+    chip8_recording_destroy(recording);
+    chip8_destroy(chip8);
+}
+
+// Reads a manifest written by write_manifest. A manifest that does not exist yet is an empty one.
+static GOLDEN *read_manifest(const char *filename, int *count) {
+    static uint64_t hashes[MAX_CHECKPOINTS];
+    GOLDEN *golden = NULL, *grown;
+    char *line = NULL, *name, *token;
+    uint64_t interval;
+    size_t size = 0;
+    FILE *fileptr;
+    int n;
+
+    *count = 0;
+    if (!(fileptr = fopen(filename, "r")))
+        return NULL;
+    while (getline(&line, &size, fileptr) != -1) {
+        if (line[0] == '#' || !(name = strtok(line, " \t\n")))
+            continue;
+        interval = (token = strtok(NULL, " \t\n")) ? strtoull(token, NULL, 10) : 0;
+        for (n = 0; n < MAX_CHECKPOINTS && (token = strtok(NULL, " \t\n")); ++n) {
+            hashes[n] = strtoull(token, NULL, 16);
+        }
+        if (!interval || !n) {
+            fprintf(stderr, "Ignoring malformed manifest line for %s\n", name);
+            continue;
+        }
+        if (!(grown = realloc(golden, (*count + 1) * sizeof(GOLDEN))))
+            break;
+        golden = grown;
+        golden[*count].name = strdup(name);
+        golden[*count].interval = interval;
+        golden[*count].count = n;
+        if (!golden[*count].name || !(golden[*count].hashes = malloc(n * sizeof(uint64_t)))) {
+            free(golden[*count].name);
+            break;
+        }
+        memcpy(golden[*count].hashes, hashes, n * sizeof(uint64_t));
+        ++*count;
+    }
+    free(line);
+    fclose(fileptr);
+    return golden;
+}
+
+static int write_manifest(const char *filename, const REGRESSROM *roms, int count) {
+    FILE *fileptr;
+    int i, j;
+
+    if (!(fileptr = fopen(filename, "w"))) {
+        fprintf(stderr, "Could not create manifest: %s\n", filename);
+        return -1;
+    }
+    fprintf(fileptr, "# chip8-regress golden manifest: ROM, instructions between checkpoints, state hash at each\n");
+    for (i = 0; i < count; ++i) {
+        if (roms[i].result == RESULT_ERROR)
+            continue;
+        fprintf(fileptr, "%s %llu", roms[i].name, (unsigned long long) roms[i].interval);
+        for (j = 0; j < roms[i].count; ++j) {
+            fprintf(fileptr, " %016llx", (unsigned long long) roms[i].hashes[j]);
+        }
+        fputc('\n', fileptr);
+    }
+    return fclose(fileptr) ? -1 : 0;
+}
+
+static int compare_names(const void *a, const void *b) {
+    return strcmp(((const REGRESSROM *) a)->name, ((const REGRESSROM *) b)->name);
+}
+
+// Collects the .ch8 files of directory, sorted by name so reports and manifests come out in a stable order.
+static REGRESSROM *find_roms(const char *directory, int *count) {
+    REGRESSROM *roms = NULL, *grown;
+    struct dirent *entry;
+    DIR *dir;
+    size_t length;
+
+    *count = 0;
+    if (!(dir = opendir(directory))) {
+        fprintf(stderr, "Could not open ROM directory: %s\n", directory);
+        return NULL;
+    }
+    while ((entry = readdir(dir))) {
+        length = strlen(entry->d_name);
+        if (length <= 4 || strcmp(entry->d_name + length - 4, ".ch8"))
+            continue;
+        if (!(grown = realloc(roms, (*count + 1) * sizeof(REGRESSROM))))
+            break;
+        roms = grown;
+        memset(&roms[*count], 0, sizeof(REGRESSROM));
+        roms[*count].name = strdup(entry->d_name);
+        snprintf(roms[*count].path, sizeof(roms[*count].path), "%s/%s", directory, entry->d_name);
+        ++*count;
+    }
+    closedir(dir);
+    if (!*count) {
+        fprintf(stderr, "No .ch8 files in %s\n", directory);
+        return NULL;
+    }
+    qsort(roms, *count, sizeof(REGRESSROM), compare_names);
+    return roms;
+}
+
+int main(int argc, char *argv[]) {
+    static const char *labels[] = {"ok", "MISMATCH", "NEW", "MISSING", "ERROR"};
+    const char *directory = NULL, *manifest = NULL;
+    char manifest_path[1024];
+    REGRESSROM *roms;
+    GOLDEN *golden;
+    CHIP8POOL *pool;
+    uint64_t instructions = DEFAULT_INSTRUCTIONS, total = 0;
+    double start, elapsed;
+    int i, j, rom_count, golden_count, checkpoints = DEFAULT_CHECKPOINTS, threads = 0, update = 0;
+    int tally[RESULT_ERROR + 1] = {0};
+
+    for (i = 1; i < argc; ++i) {
+        if (!strcmp(argv[i], "-n") && i + 1 < argc) {
+            instructions = strtoull(argv[++i], NULL, 0);
+        }
+        else if (!strcmp(argv[i], "-c") && i + 1 < argc) {
+            checkpoints = atoi(argv[++i]);
+        }
+        else if (!strcmp(argv[i], "-j") && i + 1 < argc) {
+            threads = atoi(argv[++i]);
+        }
+        else if (!strcmp(argv[i], "-m") && i + 1 < argc) {
+            manifest = argv[++i];
+        }
+        else if (!strcmp(argv[i], "-q") && i + 1 < argc) {
+            if ((quirks = chip8_find_quirks(argv[++i])) < 0) {
+                directory = NULL;
+                break;
+            }
+        }
+        else if (!strcmp(argv[i], "-I") || !strcmp(argv[i], "-T") || !strcmp(argv[i], "-J")) {
+            engine = argv[i][1] == 'I' ? CHIP8_ENGINE_INTERPRETER :
+                     argv[i][1] == 'T' ? CHIP8_ENGINE_THREADED : CHIP8_ENGINE_JIT;
+        }
+        else if (!strcmp(argv[i], "-u")) {
+            update = 1;
+        }
+        else if (argv[i][0] != '-' && !directory) {
+            directory = argv[i];
+        }
+        else {
+            directory = NULL;
+            break;
+        }
+    }
+    if (!directory || checkpoints < 1 || checkpoints > MAX_CHECKPOINTS || instructions < (uint64_t) checkpoints) {
+        printf("Usage: %s [-n instructions] [-c checkpoints] [-j threads] [-q quirks] [-I|-T|-J] [-m manifest] [-u] "
+               "romdir\n", argv[0]);
+        return 1;
+    }
+    if (!manifest) {
+        snprintf(manifest_path, sizeof(manifest_path), "%s/%s", directory, MANIFEST_NAME);
+        manifest = manifest_path;
+    }
+
+    if (!(roms = find_roms(directory, &rom_count)))
+        return 1;
+    golden = update ? NULL : read_manifest(manifest, &golden_count);
+    if (update)
+        golden_count = 0;
+    for (i = 0; i < rom_count; ++i) {
+        for (j = 0; j < golden_count && strcmp(golden[j].name, roms[i].name); ++j)
+            ;
+        roms[i].golden = j < golden_count ? &golden[j] : NULL;
+        roms[i].interval = roms[i].golden ? roms[i].golden->interval : instructions / checkpoints;
+        roms[i].count = roms[i].golden ? roms[i].golden->count : checkpoints;
+        if (!(roms[i].hashes = malloc(roms[i].count * sizeof(uint64_t))))
+            return 1;
+    }
+    if (!(pool = chip8_pool_create(threads))) {
+        fprintf(stderr, "Could not create thread pool\n");
+        return 1;
+    }
+
+    start = monotonic_seconds();
+    for (i = 0; i < rom_count; ++i) {
+        chip8_pool_submit(pool, run_rom, &roms[i]);
+    }
+    chip8_pool_wait(pool);
+    elapsed = monotonic_seconds() - start;
+    if (elapsed <= 0.0)
+        elapsed = 1e-9;
+
+    for (i = 0; i < rom_count; ++i) {
+        ++tally[roms[i].result];
+        total += roms[i].interval * roms[i].count;
+        printf("%-9s %-24s %12llu instructions", labels[roms[i].result], roms[i].name,
+               (unsigned long long) (roms[i].interval * roms[i].count));
+        if (roms[i].result != RESULT_ERROR && roms[i].seconds > 0)
+            printf("  %8.2f M/s", roms[i].interval * roms[i].count / roms[i].seconds / 1e6);
+        if (roms[i].result == RESULT_MISMATCH && roms[i].first_difference)
+            printf("  first differs after instruction %llu",
+                   (unsigned long long) roms[i].first_difference);
+        else if (roms[i].result == RESULT_MISMATCH)
+            printf("  diverged by %llu, matched at %llu",
+                   (unsigned long long) ((roms[i].diverged + 1) * roms[i].interval),
+                   (unsigned long long) (roms[i].diverged * roms[i].interval));
+        putchar('\n');
+    }
+    for (j = 0; j < golden_count; ++j) {
+        for (i = 0; i < rom_count && strcmp(golden[j].name, roms[i].name); ++i)
+            ;
+        if (i == rom_count) {
+            ++tally[RESULT_MISSING];
+            printf("%-9s %s\n", labels[RESULT_MISSING], golden[j].name);
+        }
+    }
+
+    printf("ROMs:              %d (%d ok, %d mismatched, %d new, %d missing, %d failed to run)\n", rom_count,
+           tally[RESULT_OK], tally[RESULT_MISMATCH], tally[RESULT_NEW], tally[RESULT_MISSING], tally[RESULT_ERROR]);
+    printf("Threads:           %d\n", chip8_pool_threads(pool));
+    printf("Elapsed:           %.6f s\n", elapsed);
+    printf("Instructions/sec:  %.0f\n", total / elapsed);
+    if (update && write_manifest(manifest, roms, rom_count))
+        return 1;
+    if (update)
+        printf("Manifest:          %s written\n", manifest);
+
+    chip8_pool_destroy(pool);
+    for (i = 0; i < rom_count; ++i) {
+        free(roms[i].name);
+        free(roms[i].hashes);
+    }
+    for (j = 0; j < golden_count; ++j) {
+        free(golden[j].name);
+        free(golden[j].hashes);
+    }
+    free(roms);
+    free(golden);
+    if (update)
+        return tally[RESULT_ERROR] != 0;
+    return tally[RESULT_MISMATCH] || tally[RESULT_NEW] || tally[RESULT_MISSING] || tally[RESULT_ERROR];
+}
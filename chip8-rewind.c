@@ -0,0 +1,264 @@
+#define _XOPEN_SOURCE 700
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "chip8.h"
+
+// Worst case of the run-length code for one state: every literal byte plus two length bytes for every
+// three input bytes, with room for the varints of the final token.
+#define ENCODED_MAX (sizeof(CHIP8STATE) * 2 + 16)
+
+// One stored frame. Keyframes are encoded against an all-zero state, deltas against the keyframe at
+// sequence number key.
+typedef struct {
+    size_t offset;
+    uint32_t size;
+    uint64_t key;
+} CHIP8REWINDENTRY;
+
+struct CHIP8REWIND {
+    uint8_t *data;
+    size_t capacity;
+    size_t used;
+    CHIP8REWINDENTRY *entries;
+    size_t max_entries;
+    uint64_t first;
+    uint64_t count;
+    uint32_t interval;
+    uint32_t since_key;
+    uint64_t key_seq;
+    int have_key;
+    CHIP8STATE key;
+    CHIP8STATE cached;
+    uint64_t cached_seq;
+    int have_cached;
+    uint8_t scratch[ENCODED_MAX];
+};
+
+/**
+ * Creates a rewind buffer that keeps as many frames as fit in capacity bytes, storing a full keyframe every
+ * interval frames and in between the XOR of each frame with the last keyframe. Most of a frame's state
+ * (memory, the stack, most rows) matches the keyframe, so the XOR is almost all zeros and run-length
+ * codes to a few dozen bytes.
+ */
+CHIP8REWIND *chip8_rewind_create(size_t capacity, uint32_t interval) {
+    CHIP8REWIND *rewind;
+
+    if (!(rewind = calloc(1, sizeof(CHIP8REWIND))))
+        return NULL;
+    rewind->capacity = capacity;
+    rewind->interval = interval ? interval : 1;
+    rewind->max_entries = capacity / 4 + 1;
+    rewind->data = malloc(capacity);
+    rewind->entries = malloc(rewind->max_entries * sizeof(CHIP8REWINDENTRY));
+    if (!rewind->data || !rewind->entries) {
+        chip8_rewind_destroy(rewind);
+        return NULL;
+    }
+
+    return rewind;
+}
+
+void chip8_rewind_destroy(CHIP8REWIND *rewind) {
+    if (!rewind)
+        return;
+    free(rewind->data);
+    free(rewind->entries);
+    free(rewind);
+}
+
+static uint8_t *put_varint(uint8_t *out, size_t value) {
+    while (value >= 0x80) {
+        *out++ = (uint8_t) (value | 0x80);
+        value >>= 7;
+    }
+    *out++ = (uint8_t) value;
+    return out;
+}
+
+static const uint8_t *get_varint(const uint8_t *in, size_t *value) {
+    int shift = 0;
+
+    *value = 0;
+    do {
+        *value |= (size_t) (*in & 0x7F) << shift;
+        shift += 7;
+    } while (*in++ & 0x80);
+    return in;
+}
+
+// Codes state XOR reference as (zero run, literal run, literal bytes) tokens. A literal run only ends at two
+// zero bytes in a row, since a token costs at least two bytes. Zero runs are skipped eight bytes at a time.
+static size_t encode(const CHIP8STATE *state, const CHIP8STATE *reference, uint8_t *out) {
+    const uint8_t *a = (const uint8_t *) state, *b = (const uint8_t *) reference;
+    uint8_t *p = out;
+    size_t i = 0, n = sizeof(CHIP8STATE), zeros, start;
+    uint64_t x, y;
+
+    while (i < n) {
+        for (start = i; i + 8 <= n; i += 8) {
+            memcpy(&x, a + i, 8);
+            memcpy(&y, b + i, 8);
+            if (x != y)
+                break;
+        }
+        for (; i < n && a[i] == b[i]; ++i) {
+        }
+        zeros = i - start;
+        for (start = i; i < n; ++i) {
+            if (a[i] == b[i] && (i + 1 == n || a[i + 1] == b[i + 1]))
+                break;
+        }
+        p = put_varint(p, zeros);
+        p = put_varint(p, i - start);
+        for (; start < i; ++start) {
+            *p++ = a[start] ^ b[start];
+        }
+    }
+
+    return (size_t) (p - out);
+}
+
+static void decode(const uint8_t *in, size_t size, CHIP8STATE *state) {
+    const uint8_t *end = in + size;
+    uint8_t *p = (uint8_t *) state;
+    size_t zeros, literals;
+
+    while (in < end) {
+        in = get_varint(in, &zeros);
+        in = get_varint(in, &literals);
+        p += zeros;
+        while (literals--) {
+            *p++ ^= *in++;
+        }
+    }
+}
+
+static CHIP8REWINDENTRY *entry(const CHIP8REWIND *rewind, uint64_t seq) {
+    return &rewind->entries[seq % rewind->max_entries];
+}
+
+// Drops the oldest frame, and with it every delta that depended on it if it was a keyframe.
+static void evict_oldest(CHIP8REWIND *rewind) {
+    do {
+        rewind->used -= entry(rewind, rewind->first)->size;
+        ++rewind->first;
+        --rewind->count;
+    } while (rewind->count && entry(rewind, rewind->first)->key != rewind->first);
+}
+
+// Finds room for size bytes after the newest frame, wrapping to the start of the buffer when the end is too
+// short, and evicts the oldest frames that are in the way.
+static size_t make_room(CHIP8REWIND *rewind, size_t size) {
+    CHIP8REWINDENTRY *newest, *oldest;
+    size_t offset = 0;
+
+    if (rewind->count) {
+        newest = entry(rewind, rewind->first + rewind->count - 1);
+        offset = newest->offset + newest->size;
+        if (offset + size > rewind->capacity)
+            offset = 0;
+    }
+    while (rewind->count) {
+        oldest = entry(rewind, rewind->first);
+        if (rewind->count < rewind->max_entries &&
+            (oldest->offset >= offset + size || oldest->offset + oldest->size <= offset))
+            break;
+        evict_oldest(rewind);
+    }
+
+    return offset;
+}
+
+/**
+ * Appends a frame. It is stored as a delta against the current keyframe unless interval frames have passed
+ * since that keyframe, or making room would evict it, in which case the frame becomes the new keyframe.
+ * Returns -1 if a single frame does not fit in the buffer.
+ */
+int chip8_rewind_push(CHIP8REWIND *rewind, const CHIP8STATE *state) {
+    static const CHIP8STATE zero;
+    CHIP8REWINDENTRY *e;
+    size_t size, offset;
+    uint64_t seq;
+    int keyframe = !rewind->have_key || rewind->since_key >= rewind->interval;
+
+    for (;;) {
+        size = encode(state, keyframe ? &zero : &rewind->key, rewind->scratch);
+        if (size > rewind->capacity)
+            return -1;
+        offset = make_room(rewind, size);
+        if (keyframe || (rewind->count && rewind->key_seq >= rewind->first))
+            break;
+        keyframe = 1;
+    }
+
+    seq = rewind->first + rewind->count;
+    e = entry(rewind, seq);
+    e->offset = offset;
+    e->size = (uint32_t) size;
+    memcpy(rewind->data + offset, rewind->scratch, size);
+    ++rewind->count;
+    rewind->used += size;
+
+    if (keyframe) {
+        rewind->key = *state;
+        rewind->key_seq = seq;
+        rewind->have_key = 1;
+        rewind->since_key = 0;
+    }
+    e->key = rewind->key_seq;
+    ++rewind->since_key;
+    return 0;
+}
+
+// Reconstructs the frame age frames back from the newest (0 is the newest). The last keyframe decoded is
+// kept, so walking back through one keyframe's deltas decodes it once.
+int chip8_rewind_get(CHIP8REWIND *rewind, uint64_t age, CHIP8STATE *state) {
+    const CHIP8REWINDENTRY *e, *key;
+    uint64_t seq;
+
+    if (age >= rewind->count)
+        return -1;
+    seq = rewind->first + rewind->count - 1 - age;
+    e = entry(rewind, seq);
+
+    if (!rewind->have_cached || rewind->cached_seq != e->key) {
+        key = entry(rewind, e->key);
+        memset(&rewind->cached, 0, sizeof(CHIP8STATE));
+        decode(rewind->data + key->offset, key->size, &rewind->cached);
+        rewind->cached_seq = e->key;
+        rewind->have_cached = 1;
+    }
+
+    *state = rewind->cached;
+    if (e->key != seq)
+        decode(rewind->data + e->offset, e->size, state);
+    return 0;
+}
+
+// Removes and returns the newest frame. Popping a keyframe makes the next push a keyframe.
+int chip8_rewind_pop(CHIP8REWIND *rewind, CHIP8STATE *state) {
+    uint64_t seq;
+
+    if (chip8_rewind_get(rewind, 0, state))
+        return -1;
+
+    seq = rewind->first + rewind->count - 1;
+    rewind->used -= entry(rewind, seq)->size;
+    --rewind->count;
+    if (seq == rewind->key_seq)
+        rewind->have_key = 0;
+    if (rewind->have_cached && rewind->cached_seq == seq)
+        rewind->have_cached = 0;
+    return 0;
+}
+
+uint64_t chip8_rewind_frames(const CHIP8REWIND *rewind) {
+    return rewind->count;
+}
+
+size_t chip8_rewind_bytes(const CHIP8REWIND *rewind) {
+    return rewind->used;
+}
@@ -0,0 +1,86 @@
+#define _XOPEN_SOURCE 700
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "chip8.h"
+
+// Benchmarks chip8_scale_rows against the per-pixel loop the window used to run (an integer divide per
+// output pixel on one 32-bit word per CHIP-8 pixel, alpha ORed in) at every scale, redrawing all rows
+// of a random frame each time. Both must produce the same image. Exits non-zero if the scaler is not
+// faster at some scale.
+
+static double monotonic_seconds(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void reference_scale(const uint32_t *framebuffer, uint32_t *pixels, int scale) {
+    int i, j, width = 64 * scale;
+
+    for (i = 0; i < 32 * scale; ++i) {
+        for (j = 0; j < width; ++j) {
+            pixels[i * width + j] = framebuffer[(i / scale) * 64 + (j / scale)] | 0xff000000;
+        }
+    }
+}
+
+int main(int argc, char *argv[]) {
+    static uint32_t unpacked[64 * 32];
+    uint64_t packed[32];
+    uint32_t *expected, *actual;
+    const CHIP8PALETTE *classic = chip8_find_palette("classic");
+    double start, reference_ns, scaler_ns;
+    int scale, frames, n, x, y, failed = 0;
+
+    srand(argc > 1 ? atoi(argv[1]) : 1);
+    for (y = 0; y < 32; ++y) {
+        packed[y] = 0;
+        for (x = 0; x < 64; ++x) {
+            unpacked[y * 64 + x] = (rand() & 1) ? 0xffffffff : 0;
+            packed[y] = (packed[y] << 1) | (unpacked[y * 64 + x] ? 1 : 0);
+        }
+    }
+
+    expected = malloc(64 * 32 * CHIP8_SCALE_MAX * CHIP8_SCALE_MAX * sizeof(uint32_t));
+    actual = malloc(64 * 32 * CHIP8_SCALE_MAX * CHIP8_SCALE_MAX * sizeof(uint32_t));
+    if (!expected || !actual) {
+        fprintf(stderr, "Out of memory\n");
+        return 1;
+    }
+
+    printf("scale  reference ns/frame  scaler ns/frame  speedup\n");
+    for (scale = 1; scale <= CHIP8_SCALE_MAX; ++scale) {
+        frames = 200000 / (scale * scale) + 50;
+
+        start = monotonic_seconds();
+        for (n = 0; n < frames; ++n) {
+            reference_scale(unpacked, expected, scale);
+        }
+        reference_ns = (monotonic_seconds() - start) * 1e9 / frames;
+
+        start = monotonic_seconds();
+        for (n = 0; n < frames; ++n) {
+            chip8_scale_rows(packed, 0xffffffff, actual, 64 * scale, scale, classic);
+        }
+        scaler_ns = (monotonic_seconds() - start) * 1e9 / frames;
+
+        if (memcmp(expected, actual, 64 * 32 * scale * scale * sizeof(uint32_t))) {
+            printf("%5d  output differs from the reference\n", scale);
+            failed = 1;
+            continue;
+        }
+        printf("%5d  %18.0f  %15.0f  %6.2fx\n", scale, reference_ns, scaler_ns, reference_ns / scaler_ns);
+        if (scaler_ns >= reference_ns)
+            failed = 1;
+    }
+
+    free(expected);
+    free(actual);
+    return failed;
+}
@@ -0,0 +1,106 @@
+#define _XOPEN_SOURCE 700
+
+#include <stdint.h>
+#include <string.h>
+#include <strings.h>
+
+#if defined(__SSE2__)
+#include <immintrin.h>
+#endif
+
+#include "chip8.h"
+
+// Spare pixels at the end of the line buffer for the overlapping stores in expand_row.
+#define CHIP8_SCALER_SLACK 4
+
+// Colours are 32-bit pixels with the alpha byte already set, so nothing has to be ORed in per pixel.
+static const CHIP8PALETTE palettes[] = {
+    {"classic", 0xffffffff, 0xff000000},
+    {"inverse", 0xff000000, 0xffffffff},
+    {"amber", 0xffffb000, 0xff281800},
+    {"green", 0xff33ff66, 0xff002208},
+    {"lcd", 0xff0f380f, 0xff9bbc0f},
+    {NULL, 0, 0}
+};
+
+const CHIP8PALETTE *chip8_palettes(void) {
+    return palettes;
+}
+
+// Looks a palette up by name, ignoring case. Returns NULL for an unknown name.
+const CHIP8PALETTE *chip8_find_palette(const char *name) {
+    const CHIP8PALETTE *palette;
+
+    for (palette = palettes; palette->name; ++palette) {
+        if (!strcasecmp(palette->name, name))
+            return palette;
+    }
+
+    return NULL;
+}
+
+// Expands one packed row into line, scale pixels per CHIP-8 pixel. At 1x four pixels are selected at a time
+// by turning a nibble of the row into a lane mask. Above that every pixel is a broadcast stored four lanes
+// at a time; the last store of a pixel may run up to three lanes into the next one, which is overwritten
+// right after, so line needs CHIP8_SCALER_SLACK spare pixels at the end.
+static void expand_row(uint64_t row, uint32_t *line, int scale, const CHIP8PALETTE *palette) {
+    uint32_t pixel;
+    int j;
+#if defined(__SSE2__)
+    const __m128i lanes = _mm_set_epi32(1, 2, 4, 8);
+    const __m128i off = _mm_set1_epi32(palette->off);
+    const __m128i flip = _mm_set1_epi32(palette->on ^ palette->off);
+    __m128i mask, fill;
+    int k;
+
+    if (scale == 1) {
+        for (j = 0; j < 64; j += 4) {
+            mask = _mm_and_si128(_mm_set1_epi32((row >> (60 - j)) & 0xF), lanes);
+            mask = _mm_cmpeq_epi32(mask, lanes);
+            _mm_storeu_si128((__m128i *) &line[j], _mm_xor_si128(off, _mm_and_si128(mask, flip)));
+        }
+        return;
+    }
+
+    for (j = 0; j < 64; ++j) {
+        pixel = ((row >> (63 - j)) & 1) ? palette->on : palette->off;
+        fill = _mm_set1_epi32(pixel);
+        for (k = 0; k < scale; k += 4) {
+            _mm_storeu_si128((__m128i *) &line[j * scale + k], fill);
+        }
+    }
+#else
+    uint32_t *out = line;
+    int k;
+
+    for (j = 0; j < 64; ++j) {
+        pixel = ((row >> (63 - j)) & 1) ? palette->on : palette->off;
+        for (k = 0; k < scale; ++k) {
+            *out++ = pixel;
+        }
+    }
+#endif
+}
+
+/**
+ * Scales the rows of framebuffer selected by rows (bit y for row y) into pixels, a 64*scale by 32*scale
+ * image whose lines are pitch pixels apart. Each selected row is expanded once into a line buffer with
+ * expand_row, then copied to the scale lines it covers. Rows that are not selected are left untouched.
+ */
+void chip8_scale_rows(const uint64_t *framebuffer, uint32_t rows, uint32_t *pixels, int pitch, int scale,
+                      const CHIP8PALETTE *palette) {
+    uint32_t line[64 * CHIP8_SCALE_MAX + CHIP8_SCALER_SLACK];
+    size_t width = 64 * scale * sizeof(uint32_t);
+    uint32_t *out;
+    int y, k;
+
+    for (y = 0; y < 32; ++y) {
+        if (!(rows & (1u << y)))
+            continue;
+        expand_row(framebuffer[y], line, scale, palette);
+        out = pixels + (size_t) y * scale * pitch;
+        for (k = 0; k < scale; ++k, out += pitch) {
+            memcpy(out, line, width);
+        }
+    }
+}
@@ -0,0 +1,92 @@
+#define _XOPEN_SOURCE 700
+
+#include <errno.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+
+#include "chip8.h"
+
+#define NSEC_PER_SEC 1000000000ULL
+
+static uint64_t monotonic_ns(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * NSEC_PER_SEC + ts.tv_nsec;
+}
+
+// Starts a schedule of rate frames per second with the first deadline one period from now.
+void chip8_scheduler_init(CHIP8SCHEDULER *scheduler, uint32_t rate) {
+    memset(scheduler, 0, sizeof(CHIP8SCHEDULER));
+    scheduler->period = NSEC_PER_SEC / rate;
+    scheduler->next = monotonic_ns() + scheduler->period;
+    scheduler->min_late = UINT64_MAX;
+}
+
+/**
+ * Sleeps until the next deadline with an absolute clock_nanosleep, so time spent emulating and presenting
+ * is not added on top of the period and the schedule never drifts. Deadlines stay on a fixed grid: when the
+ * host stalled past one or more of them, every missed deadline is returned as a frame to emulate, up to
+ * CHIP8_SCHEDULER_CATCHUP, and the ones beyond that are dropped. Either way the caller runs whole frames,
+ * so what the ROM computes does not depend on how late the host was. Returns the number of frames due.
+ */
+int chip8_scheduler_wait(CHIP8SCHEDULER *scheduler) {
+    struct timespec deadline;
+    uint64_t now, late, due;
+
+    deadline.tv_sec = scheduler->next / NSEC_PER_SEC;
+    deadline.tv_nsec = scheduler->next % NSEC_PER_SEC;
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &deadline, NULL) == EINTR) {
+    }
+
+    now = monotonic_ns();
+    late = now > scheduler->next ? now - scheduler->next : 0;
+    due = 1 + late / scheduler->period;
+    scheduler->next += due * scheduler->period;
+
+    // Wake-up lateness only counts for deadlines the host actually met; a missed one is an overrun.
+    if (due == 1) {
+        scheduler->late_sum += late;
+        scheduler->late_sum_squares += (double) late * late;
+        if (late > scheduler->max_late)
+            scheduler->max_late = late;
+        if (late < scheduler->min_late)
+            scheduler->min_late = late;
+        ++scheduler->on_time;
+    }
+    else {
+        ++scheduler->overruns;
+    }
+
+    if (due > CHIP8_SCHEDULER_CATCHUP) {
+        scheduler->dropped += due - CHIP8_SCHEDULER_CATCHUP;
+        due = CHIP8_SCHEDULER_CATCHUP;
+    }
+    scheduler->caught_up += due - 1;
+    scheduler->frames += due;
+    ++scheduler->wakeups;
+
+    return (int) due;
+}
+
+void chip8_scheduler_report(const CHIP8SCHEDULER *scheduler, FILE *out) {
+    double mean = 0.0, deviation = 0.0;
+
+    if (scheduler->on_time) {
+        mean = scheduler->late_sum / scheduler->on_time;
+        deviation = sqrt(fmax(0.0, scheduler->late_sum_squares / scheduler->on_time - mean * mean));
+    }
+
+    fprintf(out, "Frames emulated:   %llu\n", (unsigned long long) scheduler->frames);
+    fprintf(out, "Wake-ups:          %llu (%llu on time, %llu overruns)\n", (unsigned long long) scheduler->wakeups,
+            (unsigned long long) scheduler->on_time, (unsigned long long) scheduler->overruns);
+    fprintf(out, "Caught up:         %llu frames\n", (unsigned long long) scheduler->caught_up);
+    fprintf(out, "Dropped:           %llu frames\n", (unsigned long long) scheduler->dropped);
+    if (scheduler->on_time) {
+        fprintf(out, "Wake-up jitter:    mean %.1f us, stddev %.1f us, min %.1f us, max %.1f us\n", mean / 1e3,
+                deviation / 1e3, scheduler->min_late / 1e3, scheduler->max_late / 1e3);
+    }
+}
@@ -0,0 +1,117 @@
+#define _XOPEN_SOURCE 700
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "chip8.h"
+
+#define CHIP8_STATE_MAGIC 0x53384843u // "CH8S" read as a little-endian word
+#define CHIP8_STATE_VERSION 1
+
+// Copies everything that determines what the instance does next into state. Plain copies only, so a save is
+// a few hundred nanoseconds.
+void chip8_save_state(const CHIP8OBJECT *chip8, CHIP8STATE *state) {
+    state->magic = CHIP8_STATE_MAGIC;
+    state->version = CHIP8_STATE_VERSION;
+    memcpy(state->V, chip8->V, sizeof(state->V));
+    memcpy(state->stack, chip8->stack, sizeof(state->stack));
+    state->I = chip8->I;
+    state->program_counter = chip8->program_counter;
+    state->stack_pointer = chip8->stack_pointer;
+    state->delay_timer = chip8->delay_timer;
+    state->sound_timer = chip8->sound_timer;
+    state->quirks = chip8->quirks;
+    memset(state->reserved, 0, sizeof(state->reserved));
+    state->rng_state = chip8->rng_state;
+    state->instructions_per_frame = chip8->instructions_per_frame;
+    state->instructions = chip8->instructions;
+    memcpy(state->buttons, chip8->buttons, sizeof(state->buttons));
+    memcpy(state->framebuffer, chip8->framebuffer, sizeof(state->framebuffer));
+    memcpy(state->mem, chip8->mem, sizeof(state->mem));
+}
+
+/**
+ * Puts the instance back into a saved state. Memory is compared eight bytes at a time and only bytes that
+ * differ are written, through chip8_mem_write, so the decode cache and translated code are invalidated just
+ * where the program changed instead of being thrown away. Framebuffer rows that differ are marked dirty
+ * and the sound timer goes through chip8_register_write so the beeper follows. Returns -1 if state is not
+ * a save state of this version.
+ */
+int chip8_load_state(CHIP8OBJECT *chip8, const CHIP8STATE *state) {
+    uint64_t a, b;
+    int i, j;
+
+    if (state->magic != CHIP8_STATE_MAGIC || state->version != CHIP8_STATE_VERSION)
+        return -1;
+
+    for (i = 0; i < MEMORY_SIZE; i += 8) {
+        memcpy(&a, &chip8->mem[i], 8);
+        memcpy(&b, &state->mem[i], 8);
+        if (a == b)
+            continue;
+        for (j = i; j < i + 8; ++j) {
+            if (chip8->mem[j] != state->mem[j])
+                chip8_mem_write(chip8, j, state->mem[j]);
+        }
+    }
+    for (i = 0; i < 32; ++i) {
+        if (chip8->framebuffer[i] != state->framebuffer[i]) {
+            chip8->framebuffer[i] = state->framebuffer[i];
+            chip8->dirty_rows |= 1u << i;
+        }
+    }
+
+    memcpy(chip8->V, state->V, sizeof(chip8->V));
+    memcpy(chip8->stack, state->stack, sizeof(chip8->stack));
+    chip8->I = state->I;
+    chip8->program_counter = state->program_counter;
+    chip8->stack_pointer = state->stack_pointer & STACK_MASK;
+    chip8->rng_state = state->rng_state;
+    chip8_set_quirks(chip8, state->quirks);
+    chip8->instructions_per_frame = state->instructions_per_frame;
+    chip8->instructions = state->instructions;
+    memcpy(chip8->buttons, state->buttons, sizeof(chip8->buttons));
+    chip8->delay_timer = state->delay_timer;
+    chip8_register_write(chip8, CHIP8_REG_SOUND, state->sound_timer);
+    if (chip8->aot && !chip8->aot_valid)
+        chip8_aot_validate(chip8);
+    return 0;
+}
+
+// Save state files are the CHIP8STATE structure as it is in memory, so they are only read back by a
+// build for the same byte order.
+int chip8_write_state(const CHIP8STATE *state, const char *filename) {
+    FILE *fileptr;
+
+    if (!(fileptr = fopen(filename, "wb"))) {
+        fprintf(stderr, "Could not create save state: %s\n", filename);
+        return -1;
+    }
+    if (fwrite(state, sizeof(CHIP8STATE), 1, fileptr) != 1) {
+        fprintf(stderr, "Could not write save state: %s\n", filename);
+        fclose(fileptr);
+        return -1;
+    }
+
+    return fclose(fileptr) ? -1 : 0;
+}
+
+int chip8_read_state(CHIP8STATE *state, const char *filename) {
+    FILE *fileptr;
+
+    if (!(fileptr = fopen(filename, "rb"))) {
+        fprintf(stderr, "Could not open save state: %s\n", filename);
+        return -1;
+    }
+    if (fread(state, sizeof(CHIP8STATE), 1, fileptr) != 1 || state->magic != CHIP8_STATE_MAGIC ||
+        state->version != CHIP8_STATE_VERSION) {
+        fprintf(stderr, "Not a save state of this version: %s\n", filename);
+        fclose(fileptr);
+        return -1;
+    }
+
+    fclose(fileptr);
+    return 0;
+}
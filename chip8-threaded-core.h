@@ -0,0 +1,206 @@
+// One threaded core, compiled once per quirk profile: chip8-threaded.c includes this file with THREADED_RUN
+// set to the function's name and THREADED_QUIRKS to the profile's constant quirk bits, so the quirk tests
+// below fold away and every profile gets a core with no branch it does not need.
+
+/**
+ * Runs count instructions with direct threaded dispatch (GCC labels as values). The decode cache supplies
+ * the instruction class, which indexes a table of label addresses local to this function. The program
+ * counter, I, the stack pointer and the V registers live in locals for the whole run and are written back
+ * once at the end; everything the machine functions read (memory, timers, keys, the stack) stays in the
+ * instance. Timers and the instruction counter are handled here, so chip8_run hands over the whole count;
+ * the counter is only brought up to date mid-run for FX18, which is all that reads it.
+ */
+static void THREADED_RUN(CHIP8OBJECT *chip8, uint64_t count) {
+    static void *const labels[CHIP8_OP_COUNT] = {
+        [CHIP8_OP_UNDECODED] = &&op_undecoded, [CHIP8_OP_UNKNOWN] = &&op_unknown,
+        [CHIP8_OP_00E0] = &&op_00E0, [CHIP8_OP_00EE] = &&op_00EE, [CHIP8_OP_1NNN] = &&op_1NNN,
+        [CHIP8_OP_2NNN] = &&op_2NNN, [CHIP8_OP_3XNN] = &&op_3XNN, [CHIP8_OP_4XNN] = &&op_4XNN,
+        [CHIP8_OP_5XY0] = &&op_5XY0, [CHIP8_OP_6XNN] = &&op_6XNN, [CHIP8_OP_7XNN] = &&op_7XNN,
+        [CHIP8_OP_8XY0] = &&op_8XY0, [CHIP8_OP_8XY1] = &&op_8XY1, [CHIP8_OP_8XY2] = &&op_8XY2,
+        [CHIP8_OP_8XY3] = &&op_8XY3, [CHIP8_OP_8XY4] = &&op_8XY4, [CHIP8_OP_8XY5] = &&op_8XY5,
+        [CHIP8_OP_8XY6] = &&op_8XY6, [CHIP8_OP_8XY7] = &&op_8XY7, [CHIP8_OP_8XYE] = &&op_8XYE,
+        [CHIP8_OP_9XY0] = &&op_9XY0, [CHIP8_OP_ANNN] = &&op_ANNN, [CHIP8_OP_BNNN] = &&op_BNNN,
+        [CHIP8_OP_CXNN] = &&op_CXNN, [CHIP8_OP_DXYN] = &&op_DXYN, [CHIP8_OP_EX9E] = &&op_EX9E,
+        [CHIP8_OP_EXA1] = &&op_EXA1, [CHIP8_OP_FX07] = &&op_FX07, [CHIP8_OP_FX0A] = &&op_FX0A,
+        [CHIP8_OP_FX15] = &&op_FX15, [CHIP8_OP_FX18] = &&op_FX18, [CHIP8_OP_FX1E] = &&op_FX1E,
+        [CHIP8_OP_FX29] = &&op_FX29, [CHIP8_OP_FX33] = &&op_FX33, [CHIP8_OP_FX55] = &&op_FX55,
+        [CHIP8_OP_FX65] = &&op_FX65
+    };
+    const CHIP8DECODED *op;
+    uint8_t V[16];
+    uint16_t pc = chip8->program_counter, I = chip8->I;
+    uint8_t sp = chip8->stack_pointer, i;
+    uint32_t frame = chip8->instructions_per_frame;
+    uint32_t frame_left = frame - chip8->instructions % frame;
+    uint64_t end = chip8->instructions + count;
+
+    if (!count)
+        return;
+    memcpy(V, chip8->V, sizeof(V));
+    DISPATCH();
+
+op_undecoded:
+    op = chip8_decode(chip8, pc - 2);
+    goto *labels[op->op];
+op_unknown:
+    NEXT();
+op_00E0:
+    chip8_clear_frame(chip8);
+    NEXT();
+op_00EE:
+    sp = (sp - 1) & STACK_MASK;
+    pc = chip8->stack[sp];
+    NEXT();
+op_1NNN:
+    pc = op->NNN;
+    NEXT();
+op_2NNN:
+    chip8->stack[sp] = pc;
+    sp = (sp + 1) & STACK_MASK;
+    pc = op->NNN;
+    NEXT();
+op_3XNN:
+    if (VX == op->NN)
+        pc += 2;
+    NEXT();
+op_4XNN:
+    if (VX != op->NN)
+        pc += 2;
+    NEXT();
+op_5XY0:
+    if (VX == VY)
+        pc += 2;
+    NEXT();
+op_6XNN:
+    VX = op->NN;
+    NEXT();
+op_7XNN:
+    VX += op->NN;
+    NEXT();
+op_8XY0:
+    VX = VY;
+    NEXT();
+op_8XY1:
+    VX |= VY;
+    if (THREADED_QUIRKS & CHIP8_QUIRK_VF_RESET)
+        V[0xF] = 0;
+    NEXT();
+op_8XY2:
+    VX &= VY;
+    if (THREADED_QUIRKS & CHIP8_QUIRK_VF_RESET)
+        V[0xF] = 0;
+    NEXT();
+op_8XY3:
+    VX ^= VY;
+    if (THREADED_QUIRKS & CHIP8_QUIRK_VF_RESET)
+        V[0xF] = 0;
+    NEXT();
+// VF is written before VX so that X == F ends up holding the result, as in the handlers.
+op_8XY4:
+    i = VX + VY > 0xFF;
+    V[0xF] = i;
+    VX += VY;
+    NEXT();
+op_8XY5:
+    i = VX >= VY;
+    V[0xF] = i;
+    VX -= VY;
+    NEXT();
+op_8XY6:
+    if (THREADED_QUIRKS & CHIP8_QUIRK_SHIFT_VY)
+        VX = VY;
+    V[0xF] = VX & 0x1;
+    VX >>= 1;
+    NEXT();
+op_8XY7:
+    i = VY >= VX;
+    V[0xF] = i;
+    VX = VY - VX;
+    NEXT();
+op_8XYE:
+    if (THREADED_QUIRKS & CHIP8_QUIRK_SHIFT_VY)
+        VX = VY;
+    V[0xF] = (VX & 0x80) == 0x80;
+    VX <<= 1;
+    NEXT();
+op_9XY0:
+    if (VX != VY)
+        pc += 2;
+    NEXT();
+op_ANNN:
+    I = op->NNN;
+    NEXT();
+op_BNNN:
+    pc = op->NNN + V[THREADED_QUIRKS & CHIP8_QUIRK_JUMP_VX ? op->X : 0x0];
+    NEXT();
+op_CXNN:
+    VX = chip8_random(chip8) & op->NN;
+    NEXT();
+op_DXYN:
+    V[0xF] = chip8_draw_sprite(chip8, I, VX, VY, op->NN & 0xF);
+    NEXT();
+op_EX9E:
+    if (chip8->buttons[VX & 0xF])
+        pc += 2;
+    NEXT();
+op_EXA1:
+    if (!chip8->buttons[VX & 0xF])
+        pc += 2;
+    NEXT();
+op_FX07:
+    VX = chip8->delay_timer;
+    NEXT();
+op_FX0A:
+    pc -= 2;
+    for (i = 0; i < 0x10; i++) {
+        if (chip8->buttons[i]) {
+            VX = chip8->buttons[i];
+            pc += 2;
+            break;
+        }
+    }
+    NEXT();
+op_FX15:
+    chip8->delay_timer = VX;
+    NEXT();
+op_FX18:
+    chip8->instructions = end - count;
+    chip8_register_write(chip8, CHIP8_REG_SOUND, VX);
+    NEXT();
+op_FX1E:
+    I += VX;
+    NEXT();
+op_FX29:
+    I = 5 * (VX & 0xF);
+    NEXT();
+op_FX33:
+    chip8_mem_write(chip8, I, VX / 100);
+    chip8_mem_write(chip8, I + 1, (VX / 10) % 10);
+    chip8_mem_write(chip8, I + 2, VX % 10);
+    NEXT();
+op_FX55:
+    for (i = 0; i <= op->X; i++) {
+        chip8_mem_write(chip8, I + i, V[i]);
+    }
+    if (THREADED_QUIRKS & CHIP8_QUIRK_LOAD_X1)
+        I += op->X + 1;
+    if (THREADED_QUIRKS & CHIP8_QUIRK_LOAD_X)
+        I += op->X;
+    NEXT();
+op_FX65:
+    for (i = 0; i <= op->X; i++) {
+        V[i] = chip8_mem_read(chip8, I + i);
+    }
+    if (THREADED_QUIRKS & CHIP8_QUIRK_LOAD_X1)
+        I += op->X + 1;
+    if (THREADED_QUIRKS & CHIP8_QUIRK_LOAD_X)
+        I += op->X;
+    NEXT();
+
+done:
+    chip8->instructions = end;
+    memcpy(chip8->V, V, sizeof(V));
+    chip8->program_counter = pc;
+    chip8->I = I;
+    chip8->stack_pointer = sp;
+}
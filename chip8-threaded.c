@@ -0,0 +1,98 @@
+#define _XOPEN_SOURCE 700
+
+#include <stdint.h>
+#include <string.h>
+
+#include "chip8.h"
+
+#ifdef CHIP8_HAVE_THREADED
+
+// Moves to the next instruction: counts the one that just finished, ticks the timers on every
+// instructions_per_frame boundary exactly like chip8_run does, then jumps straight to the code for the
+// instruction at the program counter. There is no loop and no call, every handler ends in its own copy
+// of this indirect jump, which gives the branch predictor one history per instruction class.
+#define NEXT()                                                  \
+    do {                                                        \
+        if (!--frame_left) {                                    \
+            chip8_tick_timers(chip8);                           \
+            frame_left = frame;                                 \
+        }                                                       \
+        if (!--count)                                           \
+            goto done;                                          \
+        DISPATCH();                                             \
+    } while (0)
+
+#ifndef CHIP8_PROFILE
+#define DISPATCH()                                              \
+    do {                                                        \
+        op = &chip8->decoded[pc & MEMORY_MASK];                 \
+        pc += 2;                                                \
+        goto *labels[op->op];                                   \
+    } while (0)
+#else
+// Profiling builds decode before dispatch so the hook sees the real instruction class.
+#define DISPATCH()                                              \
+    do {                                                        \
+        op = &chip8->decoded[pc & MEMORY_MASK];                 \
+        if (op->op == CHIP8_OP_UNDECODED)                       \
+            op = chip8_decode(chip8, pc);                       \
+        CHIP8_PROFILE_INSTRUCTION(chip8, pc, op->op);           \
+        pc += 2;                                                \
+        goto *labels[op->op];                                   \
+    } while (0)
+#endif
+
+#define VX V[op->X]
+#define VY V[op->Y]
+
+#define THREADED_RUN threaded_run_default
+#define THREADED_QUIRKS CHIP8_QUIRKS(CHIP8_QUIRKS_DEFAULT)
+#include "chip8-threaded-core.h"
+#undef THREADED_RUN
+#undef THREADED_QUIRKS
+
+#define THREADED_RUN threaded_run_vip
+#define THREADED_QUIRKS CHIP8_QUIRKS(CHIP8_QUIRKS_VIP)
+#include "chip8-threaded-core.h"
+#undef THREADED_RUN
+#undef THREADED_QUIRKS
+
+#define THREADED_RUN threaded_run_chip48
+#define THREADED_QUIRKS CHIP8_QUIRKS(CHIP8_QUIRKS_CHIP48)
+#include "chip8-threaded-core.h"
+#undef THREADED_RUN
+#undef THREADED_QUIRKS
+
+#define THREADED_RUN threaded_run_schip
+#define THREADED_QUIRKS CHIP8_QUIRKS(CHIP8_QUIRKS_SCHIP)
+#include "chip8-threaded-core.h"
+#undef THREADED_RUN
+#undef THREADED_QUIRKS
+
+// Picks the core compiled for the instance's quirk profile; the choice costs one branch per call, not
+// one per instruction.
+void chip8_threaded_run(CHIP8OBJECT *chip8, uint64_t count) {
+    switch (chip8->quirks) {
+        case CHIP8_QUIRKS_VIP:
+            threaded_run_vip(chip8, count);
+            break;
+        case CHIP8_QUIRKS_CHIP48:
+            threaded_run_chip48(chip8, count);
+            break;
+        case CHIP8_QUIRKS_SCHIP:
+            threaded_run_schip(chip8, count);
+            break;
+        default:
+            threaded_run_default(chip8, count);
+            break;
+    }
+}
+
+#else
+
+// Without labels as values the threaded engine is never selected, chip8_set_engine falls back to the
+// interpreter.
+void chip8_threaded_run(CHIP8OBJECT *chip8, uint64_t count) {
+}
+
+#endif
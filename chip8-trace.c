@@ -0,0 +1,83 @@
+#define _XOPEN_SOURCE 700
+
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "chip8.h"
+
+// Creates a ring for the last entries instructions, rounded up to a power of two. Attach it by setting
+// chip8->trace; the instance does not own it.
+CHIP8TRACE *chip8_trace_create(uint32_t entries) {
+    CHIP8TRACE *trace;
+    uint32_t size = 1;
+    void *block;
+
+    while (size < entries && size < 1u << 31) {
+        size <<= 1;
+    }
+    if (posix_memalign(&block, 64, sizeof(CHIP8TRACE) + (size_t) size * sizeof(CHIP8TRACEENTRY)))
+        return NULL;
+    trace = memset(block, 0, sizeof(CHIP8TRACE) + (size_t) size * sizeof(CHIP8TRACEENTRY));
+    trace->mask = size - 1;
+    return trace;
+}
+
+void chip8_trace_destroy(CHIP8TRACE *trace) {
+    free(trace);
+}
+
+static int write_all(int fd, const void *data, size_t size) {
+    const uint8_t *bytes = data;
+    ssize_t written;
+
+    while (size) {
+        if ((written = write(fd, bytes, size)) <= 0)
+            return -1;
+        bytes += written;
+        size -= written;
+    }
+    return 0;
+}
+
+/**
+ * Writes the instance's trace to filename: a CHIP8TRACEHEADER, then the records still in the ring from the
+ * oldest to the newest. Uses nothing but open, write and close, so a crash handler can call it; a record
+ * that was being written when the signal arrived may come out half updated.
+ */
+int chip8_trace_write(const CHIP8OBJECT *chip8, const char *filename) {
+    const CHIP8TRACE *trace = chip8->trace;
+    CHIP8TRACEHEADER header;
+    uint64_t count;
+    uint32_t kept, first;
+    int fd, result;
+
+    if (!trace)
+        return -1;
+    count = trace->count;
+    kept = count > (uint64_t) trace->mask + 1 ? trace->mask + 1 : (uint32_t) count;
+    first = (uint32_t) (count - kept) & trace->mask;
+
+    memset(&header, 0, sizeof(header));
+    header.magic = CHIP8_TRACE_MAGIC;
+    header.version = CHIP8_TRACE_VERSION;
+    header.quirks = chip8->quirks;
+    header.count = count;
+    header.entries = kept;
+    header.entry_size = sizeof(CHIP8TRACEENTRY);
+
+    if ((fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0644)) < 0)
+        return -1;
+    // The oldest record sits at first; past the end of the ring the rest start again at 0.
+    result = write_all(fd, &header, sizeof(header));
+    if (!result && first + kept > trace->mask + 1) {
+        result = write_all(fd, &trace->entries[first], (size_t) (trace->mask + 1 - first) * sizeof(CHIP8TRACEENTRY));
+        kept -= trace->mask + 1 - first;
+        first = 0;
+    }
+    if (!result)
+        result = write_all(fd, &trace->entries[first], (size_t) kept * sizeof(CHIP8TRACEENTRY));
+    return close(fd) || result ? -1 : 0;
+}
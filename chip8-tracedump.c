@@ -0,0 +1,173 @@
+#define _XOPEN_SOURCE 700
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "chip8.h"
+
+// Disassembles an execution trace written by chip8_trace_write (-D in the window). Every record is printed
+// as the number of the instruction counted from the start of the trace, its address and opcode, the
+// instruction in the usual assembler notation, and what it changed: VX and VF for instructions that write
+// them, and I whenever it differs from the record before. -n prints only the last records.
+
+// What an instruction class writes, besides the program counter.
+#define WRITES_VX 1
+#define WRITES_VF 2
+
+// Which operands an instruction's format takes, in order.
+enum {
+    ARGS_NONE,
+    ARGS_RAW,
+    ARGS_NNN,
+    ARGS_X,
+    ARGS_X_NN,
+    ARGS_X_Y,
+    ARGS_X_Y_N
+};
+
+static const struct {
+    const char *format;
+    uint8_t args;
+    uint8_t writes;
+} ops[CHIP8_OP_COUNT] = {
+    [CHIP8_OP_UNKNOWN] = {"DW   #%04X", ARGS_RAW},
+    [CHIP8_OP_00E0] = {"CLS", ARGS_NONE},
+    [CHIP8_OP_00EE] = {"RET", ARGS_NONE},
+    [CHIP8_OP_1NNN] = {"JP   #%03X", ARGS_NNN},
+    [CHIP8_OP_2NNN] = {"CALL #%03X", ARGS_NNN},
+    [CHIP8_OP_3XNN] = {"SE   V%X, #%02X", ARGS_X_NN},
+    [CHIP8_OP_4XNN] = {"SNE  V%X, #%02X", ARGS_X_NN},
+    [CHIP8_OP_5XY0] = {"SE   V%X, V%X", ARGS_X_Y},
+    [CHIP8_OP_6XNN] = {"LD   V%X, #%02X", ARGS_X_NN, WRITES_VX},
+    [CHIP8_OP_7XNN] = {"ADD  V%X, #%02X", ARGS_X_NN, WRITES_VX},
+    [CHIP8_OP_8XY0] = {"LD   V%X, V%X", ARGS_X_Y, WRITES_VX},
+    [CHIP8_OP_8XY1] = {"OR   V%X, V%X", ARGS_X_Y, WRITES_VX | WRITES_VF},
+    [CHIP8_OP_8XY2] = {"AND  V%X, V%X", ARGS_X_Y, WRITES_VX | WRITES_VF},
+    [CHIP8_OP_8XY3] = {"XOR  V%X, V%X", ARGS_X_Y, WRITES_VX | WRITES_VF},
+    [CHIP8_OP_8XY4] = {"ADD  V%X, V%X", ARGS_X_Y, WRITES_VX | WRITES_VF},
+    [CHIP8_OP_8XY5] = {"SUB  V%X, V%X", ARGS_X_Y, WRITES_VX | WRITES_VF},
+    [CHIP8_OP_8XY6] = {"SHR  V%X, V%X", ARGS_X_Y, WRITES_VX | WRITES_VF},
+    [CHIP8_OP_8XY7] = {"SUBN V%X, V%X", ARGS_X_Y, WRITES_VX | WRITES_VF},
+    [CHIP8_OP_8XYE] = {"SHL  V%X, V%X", ARGS_X_Y, WRITES_VX | WRITES_VF},
+    [CHIP8_OP_9XY0] = {"SNE  V%X, V%X", ARGS_X_Y},
+    [CHIP8_OP_ANNN] = {"LD   I, #%03X", ARGS_NNN},
+    [CHIP8_OP_BNNN] = {"JP   V0, #%03X", ARGS_NNN},
+    [CHIP8_OP_CXNN] = {"RND  V%X, #%02X", ARGS_X_NN, WRITES_VX},
+    [CHIP8_OP_DXYN] = {"DRW  V%X, V%X, %X", ARGS_X_Y_N, WRITES_VF},
+    [CHIP8_OP_EX9E] = {"SKP  V%X", ARGS_X},
+    [CHIP8_OP_EXA1] = {"SKNP V%X", ARGS_X},
+    [CHIP8_OP_FX07] = {"LD   V%X, DT", ARGS_X, WRITES_VX},
+    [CHIP8_OP_FX0A] = {"LD   V%X, K", ARGS_X, WRITES_VX},
+    [CHIP8_OP_FX15] = {"LD   DT, V%X", ARGS_X},
+    [CHIP8_OP_FX18] = {"LD   ST, V%X", ARGS_X},
+    [CHIP8_OP_FX1E] = {"ADD  I, V%X", ARGS_X},
+    [CHIP8_OP_FX29] = {"LD   F, V%X", ARGS_X},
+    [CHIP8_OP_FX33] = {"LD   B, V%X", ARGS_X},
+    [CHIP8_OP_FX55] = {"LD   [I], V%X", ARGS_X},
+    [CHIP8_OP_FX65] = {"LD   V%X, [I]", ARGS_X, WRITES_VX}
+};
+
+// The opcode is taken apart with decode_helper and classified with chip8_resolve_op, exactly as the
+// emulator did when it ran it.
+static void disassemble(const CHIP8TRACEENTRY *entry, int quirks, char *text, size_t size, uint8_t *writes) {
+    CHIP8FULLOPCODE opcode;
+    uint8_t op;
+
+    opcode.unmodified = entry->opcode;
+    decode_helper(&opcode);
+    op = chip8_resolve_op(&opcode);
+    if (op == CHIP8_OP_BNNN && (quirks & CHIP8_QUIRK_JUMP_VX))
+        snprintf(text, size, "JP   V%X, #%03X", opcode.X, opcode.NNN);
+    else if (ops[op].args == ARGS_RAW)
+        snprintf(text, size, ops[op].format, opcode.unmodified);
+    else if (ops[op].args == ARGS_NNN)
+        snprintf(text, size, ops[op].format, opcode.NNN);
+    else if (ops[op].args == ARGS_X)
+        snprintf(text, size, ops[op].format, opcode.X);
+    else if (ops[op].args == ARGS_X_NN)
+        snprintf(text, size, ops[op].format, opcode.X, opcode.NN);
+    else if (ops[op].args == ARGS_X_Y)
+        snprintf(text, size, ops[op].format, opcode.X, opcode.Y);
+    else if (ops[op].args == ARGS_X_Y_N)
+        snprintf(text, size, ops[op].format, opcode.X, opcode.Y, opcode.N);
+    else
+        snprintf(text, size, "%s", ops[op].format);
+    *writes = ops[op].writes;
+    // Without the VF reset quirk the logic instructions leave VF alone.
+    if (op >= CHIP8_OP_8XY1 && op <= CHIP8_OP_8XY3 && !(quirks & CHIP8_QUIRK_VF_RESET))
+        *writes &= ~WRITES_VF;
+}
+
+int main(int argc, char *argv[]) {
+    CHIP8TRACEHEADER header;
+    CHIP8TRACEENTRY entry;
+    const char *filename = NULL;
+    uint64_t last = 0, skip = 0, i, number;
+    uint16_t I = 0;
+    uint8_t writes, X;
+    char text[32];
+    FILE *fileptr;
+    int arg, quirks;
+
+    for (arg = 1; arg < argc; ++arg) {
+        if (!strcmp(argv[arg], "-n") && arg + 1 < argc) {
+            last = strtoull(argv[++arg], NULL, 0);
+        }
+        else if (argv[arg][0] != '-' && !filename) {
+            filename = argv[arg];
+        }
+        else {
+            filename = NULL;
+            break;
+        }
+    }
+    if (!filename) {
+        printf("Usage: %s [-n last] tracefile\n", argv[0]);
+        return 1;
+    }
+
+    if (!(fileptr = fopen(filename, "rb"))) {
+        fprintf(stderr, "Could not open trace: %s\n", filename);
+        return 1;
+    }
+    if (fread(&header, sizeof(header), 1, fileptr) != 1 || header.magic != CHIP8_TRACE_MAGIC ||
+        header.version != CHIP8_TRACE_VERSION || header.entry_size != sizeof(CHIP8TRACEENTRY)) {
+        fprintf(stderr, "Not a trace of this version: %s\n", filename);
+        fclose(fileptr);
+        return 1;
+    }
+    quirks = CHIP8_QUIRKS(header.quirks);
+    printf("Trace of %llu instructions, the last %u kept, quirk profile %s\n", (unsigned long long) header.count,
+           header.entries, chip8_quirks_name(header.quirks));
+
+    if (last && last < header.entries)
+        skip = header.entries - last;
+    for (i = 0; i < header.entries; ++i) {
+        if (fread(&entry, sizeof(entry), 1, fileptr) != 1) {
+            fprintf(stderr, "Trace ends early after %llu records\n", (unsigned long long) i);
+            fclose(fileptr);
+            return 1;
+        }
+        number = header.count - header.entries + i;
+        if (i < skip) {
+            I = entry.I;
+            continue;
+        }
+        disassemble(&entry, quirks, text, sizeof(text), &writes);
+        X = (entry.opcode >> 8) & 0xF;
+        printf("%12llu  %03x  %04x  %-18s", (unsigned long long) number, entry.pc, entry.opcode, text);
+        if (writes & WRITES_VX)
+            printf("  V%X=%02x", X, entry.VX);
+        if ((writes & WRITES_VF) && X != 0xF)
+            printf("  VF=%02x", entry.VF);
+        if (entry.I != I || i == skip)
+            printf("  I=%03x", entry.I);
+        putchar('\n');
+        I = entry.I;
+    }
+
+    fclose(fileptr);
+    return 0;
+}
@@ -0,0 +1,120 @@
+#define _XOPEN_SOURCE 700
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "chip8.h"
+
+// Follows a running emulator's frame export (-X NAME) from another process: prints one line per frame with
+// the registers and the same framebuffer hash the headless runs print, optionally draws the screen, and
+// at the end says how many frames were read and how many were overwritten before it got to them. Stops
+// after -n frames, or once no frame has arrived for -t seconds.
+
+#define POLL_NS 1000000
+
+static double monotonic_seconds(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static uint64_t frame_hash(const CHIP8EXPORTFRAME *frame) {
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    int y, b;
+
+    for (y = 0; y < 32; ++y) {
+        for (b = 56; b >= 0; b -= 8) {
+            hash ^= (frame->framebuffer[y] >> b) & 0xff;
+            hash *= 0x100000001b3ULL;
+        }
+    }
+
+    return hash;
+}
+
+static void print_frame(const CHIP8EXPORTFRAME *frame, int draw) {
+    int i, y, x;
+
+    printf("frame %8llu  instructions %10llu  pc %03x  I %03x  sp %2u  dt %3u  st %3u  V",
+           (unsigned long long) frame->frame, (unsigned long long) frame->instructions, frame->program_counter,
+           frame->I, frame->stack_pointer, frame->delay_timer, frame->sound_timer);
+    for (i = 0; i < 16; ++i) {
+        printf(" %02x", frame->V[i]);
+    }
+    printf("  hash %016llx\n", (unsigned long long) frame_hash(frame));
+    if (!draw)
+        return;
+    for (y = 0; y < 32; ++y) {
+        for (x = 63; x >= 0; --x) {
+            putchar(frame->framebuffer[y] >> x & 1 ? '#' : '.');
+        }
+        putchar('\n');
+    }
+}
+
+int main(int argc, char *argv[]) {
+    const struct timespec poll = {0, POLL_NS};
+    const char *name = NULL;
+    CHIP8EXPORT *export;
+    CHIP8EXPORTFRAME frame;
+    uint64_t limit = 0, read = 0, missed = 0, next;
+    double timeout = 2.0, last;
+    int i, draw = 0, result;
+
+    for (i = 1; i < argc; ++i) {
+        if (!strcmp(argv[i], "-n") && i + 1 < argc) {
+            limit = strtoull(argv[++i], NULL, 0);
+        }
+        else if (!strcmp(argv[i], "-t") && i + 1 < argc) {
+            timeout = atof(argv[++i]);
+        }
+        else if (!strcmp(argv[i], "-d")) {
+            draw = 1;
+        }
+        else if (argv[i][0] != '-' && !name) {
+            name = argv[i];
+        }
+        else {
+            name = NULL;
+            break;
+        }
+    }
+    if (!name) {
+        printf("Usage: %s [-n frames] [-t seconds] [-d] /name\n", argv[0]);
+        return 1;
+    }
+    if (!(export = chip8_export_open(name)))
+        return 1;
+
+    printf("Export %s: %s, process %u, %u slots\n", export->name, export->rom, export->pid, export->slots);
+    next = __atomic_load_n(&export->published, __ATOMIC_ACQUIRE);
+    next = next ? next - 1 : 0;
+    last = monotonic_seconds();
+    while (!limit || read < limit) {
+        if ((result = chip8_export_read(export, next, &frame)) > 0) {
+            if (monotonic_seconds() - last > timeout)
+                break;
+            nanosleep(&poll, NULL);
+            continue;
+        }
+        if (result < 0) {
+            // Fell more than a ring behind: skip to the oldest frame still there.
+            ++missed;
+            ++next;
+            continue;
+        }
+        print_frame(&frame, draw);
+        ++read;
+        ++next;
+        last = monotonic_seconds();
+    }
+
+    printf("Frames read:       %llu\n", (unsigned long long) read);
+    printf("Frames missed:     %llu\n", (unsigned long long) missed);
+    chip8_export_close(export);
+    return 0;
+}
@@ -0,0 +1,520 @@
+#ifndef CHIP8_H
+#define CHIP8_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#define CHIP8_REG_DELAY 0x10
+#define CHIP8_REG_SOUND 0x11
+
+#define MEMORY_SIZE 4096
+#define MEMORY_MASK (MEMORY_SIZE - 1)
+#define MEMORY_LINE 64
+#define STACK_MASK 15
+
+// Default speed: 12 instructions per 60 Hz frame, 720 instructions per second.
+#define INSTRUCTIONS_PER_FRAME 12
+#define CHIP8_FRAME_RATE 60
+
+// Struct containing variables relating to the opcode. Used to make extracting the opcode easier.
+typedef struct {
+    uint16_t unmodified;
+    uint8_t high_nibble;
+    uint16_t NNN;
+    uint8_t NN;
+    uint8_t N;
+    uint8_t X;
+    uint8_t Y;
+} CHIP8FULLOPCODE;
+
+// Instruction classes the decoder resolves every opcode to. CHIP8_OP_UNDECODED marks a decode cache
+// entry that has not been decoded yet or was invalidated by a write to the bytes it covers.
+enum {
+    CHIP8_OP_UNDECODED,
+    CHIP8_OP_UNKNOWN,
+    CHIP8_OP_00E0,
+    CHIP8_OP_00EE,
+    CHIP8_OP_1NNN,
+    CHIP8_OP_2NNN,
+    CHIP8_OP_3XNN,
+    CHIP8_OP_4XNN,
+    CHIP8_OP_5XY0,
+    CHIP8_OP_6XNN,
+    CHIP8_OP_7XNN,
+    CHIP8_OP_8XY0,
+    CHIP8_OP_8XY1,
+    CHIP8_OP_8XY2,
+    CHIP8_OP_8XY3,
+    CHIP8_OP_8XY4,
+    CHIP8_OP_8XY5,
+    CHIP8_OP_8XY6,
+    CHIP8_OP_8XY7,
+    CHIP8_OP_8XYE,
+    CHIP8_OP_9XY0,
+    CHIP8_OP_ANNN,
+    CHIP8_OP_BNNN,
+    CHIP8_OP_CXNN,
+    CHIP8_OP_DXYN,
+    CHIP8_OP_EX9E,
+    CHIP8_OP_EXA1,
+    CHIP8_OP_FX07,
+    CHIP8_OP_FX0A,
+    CHIP8_OP_FX15,
+    CHIP8_OP_FX18,
+    CHIP8_OP_FX1E,
+    CHIP8_OP_FX29,
+    CHIP8_OP_FX33,
+    CHIP8_OP_FX55,
+    CHIP8_OP_FX65,
+    CHIP8_OP_COUNT
+};
+
+// Decode cache entry: the instruction at one address, resolved once to its handler with the operands
+// already extracted. N is the low nibble of NN. Invalidating an entry only clears op, so a handler
+// that overwrites its own instruction (FX33, FX55) can still read its operands afterwards.
+typedef struct {
+    uint8_t op;
+    uint8_t X;
+    uint8_t Y;
+    uint8_t NN;
+    uint16_t NNN;
+} CHIP8DECODED;
+
+// Superinstructions: sequences common enough in real ROMs that the decoder marks where they start and the
+// interpreter runs them with one handler. A write to any of the six bytes of a sequence invalidates its
+// decode cache entries and with them the mark, so a modified sequence, or a jump into the middle of one,
+// runs instruction by instruction as before.
+enum {
+    CHIP8_FUSED_NONE,
+    CHIP8_FUSED_LD_LD_DRW, // 6XNN 6YNN DXYN: place and draw a sprite
+    CHIP8_FUSED_LDI_LOAD, // ANNN FX65: load registers from a table
+    CHIP8_FUSED_ADD_SE_JP, // 7XNN 3XNN 1NNN: counted loop
+    CHIP8_FUSED_DT_SE_JP, // FX07 3XNN 1NNN: poll the delay timer
+    CHIP8_FUSED_COUNT
+};
+
+#define CHIP8_FUSED_MAX 3 // most instructions in one sequence
+#define CHIP8_FUSED_BYTES (2 * CHIP8_FUSED_MAX)
+
+// Execution engines an instance can run with. The interpreter always works; the others fall back to it
+// when they are not available on the host.
+enum {
+    CHIP8_ENGINE_INTERPRETER,
+    CHIP8_ENGINE_JIT,
+    CHIP8_ENGINE_THREADED,
+    CHIP8_ENGINE_AOT
+};
+
+// Quirk profiles: the behaviours CHIP-8 implementations disagree on. Every engine is compiled once per
+// profile with its quirks as constants, and an instance picks its profile once, when the ROM is loaded,
+// so no handler tests a quirk at run time. The default profile is how this emulator has always behaved.
+enum {
+    CHIP8_QUIRKS_DEFAULT,
+    CHIP8_QUIRKS_VIP,
+    CHIP8_QUIRKS_CHIP48,
+    CHIP8_QUIRKS_SCHIP,
+    CHIP8_QUIRKS_COUNT
+};
+
+#define CHIP8_QUIRK_VF_RESET 0x01 // 8XY1, 8XY2 and 8XY3 clear VF
+#define CHIP8_QUIRK_SHIFT_VY 0x02 // 8XY6 and 8XYE shift VY into VX instead of shifting VX in place
+#define CHIP8_QUIRK_LOAD_X1 0x04 // FX55 and FX65 leave I at I + X + 1
+#define CHIP8_QUIRK_LOAD_X 0x08 // FX55 and FX65 leave I at I + X
+#define CHIP8_QUIRK_JUMP_VX 0x10 // BXNN jumps to XNN + VX instead of NNN + V0
+
+// The quirk bits of a profile, a constant expression when profile is one.
+#define CHIP8_QUIRKS(profile)                                                                            \
+    ((profile) == CHIP8_QUIRKS_VIP ? CHIP8_QUIRK_VF_RESET | CHIP8_QUIRK_SHIFT_VY | CHIP8_QUIRK_LOAD_X1 : \
+     (profile) == CHIP8_QUIRKS_CHIP48 ? CHIP8_QUIRK_LOAD_X | CHIP8_QUIRK_JUMP_VX :                       \
+     (profile) == CHIP8_QUIRKS_SCHIP ? CHIP8_QUIRK_JUMP_VX : 0)
+
+// The threaded interpreter needs GCC's labels as values (also provided by clang).
+#if defined(__GNUC__)
+#define CHIP8_HAVE_THREADED 1
+#endif
+
+// AVX2 kernels are built into every x86-64 GCC or clang build whatever the compiler flags, each in a
+// function of its own compiled for AVX2, and only called once the host turns out to have it.
+#if defined(__GNUC__) && defined(__x86_64__)
+#define CHIP8_HAVE_AVX2 1
+#define CHIP8_AVX2 __attribute__((target("avx2")))
+#define chip8_host_avx2() __builtin_cpu_supports("avx2")
+#endif
+
+struct CHIP8JIT;
+typedef struct CHIP8AUDIO CHIP8AUDIO;
+typedef struct CHIP8PROFILE CHIP8PROFILE;
+typedef struct CHIP8TRACE CHIP8TRACE;
+
+// One complete CHIP-8 virtual machine. Everything an instance touches lives in here, so any number
+// of them can run side by side in one process, including on different threads. The registers and
+// the rest of the CPU state come first so that the fields used by every instruction share the
+// first cache lines, followed by memory, the framebuffer (one 64-bit word per row, leftmost pixel in
+// the top bit) and the decode cache (one entry per address, since a jump may land on an odd address).
+// fused marks the superinstruction starting at each address, good while the decode cache entries of its
+// instructions are; fused_runs counts how often each kind ran, fused_instructions how many instructions
+// they covered and interpreted how many went through the interpreter.
+// image is memory as the ROM was loaded, font included; mem_dirty has bit n set once a write has made
+// the 64 bytes at n * 64 differ from it, so a reset copies back just those. The stack pointer wraps
+// around the 16 stack entries, so unbalanced calls and returns stay inside the stack.
+typedef struct CHIP8OBJECT {
+    uint8_t V[16];
+    uint16_t stack[16];
+    uint16_t I;
+    uint16_t program_counter;
+    uint8_t stack_pointer;
+    uint8_t delay_timer;
+    uint8_t sound_timer;
+    uint32_t rng_state;
+    uint64_t instructions;
+    uint32_t instructions_per_frame;
+    uint8_t buttons[16];
+    uint8_t engine;
+    uint8_t quirks;
+    uint8_t fast_forward;
+    uint32_t idle_backoff;
+    uint64_t idle_wait;
+    uint32_t dirty_rows;
+    uint64_t mem_dirty;
+    uint16_t image_end;
+    void (*const *handlers)(struct CHIP8OBJECT *chip8, const CHIP8DECODED *op);
+    struct CHIP8JIT *jit;
+    const struct CHIP8AOT *aot;
+    uint8_t aot_valid;
+    CHIP8AUDIO *audio;
+    CHIP8TRACE *trace;
+#ifdef CHIP8_PROFILE
+    CHIP8PROFILE *profile;
+#endif
+    char *romfn;
+    uint8_t mem[MEMORY_SIZE];
+    uint64_t framebuffer[32];
+    CHIP8DECODED decoded[MEMORY_SIZE];
+    uint8_t fused[MEMORY_SIZE];
+    uint64_t fused_runs[CHIP8_FUSED_COUNT];
+    uint64_t fused_instructions;
+    uint64_t interpreted;
+    uint8_t image[MEMORY_SIZE];
+} CHIP8OBJECT;
+
+typedef void (*OpcodeFunctionPtr)(CHIP8OBJECT *chip8, const CHIP8DECODED *op);
+
+// Instance lifetime and execution (chip8-implementation.c).
+CHIP8OBJECT *chip8_create(void);
+void chip8_destroy(CHIP8OBJECT *chip8);
+void chip8_init(CHIP8OBJECT *chip8);
+void chip8_reset(CHIP8OBJECT *chip8);
+void chip8_shutdown(CHIP8OBJECT *chip8);
+void chip8_execute_instruction(CHIP8OBJECT *chip8);
+void chip8_run(CHIP8OBJECT *chip8, uint64_t count);
+int chip8_set_engine(CHIP8OBJECT *chip8, int engine);
+void chip8_set_frame_instructions(CHIP8OBJECT *chip8, uint32_t count);
+void chip8_set_fast_forward(CHIP8OBJECT *chip8, int enable);
+void chip8_set_quirks(CHIP8OBJECT *chip8, int profile);
+int chip8_find_quirks(const char *name);
+const char *chip8_quirks_name(int profile);
+OpcodeFunctionPtr chip8_opcode_handler(const CHIP8OBJECT *chip8, uint8_t op);
+void chip8_seed(CHIP8OBJECT *chip8, uint32_t seed);
+uint8_t chip8_random(CHIP8OBJECT *chip8);
+void decode_helper(CHIP8FULLOPCODE *opcode);
+uint8_t chip8_resolve_op(const CHIP8FULLOPCODE *opcode);
+const CHIP8DECODED *chip8_decode(CHIP8OBJECT *chip8, uint16_t address);
+void chip8_fused_report(const CHIP8OBJECT *chip8, FILE *out);
+
+// Idle-loop fast-forward (chip8-idle.c), called by chip8_run.
+uint64_t chip8_idle_run(CHIP8OBJECT *chip8, uint64_t count);
+
+// Memory, timers, keypad and display of an instance (chip8-machine.c).
+uint8_t chip8_mem_read(CHIP8OBJECT *chip8, uint16_t addr);
+void chip8_mem_write(CHIP8OBJECT *chip8, uint16_t addr, uint8_t val);
+uint8_t chip8_register_read(CHIP8OBJECT *chip8, uint8_t reg);
+void chip8_register_write(CHIP8OBJECT *chip8, uint8_t reg, uint8_t val);
+void chip8_tick_timers(CHIP8OBJECT *chip8);
+void chip8_clear_frame(CHIP8OBJECT *chip8);
+uint32_t chip8_take_dirty_rows(CHIP8OBJECT *chip8);
+void chip8_mem_clear(CHIP8OBJECT *chip8);
+void chip8_invalidate_decoded(CHIP8OBJECT *chip8);
+int chip8_draw_sprite(CHIP8OBJECT *chip8, uint16_t addr, uint8_t x, uint8_t y, uint8_t height);
+int chip8_load_rom(CHIP8OBJECT *chip8, const char *filename);
+int chip8_load_rom_data(CHIP8OBJECT *chip8, const uint8_t *data, size_t size);
+void chip8_mem_reset(CHIP8OBJECT *chip8);
+uint64_t chip8_framebuffer_hash(const CHIP8OBJECT *chip8);
+
+// x86-64 basic block recompiler (chip8-jit.c). chip8_jit_create returns -1 where it is not supported.
+int chip8_jit_create(CHIP8OBJECT *chip8);
+void chip8_jit_destroy(CHIP8OBJECT *chip8);
+void chip8_jit_run(CHIP8OBJECT *chip8, uint32_t count);
+void chip8_jit_invalidate(CHIP8OBJECT *chip8, uint16_t address);
+void chip8_jit_flush(CHIP8OBJECT *chip8);
+
+// Ahead-of-time compiled ROMs (chip8-aot.c). chip8-aotc translates a ROM into a C file that defines one of
+// these and registers it at start up; chip8_set_engine picks the registered translation of whatever ROM
+// the instance has loaded. image is the memory the ROM was translated from and code marks, one bit per
+// byte, which of its bytes were translated. run executes up to budget instructions and returns how many
+// are left; it stops early where the translation does not reach.
+typedef struct CHIP8AOT {
+    const char *name;
+    uint8_t quirks;
+    const uint8_t *image;
+    const uint8_t *code;
+    uint64_t (*run)(CHIP8OBJECT *chip8, uint64_t budget);
+} CHIP8AOT;
+
+void chip8_aot_register(const CHIP8AOT *aot);
+const CHIP8AOT *chip8_aot_find(const CHIP8OBJECT *chip8);
+void chip8_aot_validate(CHIP8OBJECT *chip8);
+void chip8_aot_run(CHIP8OBJECT *chip8, uint32_t count);
+
+// Framebuffer scaler (chip8-scaler.c). Scales are whole numbers from 1 to CHIP8_SCALE_MAX; the palette list
+// ends with an entry whose name is NULL.
+#define CHIP8_SCALE_MAX 20
+
+typedef struct {
+    const char *name;
+    uint32_t on;
+    uint32_t off;
+} CHIP8PALETTE;
+
+const CHIP8PALETTE *chip8_palettes(void);
+const CHIP8PALETTE *chip8_find_palette(const char *name);
+void chip8_scale_rows(const uint64_t *framebuffer, uint32_t rows, uint32_t *pixels, int pitch, int scale,
+                      const CHIP8PALETTE *palette);
+
+// Save states (chip8-state.c). Everything that decides what an instance does next, laid out without padding.
+typedef struct {
+    uint32_t magic;
+    uint16_t version;
+    uint16_t I;
+    uint16_t program_counter;
+    uint16_t stack[16];
+    uint8_t V[16];
+    uint8_t stack_pointer;
+    uint8_t delay_timer;
+    uint8_t sound_timer;
+    uint8_t quirks;
+    uint8_t reserved[2];
+    uint32_t rng_state;
+    uint32_t instructions_per_frame;
+    uint64_t instructions;
+    uint8_t buttons[16];
+    uint64_t framebuffer[32];
+    uint8_t mem[MEMORY_SIZE];
+} CHIP8STATE;
+
+void chip8_save_state(const CHIP8OBJECT *chip8, CHIP8STATE *state);
+int chip8_load_state(CHIP8OBJECT *chip8, const CHIP8STATE *state);
+int chip8_write_state(const CHIP8STATE *state, const char *filename);
+int chip8_read_state(CHIP8STATE *state, const char *filename);
+
+// Rewind history of save states, XOR/run-length coded against periodic keyframes (chip8-rewind.c).
+typedef struct CHIP8REWIND CHIP8REWIND;
+
+CHIP8REWIND *chip8_rewind_create(size_t capacity, uint32_t interval);
+void chip8_rewind_destroy(CHIP8REWIND *rewind);
+int chip8_rewind_push(CHIP8REWIND *rewind, const CHIP8STATE *state);
+int chip8_rewind_get(CHIP8REWIND *rewind, uint64_t age, CHIP8STATE *state);
+int chip8_rewind_pop(CHIP8REWIND *rewind, CHIP8STATE *state);
+uint64_t chip8_rewind_frames(const CHIP8REWIND *rewind);
+size_t chip8_rewind_bytes(const CHIP8REWIND *rewind);
+
+// Input recording (chip8-input.c). Key transitions and resets stamped with the number of instructions run
+// before them, so playing them back reproduces a session exactly.
+enum {
+    CHIP8_INPUT_KEY_UP,
+    CHIP8_INPUT_KEY_DOWN,
+    CHIP8_INPUT_RESET
+};
+
+typedef struct {
+    uint64_t instructions;
+    uint8_t type;
+    uint8_t key;
+} CHIP8INPUT;
+
+typedef struct {
+    uint32_t instructions_per_frame;
+    uint32_t rng_state;
+    uint8_t quirks;
+    uint64_t start;
+    uint64_t end;
+    uint64_t hash;
+    CHIP8INPUT *events;
+    size_t count;
+    size_t capacity;
+} CHIP8RECORDING;
+
+CHIP8RECORDING *chip8_recording_create(const CHIP8OBJECT *chip8);
+void chip8_recording_destroy(CHIP8RECORDING *recording);
+int chip8_record_key(CHIP8RECORDING *recording, CHIP8OBJECT *chip8, uint8_t key, int pressed);
+int chip8_record_reset(CHIP8RECORDING *recording, CHIP8OBJECT *chip8);
+void chip8_recording_truncate(CHIP8RECORDING *recording, uint64_t instructions);
+int chip8_recording_write(CHIP8RECORDING *recording, const CHIP8OBJECT *chip8, const char *filename);
+CHIP8RECORDING *chip8_recording_read(const char *filename);
+int chip8_replay(CHIP8OBJECT *chip8, const CHIP8RECORDING *recording);
+
+// Profiling counters (chip8-profile.c), only built with -DCHIP8_PROFILE. Without it the hooks expand to
+// nothing and the instance has no profile, so the dispatch paths are the same code as before.
+enum {
+    CHIP8_PROFILE_SPRITE,
+    CHIP8_PROFILE_PRESENT,
+    CHIP8_PROFILE_TIMERS
+};
+
+#ifdef CHIP8_PROFILE
+#define CHIP8_PROFILE_INSTRUCTION(chip8, pc, op) chip8_profile_instruction((chip8)->profile, (pc), (op))
+#else
+#define CHIP8_PROFILE_INSTRUCTION(chip8, pc, op) ((void) 0)
+#endif
+
+CHIP8PROFILE *chip8_profile_create(void);
+void chip8_profile_destroy(CHIP8PROFILE *profile);
+void chip8_profile_instruction(CHIP8PROFILE *profile, uint16_t pc, uint8_t op);
+uint64_t chip8_profile_clock(void);
+void chip8_profile_time(CHIP8PROFILE *profile, int timer, uint64_t start);
+void chip8_profile_report(const CHIP8PROFILE *profile, FILE *out, int json);
+
+// Execution trace (chip8-trace.c). While an instance has a trace, chip8_run executes on the interpreter
+// and chip8_execute_instruction adds one record per instruction to the trace's ring, overwriting the oldest:
+// the address, the raw opcode, and VX, VF and I as the instruction left them. chip8_trace_write dumps an
+// instance's ring oldest first behind a header, for chip8-tracedump to disassemble; it only makes system
+// calls, so it can be called from a signal handler.
+#define CHIP8_TRACE_MAGIC 0x54384843u // "CH8T" read as a little-endian word
+#define CHIP8_TRACE_VERSION 1
+
+typedef struct {
+    uint16_t pc;
+    uint16_t opcode;
+    uint16_t I;
+    uint8_t VX;
+    uint8_t VF;
+} CHIP8TRACEENTRY;
+
+struct CHIP8TRACE {
+    uint64_t count;
+    uint32_t mask;
+    CHIP8TRACEENTRY entries[];
+};
+
+typedef struct {
+    uint32_t magic;
+    uint16_t version;
+    uint8_t quirks;
+    uint8_t reserved;
+    uint64_t count;
+    uint32_t entries;
+    uint32_t entry_size;
+} CHIP8TRACEHEADER;
+
+CHIP8TRACE *chip8_trace_create(uint32_t entries);
+void chip8_trace_destroy(CHIP8TRACE *trace);
+int chip8_trace_write(const CHIP8OBJECT *chip8, const char *filename);
+
+// Beeper (chip8-audio.c). The emulation thread reports FX18 and its progress, the audio thread renders.
+CHIP8AUDIO *chip8_audio_create(uint32_t rate, uint32_t buffer, uint32_t frequency, int16_t amplitude);
+void chip8_audio_destroy(CHIP8AUDIO *audio);
+void chip8_audio_sound(CHIP8AUDIO *audio, uint64_t instructions, uint32_t frame, uint8_t value);
+void chip8_audio_sync(CHIP8AUDIO *audio, uint64_t instructions, uint32_t frame);
+void chip8_audio_render(CHIP8AUDIO *audio, int16_t *out, uint32_t count);
+
+// Real-time frame pacing (chip8-scheduler.c). At most CHIP8_SCHEDULER_CATCHUP frames are run back to back
+// to catch up after a stall; later deadlines are dropped.
+#define CHIP8_SCHEDULER_CATCHUP 5
+
+typedef struct {
+    uint64_t period;
+    uint64_t next;
+    uint64_t frames;
+    uint64_t wakeups;
+    uint64_t on_time;
+    uint64_t overruns;
+    uint64_t caught_up;
+    uint64_t dropped;
+    uint64_t min_late;
+    uint64_t max_late;
+    double late_sum;
+    double late_sum_squares;
+} CHIP8SCHEDULER;
+
+void chip8_scheduler_init(CHIP8SCHEDULER *scheduler, uint32_t rate);
+int chip8_scheduler_wait(CHIP8SCHEDULER *scheduler);
+void chip8_scheduler_report(const CHIP8SCHEDULER *scheduler, FILE *out);
+
+// Lock-free triple buffer handing finished frames from the emulation thread to the presentation thread
+// (chip8-frames.c). One writer and one reader; neither ever waits for the other.
+typedef struct CHIP8FRAMES CHIP8FRAMES;
+
+CHIP8FRAMES *chip8_frames_create(void);
+void chip8_frames_destroy(CHIP8FRAMES *frames);
+void chip8_frames_publish(CHIP8FRAMES *frames, const uint64_t *framebuffer, uint32_t dirty);
+const uint64_t *chip8_frames_take(CHIP8FRAMES *frames, uint32_t *dirty);
+
+// Frame export to other processes through POSIX shared memory (chip8-export.c). The region is a header
+// followed by a ring of CHIP8_EXPORT_SLOTS frames, each guarded by its own sequence counter: odd while the
+// emulator writes the slot, bumped to the next even value when it is done. Like save states it is laid
+// out without padding in host byte order, so readers just map it.
+#define CHIP8_EXPORT_MAGIC 0x58384843u // "CH8X" read as a little-endian word
+#define CHIP8_EXPORT_VERSION 1
+#define CHIP8_EXPORT_SLOTS 16
+
+typedef struct {
+    uint32_t sequence;
+    uint32_t instructions_per_frame;
+    uint64_t frame;
+    uint64_t instructions;
+    uint64_t time_ns;
+    uint16_t I;
+    uint16_t program_counter;
+    uint16_t stack[16];
+    uint8_t V[16];
+    uint8_t stack_pointer;
+    uint8_t delay_timer;
+    uint8_t sound_timer;
+    uint8_t buttons[16];
+    uint8_t reserved[25];
+    uint64_t framebuffer[32];
+} __attribute__((aligned(64))) CHIP8EXPORTFRAME;
+
+typedef struct {
+    uint32_t magic;
+    uint16_t version;
+    uint16_t slots;
+    uint32_t frame_size;
+    uint32_t pid;
+    uint64_t published;
+    char name[64];
+    char rom[104];
+    CHIP8EXPORTFRAME frames[CHIP8_EXPORT_SLOTS];
+} CHIP8EXPORT;
+
+CHIP8EXPORT *chip8_export_create(const char *name, const CHIP8OBJECT *chip8);
+void chip8_export_destroy(CHIP8EXPORT *export);
+void chip8_export_publish(CHIP8EXPORT *export, const CHIP8OBJECT *chip8);
+CHIP8EXPORT *chip8_export_open(const char *name);
+void chip8_export_close(CHIP8EXPORT *export);
+int chip8_export_read(const CHIP8EXPORT *export, uint64_t index, CHIP8EXPORTFRAME *frame);
+
+// Threaded interpreter (chip8-threaded.c). Runs count instructions including the timer ticks.
+void chip8_threaded_run(CHIP8OBJECT *chip8, uint64_t count);
+
+// Work-stealing thread pool used to run many instances at once (chip8-pool.c).
+typedef struct CHIP8POOL CHIP8POOL;
+typedef void (*CHIP8TaskFn)(CHIP8POOL *pool, void *arg);
+
+CHIP8POOL *chip8_pool_create(int threads);
+void chip8_pool_destroy(CHIP8POOL *pool);
+int chip8_pool_threads(const CHIP8POOL *pool);
+void chip8_pool_submit(CHIP8POOL *pool, CHIP8TaskFn fn, void *arg);
+void chip8_pool_wait(CHIP8POOL *pool);
+void chip8_pool_run(CHIP8POOL *pool, CHIP8OBJECT **vms, int count, uint64_t instructions);
+
+// Lockstep batch core (chip8-lockstep.c): many instances of one ROM, differing in seed or input, run as one
+// group with their registers laid out one row per register, peeling off where they go their own way.
+typedef struct CHIP8LOCKSTEP CHIP8LOCKSTEP;
+
+CHIP8LOCKSTEP *chip8_lockstep_create(CHIP8OBJECT **vms, int count);
+void chip8_lockstep_destroy(CHIP8LOCKSTEP *ls);
+void chip8_lockstep_run(CHIP8LOCKSTEP *ls, uint64_t count);
+void chip8_lockstep_counts(const CHIP8LOCKSTEP *ls, uint64_t *lockstep, uint64_t *separate);
+
+#endif
@@ -1,29 +1,21 @@
+#define _XOPEN_SOURCE 700
+
+#include <pthread.h>
+#include <signal.h>
 #include <stdio.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
-
-#define _USE_MATH_DEFINES
-#include <math.h>
+#include <time.h>
 
 #include <SDL/SDL.h>
 
-void chip8_init(void);
-void chip8_reset(void);
-void chip8_shutdown(void);
-void chip8_execute_instruction(void);
-
-uint8_t chip8_mem_read(uint16_t address);
-void chip8_mem_write(uint16_t address, uint8_t value);
-uint8_t chip8_register_read(uint8_t regis);
-void chip8_register_write(uint8_t regis, uint8_t value);
-void chip8_clear_frame(void);
-void chip8_mem_clear(void);
-int chip8_draw_sprite(uint16_t address, uint8_t x, uint8_t y, uint8_t height);
-void chip8_mem_reset(void);
+#include "chip8.h"
 
-#define CHIP8_REG_DELAY 0x10
-#define CHIP8_REG_SOUND 0x11
+// Engine used when none is given on the command line, e.g. make DEFINES=-DCHIP8_DEFAULT_ENGINE=CHIP8_ENGINE_THREADED
+#ifndef CHIP8_DEFAULT_ENGINE
+#define CHIP8_DEFAULT_ENGINE CHIP8_ENGINE_INTERPRETER
+#endif
 
 #define BEEP_FREQUENCY 400 // Sine wave frequency, changes tone
 #define BEEP_AMPLITUDE 25000 // Sine wave amplitude, changes volume, < 32767
@@ -36,264 +28,608 @@ static const uint8_t keymap_cosmac[16] = {
     0x0a, 0x00, 0x0b, 0x0f
 };
 
-#define PIXEL_SET 0xffffffff
-#define MEMORY_SIZE 4096
-#define MEMORY_MASK (MEMORY_SIZE - 1)
-
-static uint8_t mem[MEMORY_SIZE];
-static uint32_t framebuffer[64 * 32];
-static uint8_t buttons[16];
-static uint8_t delay_timer, sound_timer;
 static uint8_t keymap[16];
-static char *romfn;
-
-static SDL_Surface *screen, *frame_buffer_surface;
-
-static const uint8_t font[80] = {
-    0xF0, 0x90, 0x90, 0x90, 0xF0,
-    0x20, 0x60, 0x20, 0x20, 0x70,
-    0xF0, 0x10, 0xF0, 0x80, 0xF0,
-    0xF0, 0x10, 0xF0, 0x10, 0xF0,
-    0x90, 0x90, 0xF0, 0x10, 0x10,
-    0xF0, 0x80, 0xF0, 0x10, 0xF0,
-    0xF0, 0x80, 0xF0, 0x90, 0xF0,
-    0xF0, 0x10, 0x20, 0x40, 0x40,
-    0xF0, 0x90, 0xF0, 0x90, 0xF0,
-    0xF0, 0x90, 0xF0, 0x10, 0xF0,
-    0xF0, 0x90, 0xF0, 0x90, 0x90,
-    0xE0, 0x90, 0xE0, 0x90, 0xE0,
-    0xF0, 0x80, 0x80, 0x80, 0xF0,
-    0xE0, 0x90, 0x90, 0x90, 0xE0,
-    0xF0, 0x80, 0xF0, 0x80, 0xF0,
-    0xF0, 0x80, 0xF0, 0x80, 0x80
-};
+static CHIP8OBJECT *vm;
 
-uint8_t chip8_mem_read(uint16_t address) {
-    return mem[address & MEMORY_MASK];
-}
+static SDL_Surface *screen;
 
-void chip8_mem_write(uint16_t address, uint8_t value) {
-    mem[address & MEMORY_MASK] = value;
-}
+static int scale = 10;
+static const CHIP8PALETTE *palette;
 
-uint8_t chip8_register_read(uint8_t regis) {
-    if (regis < CHIP8_REG_DELAY)
-        return buttons[regis];
-    else if (regis == CHIP8_REG_DELAY)
-        return delay_timer;
-    else if (regis == CHIP8_REG_SOUND)
-        return sound_timer;
+// Window rewind: one state per frame while Backspace is up, popped one per frame while it is held.
+#define REWIND_BYTES (4 << 20)
+#define REWIND_KEYFRAME_INTERVAL 60
 
-    return 0;
+static CHIP8REWIND *history;
+static CHIP8STATE state;
+
+// Key presses and resets are logged here while -E is given.
+static CHIP8RECORDING *recording;
+
+// Every frame is published here for other processes while -X is given.
+static CHIP8EXPORT *export;
+
+// With -D the instance keeps an execution trace, written to trace_file at exit, when the emulator crashes,
+// and in the window whenever F12 is pressed or SIGUSR1 arrives (counted in trace_requests and written by
+// the emulation thread between frames).
+#define TRACE_ENTRIES (1u << 16)
+
+static const char *trace_file;
+static uint32_t trace_requests;
+
+// The window runs on two threads: the emulation thread owns the instance and publishes every frame that
+// drew something into frames, the main thread handles SDL events and presents the newest frame. Input goes
+// the other way through atomics the main thread writes and the emulation thread reads once per wake-up:
+// the keys held as a bit mask, how many resets were asked for, whether Backspace is held, and whether to
+// keep running. The instance's buttons[] are only ever written by the emulation thread.
+static CHIP8FRAMES *frames;
+static uint32_t held_keys;
+static uint32_t reset_requests;
+static int rewinding;
+static int running = 1;
+
+// Turbo runs turbo_rate frames per real-time frame, or with a rate of 0 as many as fit before the next
+// deadline; Tab turns it on and off. Presenting stays at the normal rate either way.
+#define TURBO_BATCH 16
+#define TURBO_MARGIN_NS 2000000
+
+static int turbo;
+static uint32_t turbo_rate;
+static uint64_t turbo_frames;
+
+// Scales the rows that changed since the last presented frame into the window and pushes only those rows
+// to the screen.
+static void draw_framebuffer(const uint64_t *framebuffer, uint32_t dirty) {
+    SDL_Rect rects[16];
+    int y, count = 0;
+
+#ifdef CHIP8_PROFILE
+    uint64_t start = chip8_profile_clock();
+#endif
+
+    SDL_LockSurface(screen);
+    chip8_scale_rows(framebuffer, dirty, (uint32_t *) screen->pixels, screen->pitch / 4, scale, palette);
+    SDL_UnlockSurface(screen);
+
+    // Adjacent dirty rows share one rectangle; at most 16 runs fit in 32 rows.
+    for (y = 0; y < 32; ++y) {
+        if (!(dirty & (1u << y)))
+            continue;
+        if (y && (dirty & (1u << (y - 1)))) {
+            rects[count - 1].h += scale;
+        }
+        else {
+            rects[count].x = 0;
+            rects[count].y = y * scale;
+            rects[count].w = 64 * scale;
+            rects[count].h = scale;
+            ++count;
+        }
+    }
+    SDL_UpdateRects(screen, count, rects);
+#ifdef CHIP8_PROFILE
+    chip8_profile_time(vm->profile, CHIP8_PROFILE_PRESENT, start);
+#endif
 }
 
-void chip8_register_write(uint8_t regis, uint8_t value) {
-    if (regis == CHIP8_REG_DELAY)
-        delay_timer = value;
-    else if (regis == CHIP8_REG_SOUND)
-        sound_timer = value;
+// Applies the input the main thread posted since the last call. Keys only change here, between frames,
+// and go through chip8_record_key so a recording stamps them with the instruction count they took
+// effect at.
+static void apply_input(void) {
+    static uint32_t resets;
+    uint32_t keys = __atomic_load_n(&held_keys, __ATOMIC_ACQUIRE);
+    uint32_t requested = __atomic_load_n(&reset_requests, __ATOMIC_ACQUIRE);
+    int i;
+
+    if (resets != requested) {
+        chip8_record_reset(recording, vm);
+        resets = requested;
+    }
+    for (i = 0; i < 16; ++i) {
+        chip8_record_key(recording, vm, (uint8_t) i, keys >> i & 1);
+    }
 }
 
-void chip8_clear_frame(void) {
-    memset(framebuffer, 0, 64 * 32 * sizeof(uint32_t));
+static double monotonic_seconds(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
 }
 
-void chip8_mem_clear(void) {
-    memset(framebuffer, 0, MEMORY_SIZE);
+// Runs count frames at the configured instructions per frame with one timer tick each. With rewind on
+// every frame is recorded.
+static void run_frames(uint64_t count) {
+    if (!history) {
+        chip8_run(vm, count * vm->instructions_per_frame);
+        return;
+    }
+    while (count--) {
+        chip8_run(vm, vm->instructions_per_frame);
+        chip8_save_state(vm, &state);
+        chip8_rewind_push(history, &state);
+    }
 }
 
-int chip8_draw_sprite(uint16_t address, uint8_t x, uint8_t y, uint8_t height) {
-    uint8_t i, j, bits;
-    int collision = 0;
-    int ptr;
+// Runs the frames the scheduler says are due, and in turbo as many more as the rate asks for, then
+// publishes the result once if anything was drawn: frames run in between are never presented. Timers
+// tick every frame's worth of instructions as always, so in turbo they run fast along with everything
+// else. While Backspace is held the due frames are taken back off the history instead.
+static void chip8_frame(CHIP8SCHEDULER *scheduler) {
+    static uint32_t traces;
+    int due = chip8_scheduler_wait(scheduler);
+    double deadline;
+    uint32_t dirty, requested;
+
+    apply_input();
+    if (vm->trace && traces != (requested = __atomic_load_n(&trace_requests, __ATOMIC_ACQUIRE))) {
+        if (chip8_trace_write(vm, trace_file))
+            fprintf(stderr, "Could not write trace: %s\n", trace_file);
+        traces = requested;
+    }
+    if (history && __atomic_load_n(&rewinding, __ATOMIC_RELAXED)) {
+        while (due-- && !chip8_rewind_pop(history, &state)) {
+            chip8_load_state(vm, &state);
+            if (recording)
+                chip8_recording_truncate(recording, vm->instructions);
+        }
+    }
+    else if (!__atomic_load_n(&turbo, __ATOMIC_RELAXED)) {
+        run_frames((uint64_t) due);
+    }
+    else if (turbo_rate) {
+        run_frames((uint64_t) due * turbo_rate);
+        turbo_frames += (uint64_t) due * (turbo_rate - 1);
+    }
+    else {
+        // Unbounded: batches of frames until just before the next deadline, so the wake-up stays on time.
+        deadline = (scheduler->next - TURBO_MARGIN_NS) / 1e9;
+        do {
+            run_frames(TURBO_BATCH);
+            turbo_frames += TURBO_BATCH;
+        } while (monotonic_seconds() < deadline);
+    }
+    if (vm->audio)
+        chip8_audio_sync(vm->audio, vm->instructions, vm->instructions_per_frame);
+    if (export)
+        chip8_export_publish(export, vm);
+    if ((dirty = chip8_take_dirty_rows(vm)))
+        chip8_frames_publish(frames, vm->framebuffer, dirty);
+}
 
-    y &= 0x1F;
-    x &= 0x3F;
-    ptr = (y << 6) + x;
+// Emulation thread: paced by its own scheduler, so a slow present or a compositor stall on the main thread
+// never holds up emulated time.
+static void *emulation_main(void *arg) {
+    CHIP8SCHEDULER *scheduler = arg;
 
-    if ((height + y) > 32)
-        height = 32 - y;
-    
-    for (i = 0; i < height; ++i, ptr += 64) {
-        bits = chip8_mem_read(address + i);
+    while (__atomic_load_n(&running, __ATOMIC_ACQUIRE)) {
+        chip8_frame(scheduler);
+    }
+    return NULL;
+}
 
-        for (j = 0; (j < 8) && (x + j) < 64; ++j) {
-            if ((bits & (0x80 >> j))) {
-                framebuffer[ptr + j] ^= PIXEL_SET;
-                if (!framebuffer[ptr + j])
-                        collision = 1;
-            }
+// Runs the ROM without a window or audio device for either a fixed number of instructions or a
+// fixed number of frames, as fast as the host allows. Timers still tick once every frame's worth of
+// instructions so the ROM behaves exactly as it would in the window. With -X every frame is exported.
+// When the interpreter ran the ROM, the superinstruction hit rate follows the results.
+static void run_headless(uint64_t instructions) {
+    double start, elapsed;
+    uint64_t left, n;
+
+    start = monotonic_seconds();
+    if (!export) {
+        chip8_run(vm, instructions);
+    }
+    else {
+        for (left = instructions; left; left -= n) {
+            n = left < vm->instructions_per_frame ? left : vm->instructions_per_frame;
+            chip8_run(vm, n);
+            chip8_export_publish(export, vm);
         }
     }
-
-    return collision;
+    elapsed = monotonic_seconds() - start;
+    if (elapsed <= 0.0)
+        elapsed = 1e-9;
+
+    printf("Instructions:      %llu\n", (unsigned long long) instructions);
+    printf("Frames:            %llu\n", (unsigned long long) (instructions / vm->instructions_per_frame));
+    printf("Elapsed:           %.6f s\n", elapsed);
+    printf("Instructions/sec:  %.0f\n", instructions / elapsed);
+    printf("Frames/sec:        %.1f\n", (double) instructions / vm->instructions_per_frame / elapsed);
+    printf("Framebuffer hash:  %016llx\n", (unsigned long long) chip8_framebuffer_hash(vm));
+    if (vm->interpreted)
+        chip8_fused_report(vm, stdout);
 }
 
-static int chip8_load_rom(const char *filename) {
+// Prints the profile at exit, and writes it as JSON too if a file was given. Profiling builds only.
+static void report_profile(const char *filename) {
+#ifdef CHIP8_PROFILE
     FILE *fileptr;
-    int size;
 
-    chip8_mem_clear();
+    chip8_profile_report(vm->profile, stdout, 0);
+    if (!filename)
+        return;
+    if (!(fileptr = fopen(filename, "w"))) {
+        fprintf(stderr, "Could not create profile: %s\n", filename);
+        return;
+    }
+    chip8_profile_report(vm->profile, fileptr, 1);
+    fclose(fileptr);
+#else
+    if (filename)
+        fprintf(stderr, "Profiling is not built in, rebuild with make DEFINES=-DCHIP8_PROFILE\n");
+#endif
+}
 
-    if (!(fileptr = fopen(filename, "rb"))) {
-        fprintf(stderr, "Could not open ROM: %s\n", filename);
-        return -1;
+// Headless replay: feeds a recorded session back at full speed and checks that it ends on the framebuffer
+// it was recorded with.
+static int run_headless_replay(const char *filename) {
+    CHIP8RECORDING *replay;
+    double start, elapsed;
+    uint64_t instructions;
+    int mismatch;
+
+    if (!(replay = chip8_recording_read(filename)))
+        return 1;
+
+    start = monotonic_seconds();
+    if (chip8_replay(vm, replay)) {
+        fprintf(stderr, "Recording starts at instruction %llu, not %llu: load the state it was recorded from\n",
+                (unsigned long long) replay->start, (unsigned long long) vm->instructions);
+        chip8_recording_destroy(replay);
+        return 1;
     }
+    elapsed = monotonic_seconds() - start;
+    if (elapsed <= 0.0)
+        elapsed = 1e-9;
+    instructions = replay->end - replay->start;
+    mismatch = chip8_framebuffer_hash(vm) != replay->hash;
+
+    printf("Events:            %llu\n", (unsigned long long) replay->count);
+    printf("Instructions:      %llu\n", (unsigned long long) instructions);
+    printf("Elapsed:           %.6f s\n", elapsed);
+    printf("Instructions/sec:  %.0f\n", instructions / elapsed);
+    printf("Frames/sec:        %.1f\n", (double) instructions / replay->instructions_per_frame / elapsed);
+    printf("Framebuffer hash:  %016llx\n", (unsigned long long) chip8_framebuffer_hash(vm));
+    printf("Replay:            %s\n", mismatch ? "MISMATCH" : "ok");
+
+    chip8_recording_destroy(replay);
+    return mismatch;
+}
 
-    // Size of file
-    fseek(fileptr, 0, SEEK_END);
-    size = ftell(fileptr);
-    fseek(fileptr, 0, SEEK_SET);
+// Headless rewind check: runs frames one at a time, recording every one into a rewind buffer of the given
+// size, and reports what it costs. Then it goes back to the oldest frame still kept, runs forward again and
+// checks that it arrives at exactly the state it recorded last.
+static int run_headless_rewind(uint64_t frames, size_t bytes) {
+    static CHIP8STATE newest, replayed;
+    CHIP8REWIND *rewind;
+    double start, elapsed, record;
+    uint64_t frame, kept;
+
+    // Replaying needs at least one recorded frame to start from.
+    if (!frames) {
+        fprintf(stderr, "The run is shorter than one frame, nothing to rewind\n");
+        return 1;
+    }
+    if (!(rewind = chip8_rewind_create(bytes, REWIND_KEYFRAME_INTERVAL))) {
+        fprintf(stderr, "Could not create a rewind buffer of %zu bytes\n", bytes);
+        return 1;
+    }
 
-    if (size > MEMORY_SIZE - 0x200) {
-        fprintf(stderr, "ROM size too large, bailing out\n");
-        return -1;
+    record = 0.0;
+    start = monotonic_seconds();
+    for (frame = 0; frame < frames; ++frame) {
+        chip8_run(vm, vm->instructions_per_frame);
+        elapsed = monotonic_seconds();
+        chip8_save_state(vm, &newest);
+        if (chip8_rewind_push(rewind, &newest)) {
+            fprintf(stderr, "A single frame does not fit in %zu bytes\n", bytes);
+            chip8_rewind_destroy(rewind);
+            return 1;
+        }
+        record += monotonic_seconds() - elapsed;
+    }
+    elapsed = monotonic_seconds() - start;
+    kept = chip8_rewind_frames(rewind);
+    if (!kept || chip8_rewind_get(rewind, kept - 1, &replayed)) {
+        fprintf(stderr, "Could not read back the oldest frame\n");
+        chip8_rewind_destroy(rewind);
+        return 1;
     }
 
-    if (fread(mem + 0x200, 1, size, fileptr) != size) {
-        fprintf(stderr, "Could not read ROM\n");
-        return -1;
+    printf("Frames:            %llu\n", (unsigned long long) frames);
+    printf("Elapsed:           %.6f s\n", elapsed);
+    printf("Frames kept:       %llu (%.1f s)\n", (unsigned long long) kept, (double) kept / CHIP8_FRAME_RATE);
+    printf("Rewind bytes:      %zu of %zu\n", chip8_rewind_bytes(rewind), bytes);
+    printf("Bytes/frame:       %.1f (state is %zu)\n", (double) chip8_rewind_bytes(rewind) / kept,
+           sizeof(CHIP8STATE));
+    printf("Save+push:         %.0f ns/frame\n", record * 1e9 / frames);
+
+    start = monotonic_seconds();
+    chip8_load_state(vm, &replayed);
+    printf("Load:              %.0f ns\n", (monotonic_seconds() - start) * 1e9);
+    chip8_run(vm, (kept - 1) * vm->instructions_per_frame);
+    chip8_save_state(vm, &replayed);
+    printf("Framebuffer hash:  %016llx\n", (unsigned long long) chip8_framebuffer_hash(vm));
+    printf("Replay:            %s\n", memcmp(&newest, &replayed, sizeof(CHIP8STATE)) ? "MISMATCH" : "ok");
+
+    chip8_rewind_destroy(rewind);
+    return memcmp(&newest, &replayed, sizeof(CHIP8STATE)) != 0;
+}
+
+// A share of the instances run in lockstep, one batch per pool task.
+typedef struct {
+    CHIP8LOCKSTEP *ls;
+    uint64_t instructions;
+} LOCKSTEPTASK;
+
+static void run_lockstep_task(CHIP8POOL *pool, void *arg) {
+    LOCKSTEPTASK *task = arg;
+
+    chip8_lockstep_run(task->ls, task->instructions);
+}
+
+// Headless batch: loads the ROM into count independent instances and runs all of them for the same
+// number of instructions on a work-stealing pool. Every instance is deterministic, so they must all
+// end up with the same framebuffer; the report says so if they do not. With a seed, instance i is seeded
+// with seed + i instead, and they are free to differ. With lockstep the instances are split into one
+// lockstep batch per thread, each run as a single task.
+static int run_headless_batch(const char *filename, int count, int threads, int engine, int quirks,
+                              uint32_t frame_instructions, int fast_forward, uint64_t instructions,
+                              uint32_t seed, int lockstep) {
+    CHIP8OBJECT **vms;
+    CHIP8POOL *pool = NULL;
+    LOCKSTEPTASK *tasks = NULL;
+    double start, elapsed;
+    uint64_t hash, grouped = 0, separate = 0, a, b;
+    int i, batches = 0, mismatches = 0, result = 1;
+
+    if (!(vms = calloc(count, sizeof(CHIP8OBJECT *))))
+        return 1;
+    for (i = 0; i < count; ++i) {
+        if (!(vms[i] = chip8_create()) || chip8_load_rom(vms[i], filename)) {
+            fprintf(stderr, "Could not set up instance %d\n", i);
+            goto done;
+        }
+        chip8_reset(vms[i]);
+        if (seed)
+            chip8_seed(vms[i], seed + i);
+        chip8_set_quirks(vms[i], quirks);
+        chip8_set_engine(vms[i], engine);
+        chip8_set_frame_instructions(vms[i], frame_instructions);
+        chip8_set_fast_forward(vms[i], fast_forward);
+    }
+    if (!(pool = chip8_pool_create(threads))) {
+        fprintf(stderr, "Could not create thread pool\n");
+        goto done;
+    }
+    if (lockstep) {
+        batches = chip8_pool_threads(pool) < count ? chip8_pool_threads(pool) : count;
+        if (!(tasks = calloc(batches, sizeof(LOCKSTEPTASK)))) {
+            batches = 0;
+            goto done;
+        }
+        for (i = 0; i < batches; ++i) {
+            tasks[i].instructions = instructions;
+            if (!(tasks[i].ls = chip8_lockstep_create(vms + count * i / batches,
+                                                     count * (i + 1) / batches - count * i / batches))) {
+                fprintf(stderr, "Could not set up lockstep batch %d\n", i);
+                goto done;
+            }
+        }
     }
 
-    fclose(fileptr);
+    start = monotonic_seconds();
+    if (lockstep) {
+        for (i = 0; i < batches; ++i) {
+            chip8_pool_submit(pool, run_lockstep_task, &tasks[i]);
+        }
+        chip8_pool_wait(pool);
+    }
+    else {
+        chip8_pool_run(pool, vms, count, instructions);
+    }
+    elapsed = monotonic_seconds() - start;
+    if (elapsed <= 0.0)
+        elapsed = 1e-9;
+
+    hash = chip8_framebuffer_hash(vms[0]);
+    for (i = 1; i < count && !seed; ++i) {
+        if (chip8_framebuffer_hash(vms[i]) != hash)
+            ++mismatches;
+    }
 
-    memcpy(mem, font, 80);
-    memset(buttons, 0, 16);
-    chip8_clear_frame();
+    printf("Instances:         %d\n", count);
+    printf("Threads:           %d\n", chip8_pool_threads(pool));
+    printf("Instructions:      %llu per instance\n", (unsigned long long) instructions);
+    printf("Elapsed:           %.6f s\n", elapsed);
+    printf("Instructions/sec:  %.0f\n", (double) instructions * count / elapsed);
+    printf("Frames/sec:        %.1f\n", (double) instructions / frame_instructions * count / elapsed);
+    printf("Framebuffer hash:  %016llx%s\n", (unsigned long long) hash, seed ? " (first instance)" : "");
+    if (mismatches)
+        printf("Mismatching:       %d instances\n", mismatches);
+    for (i = 0; i < batches; ++i) {
+        chip8_lockstep_counts(tasks[i].ls, &a, &b);
+        grouped += a;
+        separate += b;
+    }
+    if (lockstep)
+        printf("Lockstep:          %.1f%% of instructions in %d batches\n",
+               grouped + separate ? 100.0 * grouped / (grouped + separate) : 0.0, batches);
+    result = mismatches != 0;
+
+done:
+    for (i = 0; i < batches; ++i) {
+        chip8_lockstep_destroy(tasks[i].ls);
+    }
+    free(tasks);
+    chip8_pool_destroy(pool);
+    for (i = 0; i < count; ++i) {
+        chip8_destroy(vms[i]);
+    }
+    free(vms);
+    return result;
+}
 
-    if (!romfn)
-        romfn = strdup(filename);
+// Crash signals write the trace as it is and then let the signal take its default course.
+static const int crash_signals[] = {SIGSEGV, SIGBUS, SIGILL, SIGFPE, SIGABRT};
 
-    return 0;
+static void crash_handler(int sig) {
+    chip8_trace_write(vm, trace_file);
+    raise(sig);
 }
 
-void chip8_mem_reset(void) {
-    memset(mem, 0, 4096);
-    chip8_load_rom(romfn);
-    delay_timer = 0;
-    sound_timer = 0;
+static void request_trace(int sig) {
+    __atomic_add_fetch(&trace_requests, 1, __ATOMIC_RELEASE);
 }
 
-static void draw_framebuffer(void) {
-    int i, j, ii;
-    uint32_t *pixels = (uint32_t *) screen->pixels;
+static int start_trace(void) {
+    struct sigaction action;
+    size_t i;
 
-    for (i = 0; i < 320; ++i) {
-        ii = i / 10;
-        for (j = 0; j < 640; ++j) {
-            pixels[i * 640 + j] = framebuffer[(ii * 64) + (j / 10)] | 0xff000000;
-        }
+    if (!(vm->trace = chip8_trace_create(TRACE_ENTRIES))) {
+        fprintf(stderr, "Could not allocate the trace\n");
+        return -1;
+    }
+    memset(&action, 0, sizeof(action));
+    sigemptyset(&action.sa_mask);
+    action.sa_handler = crash_handler;
+    action.sa_flags = SA_RESETHAND;
+    for (i = 0; i < sizeof(crash_signals) / sizeof(crash_signals[0]); ++i) {
+        sigaction(crash_signals[i], &action, NULL);
     }
+    action.sa_handler = request_trace;
+    action.sa_flags = SA_RESTART;
+    sigaction(SIGUSR1, &action, NULL);
+    return 0;
 }
 
-static void chip8_frame(void) {
-    int i;
-    SDL_Rect rect;
+// Writes the trace at exit and detaches it.
+static void finish_trace(void) {
+    size_t i;
 
-    for (i = 0; i < 12; ++i) {
-        chip8_execute_instruction();
+    if (!vm->trace)
+        return;
+    if (chip8_trace_write(vm, trace_file))
+        fprintf(stderr, "Could not write trace: %s\n", trace_file);
+    for (i = 0; i < sizeof(crash_signals) / sizeof(crash_signals[0]); ++i) {
+        signal(crash_signals[i], SIG_DFL);
     }
-    if (delay_timer)
-        --delay_timer;
-    if (sound_timer)
-        --sound_timer;
-    
-    SDL_LockSurface(screen);
-    draw_framebuffer();
-    SDL_UnlockSurface(screen);
-    SDL_Flip(screen);
-    SDL_Delay(15);
+    signal(SIGUSR1, SIG_DFL);
+    chip8_trace_destroy(vm->trace);
+    vm->trace = NULL;
 }
 
 #define SAMPLE_RATE 44100
 
+#define DEFAULT_AUDIO_SAMPLES 512
+
+// Runs on SDL's audio thread. It never touches the instance: the beeper gets the sound timer handed over
+// through chip8_audio_sound and chip8_audio_sync.
 void fill_audio(void *udata, Uint8 *stream, int len) {
-    static double phase = 0.0;
-    double increment = 2.0 * M_PI * BEEP_FREQUENCY / SAMPLE_RATE;
-    Sint16 *buffer = (Sint16 *)stream;
-    int length = len >> 1, i;
-
-    for(i = 0; i < length; ++i) {
-        if(sound_timer) {
-            buffer[i] = (Sint16)(BEEP_AMPLITUDE * sin(phase));
-            phase += increment;
-
-            if (phase >= 2.0 * M_PI)
-                phase -= 2.0 * M_PI;
-        }
-        else {
-            buffer[i] = 0;
-            phase = 0;
-        }
-    }
+    chip8_audio_render(udata, (int16_t *) stream, len >> 1);
 }
 
-static int handle_keypress(SDLKey key, int pressed) {
+static void set_key(uint8_t key, int pressed) {
+    if (pressed)
+        __atomic_fetch_or(&held_keys, 1u << key, __ATOMIC_RELEASE);
+    else
+        __atomic_fetch_and(&held_keys, ~(1u << key), __ATOMIC_RELEASE);
+}
+
+static void handle_keypress(SDLKey key, int pressed) {
     static int in_reset;
     switch(key) {
         case SDLK_ESCAPE:
             if (pressed && !in_reset) {
-                chip8_reset();
+                __atomic_add_fetch(&reset_requests, 1, __ATOMIC_RELEASE);
                 in_reset = 1;
             }
             else if (!pressed) {
                 in_reset = 0;
             }
             break;
+        case SDLK_TAB:
+            if (pressed) {
+                __atomic_store_n(&turbo, !__atomic_load_n(&turbo, __ATOMIC_RELAXED), __ATOMIC_RELAXED);
+                SDL_WM_SetCaption(__atomic_load_n(&turbo, __ATOMIC_RELAXED) ? "CHIP-8 (turbo)" : "CHIP-8", NULL);
+            }
+            break;
+        case SDLK_BACKSPACE:
+            __atomic_store_n(&rewinding, pressed, __ATOMIC_RELAXED);
+            break;
+        case SDLK_F12:
+            if (pressed)
+                __atomic_add_fetch(&trace_requests, 1, __ATOMIC_RELEASE);
+            break;
         case SDLK_1:
-            buttons[keymap[0]] = pressed;
+            set_key(keymap[0], pressed);
             break;
         case SDLK_2:
-            buttons[keymap[1]] = pressed;
+            set_key(keymap[1], pressed);
             break;
         case SDLK_3:
-            buttons[keymap[2]] = pressed;
+            set_key(keymap[2], pressed);
             break;
         case SDLK_4:
-            buttons[keymap[3]] = pressed;
+            set_key(keymap[3], pressed);
             break;
         case SDLK_q:
-            buttons[keymap[4]] = pressed;
+            set_key(keymap[4], pressed);
             break;
         case SDLK_w:
-            buttons[keymap[5]] = pressed;
+            set_key(keymap[5], pressed);
             break;
         case SDLK_e:
-            buttons[keymap[6]] = pressed;
+            set_key(keymap[6], pressed);
             break;
         case SDLK_r:
-            buttons[keymap[7]] = pressed;
+            set_key(keymap[7], pressed);
             break;
         case SDLK_a:
-            buttons[keymap[8]] = pressed;
+            set_key(keymap[8], pressed);
             break;
         case SDLK_s:
-            buttons[keymap[9]] = pressed;
+            set_key(keymap[9], pressed);
             break;
         case SDLK_d:
-            buttons[keymap[10]] = pressed;
+            set_key(keymap[10], pressed);
             break;
         case SDLK_f:
-            buttons[keymap[11]] = pressed;
+            set_key(keymap[11], pressed);
             break;
         case SDLK_z:
-            buttons[keymap[12]] = pressed;
+            set_key(keymap[12], pressed);
             break;
         case SDLK_x:
-            buttons[keymap[13]] = pressed;
+            set_key(keymap[13], pressed);
             break;
         case SDLK_c:
-            buttons[keymap[14]] = pressed;
+            set_key(keymap[14], pressed);
             break;
         case SDLK_v:
-            buttons[keymap[15]] = pressed;
+            set_key(keymap[15], pressed);
             break;
     }
 }
 
 int main(int argc, char *argv[]) {
     SDL_Event ev;
-    int running = 1, i, mute = 0;
+    int i, mute = 0, headless = 0, instances = 1, threads = 0, lockstep = 0, engine = CHIP8_DEFAULT_ENGINE;
+    int quirks = CHIP8_QUIRKS_DEFAULT;
+    int result = 0;
+    const char *load_file = NULL, *save_file = NULL, *record_file = NULL, *replay_file = NULL;
+    const char *profile_file = NULL, *export_name = NULL;
+    uint32_t seed = 0;
+    int rewind_enabled = 1, fast_forward = 1;
+    size_t rewind_bytes = 0;
+    uint64_t max_instructions = 0, max_frames = 0;
+    uint32_t speed = INSTRUCTIONS_PER_FRAME * CHIP8_FRAME_RATE, frame_instructions;
+    uint32_t audio_samples = DEFAULT_AUDIO_SAMPLES;
+    CHIP8SCHEDULER scheduler, display;
+    pthread_t emulator;
+    const uint64_t *framebuffer;
+    uint32_t dirty;
     SDL_AudioSpec audio_desired;
     SDL_AudioSpec audio_obtained;
 
@@ -301,10 +637,48 @@ int main(int argc, char *argv[]) {
         printf("Usage: %s [options] romfilename\n", argv[0]);
         printf("Options:\n");
         printf("  -m    - Mute sounds\n");
+        printf("  -I    - Run with the function pointer interpreter\n");
+        printf("  -T    - Run with the threaded interpreter (computed goto)\n");
+        printf("  -J    - Run with the x86-64 recompiler (falls back to the interpreter elsewhere)\n");
+        printf("  -A    - Run the ROM's ahead-of-time translation, if one is linked in (make aot ROM=file)\n");
+        printf("  -i N  - CPU speed in instructions per second, rounded to a multiple of %d (default %d)\n",
+               CHIP8_FRAME_RATE, INSTRUCTIONS_PER_FRAME * CHIP8_FRAME_RATE);
+        printf("  -b N  - Audio buffer size in samples, a power of two (default %d)\n", DEFAULT_AUDIO_SAMPLES);
+        printf("  -s N  - Scale the 64x32 display N times (1 to %d, default 10)\n", CHIP8_SCALE_MAX);
+        printf("  -p P  - Colour palette:");
+        for (palette = chip8_palettes(); palette->name; ++palette) {
+            printf(" %s", palette->name);
+        }
+        printf(" (default classic)\n");
+        printf("  -q Q  - Quirk profile:");
+        for (i = 0; i < CHIP8_QUIRKS_COUNT; ++i) {
+            printf(" %s", chip8_quirks_name(i));
+        }
+        printf(" (default %s)\n", chip8_quirks_name(CHIP8_QUIRKS_DEFAULT));
+        printf("  -L F  - Load the save state in file F after start up\n");
+        printf("  -S F  - Write a save state to file F at exit\n");
+        printf("  -x N  - Seed the random number generator with N\n");
+        printf("  -E F  - Record key presses and resets to file F\n");
+        printf("  -P F  - Headless: replay the recording in file F at full speed\n");
+        printf("  -t N  - Start in turbo at N times normal speed, 0 for as fast as the host allows (Tab toggles)\n");
+        printf("  -X S  - Publish every frame to the shared memory object S (e.g. /chip8) for chip8-watch\n");
+        printf("  -o F  - Write the profile as JSON to file F (builds with -DCHIP8_PROFILE)\n");
+        printf("  -D F  - Trace the last %u instructions on the interpreter; write the trace to file F at exit,\n"
+               "          on a crash, on F12 or on SIGUSR1 (read it with chip8-tracedump)\n", TRACE_ENTRIES);
+        printf("  -R    - Disable rewind (hold Backspace to run the game backwards)\n");
+        printf("  -F    - Run busy-wait loops instruction by instruction instead of skipping them\n");
+        printf("  -H    - Headless: run at full speed without video or audio and report throughput\n");
+        printf("  -n N  - Headless: stop after N instructions\n");
+        printf("  -f N  - Headless: stop after N frames (default 3600)\n");
+        printf("  -N N  - Headless: run N independent instances of the ROM at once\n");
+        printf("  -j N  - Headless: worker threads for -N (default: one per core)\n");
+        printf("  -l    - Headless: run the -N instances in lockstep batches; with -x N, instance i is seeded N + i\n");
+        printf("  -r N  - Rewind buffer in MB (default 4); headless: record every frame, then replay from the oldest\n");
         return 1;
     }
 
     memcpy(keymap, keymap_cosmac, 16);
+    palette = chip8_palettes();
 
     if (argc > 2) {
         for (i = 1; i < argc - 1; ++i) {
@@ -312,36 +686,205 @@ int main(int argc, char *argv[]) {
                 printf("Muting sound\n");
                 mute = 1;
             }
+            else if (!strcmp(argv[i], "-I")) {
+                engine = CHIP8_ENGINE_INTERPRETER;
+            }
+            else if (!strcmp(argv[i], "-T")) {
+                engine = CHIP8_ENGINE_THREADED;
+            }
+            else if (!strcmp(argv[i], "-J")) {
+                engine = CHIP8_ENGINE_JIT;
+            }
+            else if (!strcmp(argv[i], "-A")) {
+                engine = CHIP8_ENGINE_AOT;
+            }
+            else if (!strcmp(argv[i], "-F")) {
+                fast_forward = 0;
+            }
+            else if (!strcmp(argv[i], "-H")) {
+                headless = 1;
+            }
+            else if (!strcmp(argv[i], "-n") && i + 1 < argc - 1) {
+                max_instructions = strtoull(argv[++i], NULL, 0);
+            }
+            else if (!strcmp(argv[i], "-f") && i + 1 < argc - 1) {
+                max_frames = strtoull(argv[++i], NULL, 0);
+            }
+            else if (!strcmp(argv[i], "-i") && i + 1 < argc - 1) {
+                speed = strtoul(argv[++i], NULL, 0);
+            }
+            else if (!strcmp(argv[i], "-b") && i + 1 < argc - 1) {
+                audio_samples = strtoul(argv[++i], NULL, 0);
+                if (audio_samples < 16 || audio_samples > 8192 || (audio_samples & (audio_samples - 1))) {
+                    fprintf(stderr, "Audio buffer must be a power of two from 16 to 8192, using %d\n",
+                            DEFAULT_AUDIO_SAMPLES);
+                    audio_samples = DEFAULT_AUDIO_SAMPLES;
+                }
+            }
+            else if (!strcmp(argv[i], "-s") && i + 1 < argc - 1) {
+                scale = atoi(argv[++i]);
+                if (scale < 1 || scale > CHIP8_SCALE_MAX) {
+                    fprintf(stderr, "Scale must be between 1 and %d, using 10\n", CHIP8_SCALE_MAX);
+                    scale = 10;
+                }
+            }
+            else if (!strcmp(argv[i], "-p") && i + 1 < argc - 1) {
+                if (!(palette = chip8_find_palette(argv[++i]))) {
+                    fprintf(stderr, "Unknown palette %s, using classic\n", argv[i]);
+                    palette = chip8_palettes();
+                }
+            }
+            else if (!strcmp(argv[i], "-q") && i + 1 < argc - 1) {
+                if ((quirks = chip8_find_quirks(argv[++i])) < 0) {
+                    fprintf(stderr, "Unknown quirk profile %s, using %s\n", argv[i],
+                            chip8_quirks_name(CHIP8_QUIRKS_DEFAULT));
+                    quirks = CHIP8_QUIRKS_DEFAULT;
+                }
+            }
+            else if (!strcmp(argv[i], "-L") && i + 1 < argc - 1) {
+                load_file = argv[++i];
+            }
+            else if (!strcmp(argv[i], "-S") && i + 1 < argc - 1) {
+                save_file = argv[++i];
+            }
+            else if (!strcmp(argv[i], "-x") && i + 1 < argc - 1) {
+                seed = strtoul(argv[++i], NULL, 0);
+            }
+            else if (!strcmp(argv[i], "-E") && i + 1 < argc - 1) {
+                record_file = argv[++i];
+            }
+            else if (!strcmp(argv[i], "-P") && i + 1 < argc - 1) {
+                replay_file = argv[++i];
+                headless = 1;
+            }
+            else if (!strcmp(argv[i], "-t") && i + 1 < argc - 1) {
+                turbo_rate = strtoul(argv[++i], NULL, 0);
+                turbo = 1;
+            }
+            else if (!strcmp(argv[i], "-X") && i + 1 < argc - 1) {
+                export_name = argv[++i];
+            }
+            else if (!strcmp(argv[i], "-o") && i + 1 < argc - 1) {
+                profile_file = argv[++i];
+            }
+            else if (!strcmp(argv[i], "-D") && i + 1 < argc - 1) {
+                trace_file = argv[++i];
+            }
+            else if (!strcmp(argv[i], "-R")) {
+                rewind_enabled = 0;
+            }
+            else if (!strcmp(argv[i], "-r") && i + 1 < argc - 1) {
+                rewind_bytes = (size_t) strtoul(argv[++i], NULL, 0) << 20;
+            }
+            else if (!strcmp(argv[i], "-N") && i + 1 < argc - 1) {
+                instances = atoi(argv[++i]);
+            }
+            else if (!strcmp(argv[i], "-j") && i + 1 < argc - 1) {
+                threads = atoi(argv[++i]);
+            }
+            else if (!strcmp(argv[i], "-l")) {
+                lockstep = 1;
+            }
             else {
                 fprintf(stderr, "Unknown option %s, ignoring\n", argv[i]);
             }
         }
     }
 
+    // The timers tick at exactly CHIP8_FRAME_RATE per emulated second, so the speed is a whole number of
+    // instructions per frame.
+    frame_instructions = (speed + CHIP8_FRAME_RATE / 2) / CHIP8_FRAME_RATE;
+    if (!frame_instructions)
+        frame_instructions = 1;
+    if (frame_instructions * CHIP8_FRAME_RATE != speed)
+        fprintf(stderr, "Running at %u instructions per second\n", frame_instructions * CHIP8_FRAME_RATE);
+
+    if (headless) {
+        if (!max_instructions)
+            max_instructions = (max_frames ? max_frames : 3600) * frame_instructions;
+        if (instances > 1 || threads > 0 || lockstep) {
+            // The batch runs its own instances and none of the single instance's files or rewind.
+            if (load_file || save_file || record_file || replay_file || export_name || profile_file ||
+                trace_file || rewind_bytes) {
+                fprintf(stderr, "-L, -S, -E, -P, -X, -o, -D and -r cannot be used with -N, -j or -l\n");
+                return 1;
+            }
+            return run_headless_batch(argv[argc - 1], instances > 0 ? instances : 1, threads, engine, quirks,
+                                      frame_instructions, fast_forward, max_instructions, seed, lockstep);
+        }
+    }
+
     // Preparing the emulator for a CHIP-8 program
-    if (chip8_load_rom(argv[argc - 1]))
+    if (!(vm = chip8_create()))
+        return 1;
+    if (chip8_load_rom(vm, argv[argc - 1]))
         return 1;
     
-    chip8_init();
-    chip8_reset();
+    chip8_init(vm);
+    chip8_reset(vm);
+    if (seed)
+        chip8_seed(vm, seed);
+    chip8_set_quirks(vm, quirks);
+    chip8_set_frame_instructions(vm, frame_instructions);
+    chip8_set_fast_forward(vm, fast_forward);
+    if (chip8_set_engine(vm, engine) != engine && engine == CHIP8_ENGINE_AOT)
+        fprintf(stderr, "No ahead-of-time translation of this ROM is linked in, using the interpreter\n");
+    else if (vm->engine != engine)
+        fprintf(stderr, "Requested engine not available on this host, using the interpreter\n");
+    if (load_file && (chip8_read_state(&state, load_file) || chip8_load_state(vm, &state)))
+        return 1;
+    if (export_name && !(export = chip8_export_create(export_name, vm)))
+        return 1;
+    if (trace_file && start_trace())
+        return 1;
+
+    if (headless) {
+        if (replay_file)
+            result = run_headless_replay(replay_file);
+        else if (rewind_bytes)
+            result = run_headless_rewind(max_instructions / vm->instructions_per_frame, rewind_bytes);
+        else
+            run_headless(max_instructions);
+        if (save_file) {
+            chip8_save_state(vm, &state);
+            result |= chip8_write_state(&state, save_file) != 0;
+        }
+        report_profile(profile_file);
+        finish_trace();
+        chip8_export_destroy(export);
+        chip8_destroy(vm);
+        return result;
+    }
+
+    if (record_file && !(recording = chip8_recording_create(vm)))
+        return 1;
+    if (rewind_enabled && !(history = chip8_rewind_create(rewind_bytes ? rewind_bytes : REWIND_BYTES,
+                                                          REWIND_KEYFRAME_INTERVAL)))
+        fprintf(stderr, "Could not allocate the rewind buffer, rewind disabled\n");
 
     SDL_Init(SDL_INIT_VIDEO | SDL_INIT_AUDIO);
 
     // Video set up
-    if (!(screen = SDL_SetVideoMode(640, 320, 32, SDL_SWSURFACE))) {
+    if (!(screen = SDL_SetVideoMode(64 * scale, 32 * scale, 32, SDL_SWSURFACE))) {
         fprintf(stderr, "Failed to set up SDL video mode, exiting \n");
         return 1;
     }
 
-    SDL_WM_SetCaption("CHIP-8", NULL);
+    SDL_WM_SetCaption(turbo ? "CHIP-8 (turbo)" : "CHIP-8", NULL);
+    vm->dirty_rows = 0xffffffff;
 
     // Sound set up
     if (!mute) {
         audio_desired.freq = SAMPLE_RATE;
         audio_desired.format = AUDIO_S16SYS;
         audio_desired.channels = 1;
-        audio_desired.samples = 2048;
+        audio_desired.samples = audio_samples;
         audio_desired.callback = &fill_audio;
+        if (!(audio_desired.userdata = vm->audio = chip8_audio_create(SAMPLE_RATE, audio_samples, BEEP_FREQUENCY,
+                                                                      BEEP_AMPLITUDE))) {
+            fprintf(stderr, "Failed to set up audio: out of memory\n");
+            return -1;
+        }
 
         if (SDL_OpenAudio(&audio_desired, &audio_obtained) < 0) {
             fprintf(stderr, "Failed to set up audio: %s\n", SDL_GetError());
@@ -351,9 +894,22 @@ int main(int argc, char *argv[]) {
         SDL_PauseAudio(0);
     }
 
-    // Running the emulator
+    // Running the emulator on its own thread. This one presents the newest finished frame at the same rate;
+    // when it falls behind it skips frames, not emulation.
+    if (!(frames = chip8_frames_create())) {
+        fprintf(stderr, "Failed to set up the frame buffers: out of memory\n");
+        return 1;
+    }
+    chip8_scheduler_init(&scheduler, CHIP8_FRAME_RATE);
+    chip8_scheduler_init(&display, CHIP8_FRAME_RATE);
+    if (pthread_create(&emulator, NULL, emulation_main, &scheduler)) {
+        fprintf(stderr, "Failed to start the emulation thread\n");
+        return 1;
+    }
     while (running) {
-        chip8_frame();
+        chip8_scheduler_wait(&display);
+        if ((framebuffer = chip8_frames_take(frames, &dirty)))
+            draw_framebuffer(framebuffer, dirty);
         while (SDL_PollEvent(&ev)) {
             if (ev.type == SDL_KEYDOWN) {
                 handle_keypress(ev.key.keysym.sym, 1);
@@ -363,14 +919,34 @@ int main(int argc, char *argv[]) {
             }
             else if (ev.type == SDL_QUIT) {
                 printf("Got quit signal, exiting.\n");
-                running = 0;
+                __atomic_store_n(&running, 0, __ATOMIC_RELEASE);
                 break;
             }
         }
     }
-    chip8_shutdown();
-    if (!mute)
+    pthread_join(emulator, NULL);
+    chip8_frames_destroy(frames);
+    chip8_scheduler_report(&scheduler, stdout);
+    if (turbo_frames)
+        printf("Turbo:             %llu extra frames\n", (unsigned long long) turbo_frames);
+    report_profile(profile_file);
+    if (save_file) {
+        chip8_save_state(vm, &state);
+        chip8_write_state(&state, save_file);
+    }
+    chip8_rewind_destroy(history);
+    chip8_export_destroy(export);
+    finish_trace();
+    if (recording) {
+        chip8_recording_write(recording, vm, record_file);
+        chip8_recording_destroy(recording);
+    }
+    if (!mute) {
         SDL_CloseAudio();
+        chip8_audio_destroy(vm->audio);
+        vm->audio = NULL;
+    }
+    chip8_destroy(vm);
     SDL_Quit();
     return 0;
 }
\ No newline at end of file